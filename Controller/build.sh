@@ -1,4 +1,7 @@
 #!/bin/bash
+# Usage: build.sh [atmega328p|atmega2560]
+# The ATmega328P is the PWM controller, the ATmega2560 adds the DCC command station.
+MCU="${1:-atmega328p}"
 CC="avr-gcc"
 SRC="main.c"
 SRC+=" buffers.c"
@@ -10,19 +13,49 @@ SRC+=" log.c"
 SRC+=" serial_console.c"
 SRC+=" serial.c"
 SRC+=" timer.c"
+SRC+=" adc.c"
 SRC+=" input_driver.c"
 SRC+=" pwm_driver.c"
 SRC+=" led_driver.c"
 SRC+=" locomotive_settings.c"
 SRC+=" curves.c"
-DEF="-D__AVR_ATmega328P__"
-OPTS="-mmcu=atmega328p -Os -Wall -Waddr-space-convert"
-OUT="controller"
+SRC+=" dcc/bdp.c"
+SRC+=" dcc/bdp_console.c"
+INC="-I. -I../include"
+
+case "${MCU}" in
+atmega328p)
+  DEF="-D__AVR_ATmega328P__"
+  OUT="controller"
+  ;;
+atmega2560)
+  DEF="-D__AVR_ATmega2560__"
+  OUT="controller_dcc"
+  SRC+=" serial1.c"
+  SRC+=" dcc/dcc.c"
+  SRC+=" dcc/dcc_packet.c"
+  SRC+=" dcc/dcc_refresh.c"
+  SRC+=" dcc/dcc_pom.c"
+  SRC+=" dcc/dcc_railcom.c"
+  SRC+=" dcc/dcc_service_mode.c"
+  SRC+=" dcc/dcc_service_auto.c"
+  SRC+=" dcc/dcc_cv_jobs.c"
+  SRC+=" dcc/dcc_cv_backup.c"
+  SRC+=" dcc/dcc_commands.c"
+  SRC+=" dcc/current_sense.c"
+  ;;
+*)
+  echo "Unknown MCU ${MCU}, use atmega328p or atmega2560"
+  exit 1
+  ;;
+esac
+
+OPTS="-mmcu=${MCU} -Os -Wall -Waddr-space-convert"
 
 # Compile into build directory
 cd src
 mkdir -p ../build
-${CC} ${OPTS} ${DEF} -o ../build/${OUT}.elf ${SRC}
+${CC} ${OPTS} ${DEF} ${INC} -o ../build/${OUT}.elf ${SRC} || exit 1
 cd ..
 
 # Post-build steps
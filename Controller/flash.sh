@@ -1,10 +1,21 @@
 #!/bin/bash
+# Usage: flash.sh [atmega328p|atmega2560], build with the same MCU first
+MCU="${1:-atmega328p}"
 
-OUT="controller"
-HEX="build/${OUT}.hex"
+case "${MCU}" in
+atmega2560)
+  OUT="controller_dcc"
+  # Arduino Mega
+  avrdude -v -p atmega2560 -c wiring -P /dev/ttyACM0 -b 115200 -D -U flash:w:build/${OUT}.hex:i
+  ;;
+*)
+  OUT="controller"
+  HEX="build/${OUT}.hex"
 
-# Arduino UNO
-# avrdude -v -p atmega328p -c arduino -P /dev/ttyACM0 -b 115200 -U flash:w:build/${OUT}.hex:i
+  # Arduino UNO
+  # avrdude -v -p atmega328p -c arduino -P /dev/ttyACM0 -b 115200 -U flash:w:build/${OUT}.hex:i
 
-# Arduino as ISP
-avrdude -v -p atmega328p -c stk500v1 -P /dev/ttyACM0 -b 19200 -U flash:w:build/${OUT}.hex:i
\ No newline at end of file
+  # Arduino as ISP
+  avrdude -v -p atmega328p -c stk500v1 -P /dev/ttyACM0 -b 19200 -U flash:w:build/${OUT}.hex:i
+  ;;
+esac
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+typedef void (*serial1_receive_callback_t)(uint8_t data);
+
 void serial1_initialize(void);
 
 bool serial1_send_byte(uint8_t data);
@@ -14,4 +16,10 @@ uint8_t serial1_read(uint8_t *data, uint8_t maxLength);
 
 bool serial1_read_has_overflowed(void);
 
-#endif /* SERIAL_H_ */
\ No newline at end of file
+// Enables or disables the receiver, bytes arriving while it is disabled are ignored
+void serial1_set_receive_enabled(bool enabled);
+
+// Sets a callback that is invoked from the receive interrupt for every byte instead of buffering it. May be NULL.
+void serial1_set_receive_callback(serial1_receive_callback_t callback);
+
+#endif /* SERIAL1_H_ */
\ No newline at end of file
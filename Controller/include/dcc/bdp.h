@@ -3,13 +3,29 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
 
 #define BDP_CRC_LENGTH      (2)       // We use CRC-16-XMODEM, so 2 bytes
 
 #define BDP_CRC_INIT    (0x0000)
 #define BDP_CRC_CHECK   (0x0000)
 
-#define BDP_LAST_RESPONSE_SIZE    (64)
+#define BDP_LAST_RESPONSE_SIZE    (64)      // Per window slot
+
+// Commands a host can have in flight. Window sizes are powers of two so the slots stay put when the sequence number wraps.
+#ifndef BDP_MAX_WINDOW_SIZE
+#define BDP_MAX_WINDOW_SIZE       (4)
+#endif
+
+// CRC implementations, all give the same result. The avr-libc routine goes bit by bit, the tables live in flash.
+#define BDP_CRC_BITWISE           (0)
+#define BDP_CRC_NIBBLE_TABLE      (1)     // 32 bytes of flash, two lookups per byte
+#define BDP_CRC_BYTE_TABLE        (2)     // 512 bytes of flash, one lookup per byte
+
+#ifndef BDP_CRC_METHOD
+#define BDP_CRC_METHOD            BDP_CRC_BYTE_TABLE
+#endif
 
 typedef enum
 {
@@ -17,6 +33,7 @@ typedef enum
   BDP_FLAG_COMMAND = 1,
   BDP_FLAG_DO_NOT_RESPOND = 2,
   BDP_FLAG_RESET = 4,
+  BDP_FLAG_EVENT = 8,       // Sent by the device on its own, not a response. The sequence number counts the events.
 } bdp_flags_t;
 
 typedef struct __attribute__((packed))
@@ -26,29 +43,86 @@ typedef struct __attribute__((packed))
   uint8_t dataLength;
 } bdp_header_t;
 
+// Response data that fits in a window slot next to the header and CRC
+#define BDP_MAX_RESPONSE_DATA     (BDP_LAST_RESPONSE_SIZE - sizeof(bdp_header_t) - BDP_CRC_LENGTH)
+
 typedef bool (*bdp_transmit_t)(const uint8_t *data, uint16_t size);
 
 typedef bool (*bdp_handle_command_t)(const bdp_header_t *header);
 
-typedef struct  
+typedef enum
 {
-  uint8_t lastRxSeqNumber;
-  bdp_transmit_t txFunction; 
+  BDP_SLOT_EMPTY,
+  BDP_SLOT_PENDING,         // Command was passed to the handler, no response yet
+  BDP_SLOT_DONE,
+} bdp_slot_state_t;
+
+// Remembers one command in the window so a repeat is answered from the cache instead of running it again
+typedef struct
+{
+  uint8_t state;
+  uint8_t seqNumber;
+  uint8_t responseSize;     // 0 when the command did not get a response
+  uint8_t response[BDP_LAST_RESPONSE_SIZE];
+} bdp_window_slot_t;
+
+typedef struct
+{
+  bdp_transmit_t txFunction;
   bdp_handle_command_t handlerFunction;
-  uint8_t lastTransmittedResponseSize;
-  uint8_t lastTransmittedResponse[BDP_LAST_RESPONSE_SIZE];
+  uint8_t windowMask;       // Window size - 1
+  bool hasRxSeqNumber;
+  uint8_t highestRxSeqNumber;
+  bdp_window_slot_t window[BDP_MAX_WINDOW_SIZE];
 } bdp_port_t;
 
 typedef enum
 {
   BDP_RESULT_OK = 0,
   BDP_RESULT_UNKNOWN_COMMAND = 1,
+  BDP_RESULT_INVALID_ARGUMENT = 2,
+  BDP_RESULT_FAILED = 3,          // Valid command that could not be carried out right now, such as a full queue
 } bdp_result_code_t;
 
+#if BDP_CRC_METHOD == BDP_CRC_BYTE_TABLE
+extern const uint16_t bdp_crc_table[256] PROGMEM;
+#elif BDP_CRC_METHOD == BDP_CRC_NIBBLE_TABLE
+extern const uint16_t bdp_crc_table[16] PROGMEM;
+#endif
+
+// Adds one byte to a running CRC, inline so framers can update it while they move the byte anyway
+static inline uint16_t bdp_crc_update(uint16_t crc, uint8_t data)
+{
+#if BDP_CRC_METHOD == BDP_CRC_BYTE_TABLE
+  return (crc << 8) ^ pgm_read_word(&bdp_crc_table[(uint8_t)(crc >> 8) ^ data]);
+#elif BDP_CRC_METHOD == BDP_CRC_NIBBLE_TABLE
+  crc = (crc << 4) ^ pgm_read_word(&bdp_crc_table[(crc >> 12) ^ (data >> 4)]);
+  return (crc << 4) ^ pgm_read_word(&bdp_crc_table[(crc >> 12) ^ (data & 0x0F)]);
+#else
+  return _crc_xmodem_update(crc, data);
+#endif
+}
+
 void bdp_port_initialize(bdp_port_t *port, bdp_transmit_t txFunction, bdp_handle_command_t handlerFunction);
 
+// Sets how many commands may be outstanding, a power of two up to BDP_MAX_WINDOW_SIZE. Forgets all cached responses.
+// A window of 1 behaves like a stop and wait link, which is also the default.
+bool bdp_port_set_window_size(bdp_port_t *port, uint8_t size);
+
+uint8_t bdp_port_get_window_size(const bdp_port_t *port);
+
 bool bdp_port_received_command(bdp_port_t *port, const uint8_t *data, uint16_t dataLength);
 
+// Same as bdp_port_received_command, for callers that ran bdp_crc_update over all of the data while it came in.
+// The frame is then checked without going over it again.
+bool bdp_port_received_command_crc(bdp_port_t *port, const uint8_t *data, uint16_t dataLength, uint16_t crc);
+
+// Gets the place in the window slot where the response to seqNumber goes, room for BDP_MAX_RESPONSE_DATA bytes.
+// Handlers can build their response there and pass it to bdp_port_transmit_response without it being copied.
+// Returns NULL when the slot belongs to another command.
+uint8_t *bdp_port_begin_response(bdp_port_t *port, uint8_t seqNumber);
+
+// Adds the header and CRC to the response and transmits it. The data is copied into the window slot unless it is already there.
 bool bdp_port_transmit_response(bdp_port_t *port, uint8_t seqNumber, const uint8_t *data, uint16_t dataLength);
 
 
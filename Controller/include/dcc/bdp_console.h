@@ -0,0 +1,63 @@
+#ifndef BDP_CONSOLE_H_
+#define BDP_CONSOLE_H_
+
+#include "dcc/bdp.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Frames are SLIP encoded and start and end with BDP_CONSOLE_END. Text never contains these bytes,
+// so anything outside a frame goes to the text console.
+#define BDP_CONSOLE_END         (0xC0)
+#define BDP_CONSOLE_ESC         (0xDB)
+#define BDP_CONSOLE_ESC_END     (0xDC)
+#define BDP_CONSOLE_ESC_ESC     (0xDD)
+
+#define BDP_CONSOLE_MAX_FRAME   (BDP_LAST_RESPONSE_SIZE)
+
+// Room for handler results, the response starts with the result code
+#define BDP_CONSOLE_MAX_RESPONSE_DATA   (BDP_MAX_RESPONSE_DATA - 1)
+
+// Transmit buffer room an event with length bytes of data needs, when every byte has to be escaped
+#define BDP_CONSOLE_EVENT_SIZE(length)  (2 * (sizeof(bdp_header_t) + 1 + (length) + BDP_CRC_LENGTH) + 2)
+
+// A command payload is the opcode followed by its arguments, a response payload is a bdp_result_code_t followed by the results.
+// Values of more than one byte are big endian.
+typedef enum
+{
+  BDP_OPCODE_PING = 0x00,                 // No arguments or results
+  BDP_OPCODE_WINDOW = 0x01,               // [size], results [size] [max size]. Omit the argument to get the window. Send it with the reset flag.
+  BDP_OPCODE_PC_CONTROL = 0x10,           // [on], results [on]. Omit the argument to get the state.
+  BDP_OPCODE_THROTTLE = 0x11,             // [direction: 0 stop, 1 forwards, 2 reverse] [speed]
+  BDP_OPCODE_THROTTLE_GET = 0x12,         // Results [pc control] [pc speed hi] [pc speed lo] [input throttle hi] [input throttle lo] [input direction, -1 to 1]
+  BDP_OPCODE_DCC_SEND = 0x20,             // [packet bytes including the error detection byte], results [message id]
+  BDP_OPCODE_DCC_LOCO_SPEED = 0x21,       // [address hi] [address lo] [speed 0-126] [forward]
+  BDP_OPCODE_DCC_EMERGENCY_STOP = 0x22,   // No arguments
+  BDP_OPCODE_DCC_CURRENT = 0x23,          // [on], results [on]. Omit the argument to get the state. While on, every block of
+                                          // current samples comes as an event with this opcode, see DCC+CUR for the format.
+  BDP_OPCODE_PROFILE_GET = 0x30,          // [index], results [vMin] [vMid] [vMax] [acc] [dec] [boostPower]
+  BDP_OPCODE_PROFILE_SET = 0x31,          // [index] [vMin] [vMid] [vMax] [acc] [dec] [boostPower]
+  BDP_OPCODE_PROFILE_ACTIVE = 0x32,       // [index], results [index]. Omit the argument to get the active profile.
+} bdp_opcode_id_t;
+
+// Handles one opcode. Results go to response, which is the window slot the response is sent from.
+// There is room for BDP_CONSOLE_MAX_RESPONSE_DATA bytes and responseLength starts at 0.
+typedef bdp_result_code_t (*bdp_opcode_handler_t)(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+
+typedef struct
+{
+  uint8_t opcode;
+  bdp_opcode_handler_t handler;
+} bdp_opcode_t;
+
+void bdp_console_initialize(void);
+
+void bdp_console_register(const bdp_opcode_t *opcode);
+
+// Call this from the main loop instead of serial_console_poll, it reads the serial port for both consoles
+void bdp_console_poll(void);
+
+// Sends a frame the host did not ask for, flagged BDP_FLAG_EVENT. The payload is the opcode followed by the data.
+// Returns false when the frame does not fit in the transmit buffer right now, nothing is sent then.
+bool bdp_console_send_event(uint8_t opcode, const uint8_t *data, uint8_t length);
+
+#endif /* BDP_CONSOLE_H_ */
@@ -2,6 +2,40 @@
 #define CURRENT_SENSE_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+
+// Output samples kept for telemetry, one every millisecond at a decimation of 1
+#define CURRENT_SENSE_RING_SIZE   (64)
+
+typedef struct
+{
+  uint16_t tripCount;
+  uint16_t current;         // Raw ADC sample that caused the trip
+  uint16_t retryDelayMs;
+} current_sense_trip_message_t;
+
+typedef struct
+{
+  uint16_t threshold;       // Raw ADC counts, 0 when disabled
+  uint16_t tripCount;
+  uint16_t peakCurrent;     // Highest raw ADC sample
+  uint16_t retryTimeLeftMs; // The output is off while this is not 0
+} current_sense_trip_status_t;
+
+typedef struct
+{
+  uint16_t samplePeriod;    // OCR1A, the ADC is triggered every samplePeriod + 1 CPU cycles. 400 to 15999, so at least once per ms.
+  uint8_t averageShift;     // 2^averageShift ADC samples per output sample
+  uint8_t cicOrder;         // 1 for a moving average, 2 for a second order CIC
+  uint8_t iirShift;         // Single pole IIR on the output, y += (x - y) >> iirShift. 0 disables it.
+  bool median;              // Median of 3 spike rejection on the ADC samples, the overcurrent trip sees the result
+} current_sense_filter_t;
+
+typedef struct
+{
+  uint16_t timeMs;          // Milliseconds since the current sense was started, wraps
+  uint16_t value;
+} current_sense_sample_t;
 
 void current_sense_initialize(void);
 
@@ -9,4 +43,32 @@ void current_sense_start(void);
 
 void current_sense_stop(void);
 
+// Changes the filter chain and ADC sample rate. Time is kept in milliseconds from the sample period, so
+// the telemetry, the trip retry and the MESSAGE_ID_ADC_SAMPLES posts stay at one per millisecond.
+// Those carry the latest output sample, a faster output is only seen by the filter chain.
+bool current_sense_set_filter(const current_sense_filter_t* config);
+
+void current_sense_get_filter(current_sense_filter_t* config);
+
+// Gets the cost of the ADC interrupt in CPU cycles since the filter was last set up
+void current_sense_get_cycles(uint16_t* average, uint16_t* maximum);
+
+// Sets the raw ADC value that shuts the track output down, 0 disables the check
+void current_sense_set_trip_threshold(uint16_t threshold);
+
+void current_sense_get_trip_status(current_sense_trip_status_t* status);
+
+// Clears the trip count and peak current
+void current_sense_reset_trip_status(void);
+
+// Stores every Nth averaged sample in the telemetry ring, 1 keeps all of them
+void current_sense_set_decimation(uint8_t decimation);
+
+uint8_t current_sense_get_decimation(void);
+
+// Takes up to maxCount samples out of the ring, oldest first. The oldest samples are overwritten when nobody reads them.
+uint8_t current_sense_read_samples(current_sense_sample_t* samples, uint8_t maxCount);
+
+uint8_t current_sense_get_sample_count(void);
+
 #endif /* CURRENT_SENSE_H_ */
\ No newline at end of file
@@ -9,6 +9,8 @@ typedef enum
   DCC_MESSAGE_FLAG_NONE = 0,
   DCC_MESSAGE_FLAG_USER_PROVIDED = 1,
   DCC_MESSAGE_FLAG_LONG_PREAMBLE = 2,
+  DCC_MESSAGE_FLAG_EXPRESS = 4,
+  DCC_MESSAGE_FLAG_IDLE = 8,
 } dcc_message_flags_t;
 
 typedef struct __attribute__((packed))
@@ -17,6 +19,27 @@ typedef struct __attribute__((packed))
   uint8_t dccMessageId;
 } dcc_event_message_t;
 
+typedef struct __attribute__((packed))
+{
+  uint16_t latencyUs;         // Time from the request until the stop packet started on the wire
+} dcc_emergency_stop_message_t;
+
+// Counters kept by the DCC engine since start up or the last reset
+typedef struct
+{
+  uint32_t userPackets;         // Packets queued through dcc_queue_data
+  uint32_t internalPackets;     // Refresh, programming and service mode packets
+  uint32_t idlePackets;         // Idle packets inserted because nothing else was queued
+  uint32_t totalBits;           // Bit periods put on the wire, including the cutout
+  uint32_t packetBits;          // Bit periods that were part of a user or internal packet
+  uint16_t rejectedPackets;     // Packets that did not fit in the queue
+  uint16_t overruns;            // Timer periods that were over before the interrupt was done with them
+  uint8_t queueHighWater;       // Maximum depth of the normal queue
+  uint8_t expressHighWater;     // Maximum depth of the express lane
+  uint16_t emergencyStopLatencyUs;      // Latency of the last emergency stop
+  uint16_t maxEmergencyStopLatencyUs;   // Highest emergency stop latency
+} dcc_statistics_t;
+
 typedef enum
 {
   DCC_MODE_OPERATION,
@@ -32,22 +55,54 @@ void dcc_start(dcc_mode_t mode);
 // Stops sending out signals
 void dcc_stop(void);
 
+// Connects or disconnects the track while the signal keeps running, used by the overcurrent trip in the ADC interrupt
+void dcc_set_output_enabled(bool enabled);
+
 // Get the current state
 bool dcc_is_started(void);
 
 // Gets the current mode
 dcc_mode_t dcc_get_mode(void);
 
-// Call this when EVENT_FLAG_DCC_TX_STARTED is set
+// Enables or disables the RailCom cutout after every packet. Only used in operation mode.
+void dcc_set_railcom_enabled(bool enabled);
+
+// Gets whether the RailCom cutout is enabled
+bool dcc_is_railcom_enabled(void);
+
+// Call this when a MESSAGE_ID_DCC_TX_STARTED message is received, keeps the queue topped up with refresh and idle packets
 void dcc_on_tx_started(void);
 
-// Call this when EVENT_FLAG_DCC_TX_COMPLETED is set
+// Call this when a MESSAGE_ID_DCC_TX_COMPLETED message is received
 void dcc_on_tx_completed(void);
 
-// Queues data for transmission
+// Stops all locomotives as fast as possible. The packet on the wire is cut off at the next byte and broadcast emergency stops
+// are sent before anything else. Only works in operation mode. Safe to call from an interrupt.
+void dcc_emergency_stop(void);
+
+// Call this when a MESSAGE_ID_DCC_EMERGENCY_STOP message is received, keeps queued and refreshed packets from starting the locomotives again
+void dcc_on_emergency_stop(const dcc_emergency_stop_message_t* message);
+
+// Queues data for transmission. In operation mode a speed or function packet replaces a queued one of the same kind for the same
+// decoder that has not started yet, messageIdOut then gets the ID of the packet that was replaced.
 bool dcc_queue_data(const uint8_t* data, uint8_t size, uint8_t *messageIdOut);
 
 // Queues data for transmission, does not set the USER_PROVIDED flag
 bool dcc_queue_data_internal(const uint8_t* data, uint8_t size, uint8_t *messageIdOut);
 
+// Queues data in the express lane, which goes out before anything in the normal queue. Meant for emergency stops and service mode.
+bool dcc_queue_data_express(const uint8_t* data, uint8_t size, uint8_t *messageIdOut);
+
+// Gets the amount of packets in the normal queue, including one that is being transmitted
+uint8_t dcc_get_queue_depth(void);
+
+// Gets the amount of packets in the express lane, including one that is being transmitted
+uint8_t dcc_get_express_queue_depth(void);
+
+// Gets a copy of the statistics
+void dcc_get_statistics(dcc_statistics_t *statistics);
+
+// Clears all statistics
+void dcc_reset_statistics(void);
+
 #endif /* DCC_H_ */
\ No newline at end of file
@@ -1,6 +1,21 @@
 #ifndef DCC_COMMANDS_H_
 #define DCC_COMMANDS_H_
 
+#include "dcc/dcc.h"
+#include "dcc/current_sense.h"
+
 void dcc_commands_initialize(void);
 
+// Call this from the main loop, streams current telemetry when it is enabled
+void dcc_commands_poll(void);
+
+// Call this when a MESSAGE_ID_DCC_TX_COMPLETED message is received, reports the packet to the host
+void dcc_commands_on_tx_completed(const dcc_event_message_t* event);
+
+// Call this when a MESSAGE_ID_DCC_EMERGENCY_STOP message is received, reports the stop latency to the host
+void dcc_commands_on_emergency_stop(const dcc_emergency_stop_message_t* message);
+
+// Call this when a MESSAGE_ID_OVERCURRENT message is received, reports the trip to the host
+void dcc_commands_on_overcurrent(const current_sense_trip_message_t* message);
+
 #endif /* DCC_COMMANDS_H_ */
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef DCC_CV_BACKUP_H_
+#define DCC_CV_BACKUP_H_
+
+#include "dcc/dcc_service_mode.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DCC_CV_RECORD_CVS           (8)
+// Base CV (2 bytes, big endian), bitmap and at most one value per CV
+#define DCC_CV_RECORD_MAX_SIZE      (3 + DCC_CV_RECORD_CVS)
+
+// A block of consecutive CVs. Bit n of the bitmap is set when CV baseCvAddress + n has a value,
+// the values of the set bits are stored in order without gaps.
+typedef struct
+{
+  uint16_t baseCvAddress;     // Zero based
+  uint8_t bitmap;
+  uint8_t values[DCC_CV_RECORD_CVS];
+} dcc_cv_record_t;
+
+typedef struct
+{
+  uint16_t cvAddress;         // Zero based
+  dcc_result_t result;
+  uint8_t retries;
+  bool written;               // Restore only, the CV differed and was written
+  uint16_t durationMs;
+} dcc_cv_progress_t;
+
+typedef struct
+{
+  void (*on_record)(const dcc_cv_record_t* record);
+  void (*on_progress)(const dcc_cv_progress_t* progress);
+  // A stopped dump can be resumed at nextCvAddress, a finished one has nothing left to do
+  void (*on_finished)(bool stopped, uint16_t nextCvAddress);
+} dcc_cv_backup_handler_t;
+
+// Reads count CVs starting at firstCvAddress, completed records are reported through the handler
+bool dcc_cv_backup_dump(uint16_t firstCvAddress, uint16_t count, const dcc_cv_backup_handler_t* handler);
+
+// Continues a dump that was stopped or timed out with the CV it was busy with
+bool dcc_cv_backup_resume(void);
+
+// Stops the running operation after the current CV
+void dcc_cv_backup_stop(void);
+
+// Writes back the CVs of a record that do not hold the recorded value yet
+bool dcc_cv_backup_restore(const dcc_cv_record_t* record, const dcc_cv_backup_handler_t* handler);
+
+bool dcc_cv_backup_is_busy(void);
+
+// Serializes a record, returns the size in bytes
+uint8_t dcc_cv_backup_encode(const dcc_cv_record_t* record, uint8_t* buffer);
+
+bool dcc_cv_backup_decode(const uint8_t* buffer, uint8_t size, dcc_cv_record_t* record);
+
+#endif /* DCC_CV_BACKUP_H_ */
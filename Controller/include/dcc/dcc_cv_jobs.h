@@ -0,0 +1,39 @@
+#ifndef DCC_CV_JOBS_H_
+#define DCC_CV_JOBS_H_
+
+#include "dcc/dcc_service_mode.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DCC_CV_JOBS_QUEUE_SIZE    (16)
+
+typedef enum
+{
+  DCC_CV_JOB_WRITE,
+  DCC_CV_JOB_VERIFY,
+  DCC_CV_JOB_WRITE_BIT,
+  DCC_CV_JOB_VERIFY_BIT,
+  DCC_CV_JOB_READ
+} dcc_cv_job_type_t;
+
+typedef struct
+{
+  uint8_t id;             // Assigned when the job is queued
+  uint8_t type;           // dcc_cv_job_type_t
+  uint16_t cvAddress;     // Zero based
+  uint8_t bit;
+  uint8_t value;          // Holds the value that was read for a successful read job
+} dcc_cv_job_t;
+
+typedef void (*dcc_cv_job_callback_t)(const dcc_cv_job_t* job, dcc_result_t result, void* userData);
+
+// Queues a service mode operation, jobs run back to back and each one is reported through the callback when it finishes
+bool dcc_cv_jobs_queue(const dcc_cv_job_t* job, dcc_cv_job_callback_t callback, void* userData, uint8_t* jobIdOut);
+
+// Drops the jobs that have not started yet, they are not reported
+void dcc_cv_jobs_clear(void);
+
+// Gets the amount of jobs, including the one that is running
+uint8_t dcc_cv_jobs_get_count(void);
+
+#endif /* DCC_CV_JOBS_H_ */
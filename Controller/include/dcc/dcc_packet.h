@@ -0,0 +1,69 @@
+#ifndef DCC_PACKET_H_
+#define DCC_PACKET_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DCC_PACKET_MAX_SIZE             (6)         // Long address, up to three instruction bytes and the error detection byte
+#define DCC_PACKET_BROADCAST_ADDRESS    (0)
+#define DCC_PACKET_MAX_SHORT_ADDRESS    (127)
+#define DCC_PACKET_MAX_LONG_ADDRESS     (10239)
+#define DCC_PACKET_MAX_BASIC_ACCESSORY  (511)
+#define DCC_PACKET_MAX_EXT_ACCESSORY    (2047)
+#define DCC_PACKET_MAX_CV_ADDRESS       (0x3FF)
+
+typedef struct
+{
+  uint8_t size;
+  uint8_t data[DCC_PACKET_MAX_SIZE];
+} dcc_packet_t;
+
+typedef enum
+{
+  DCC_SPEED_STEPS_14,
+  DCC_SPEED_STEPS_28,
+  DCC_SPEED_STEPS_128,
+} dcc_speed_steps_t;
+
+typedef enum
+{
+  DCC_FUNCTION_GROUP_F0_F4,
+  DCC_FUNCTION_GROUP_F5_F8,
+  DCC_FUNCTION_GROUP_F9_F12,
+  DCC_FUNCTION_GROUP_F13_F20,
+  DCC_FUNCTION_GROUP_F21_F28,
+  NR_OF_DCC_FUNCTION_GROUPS,
+} dcc_function_group_t;
+
+// Builds an idle packet
+void dcc_packet_idle(dcc_packet_t* packet);
+
+// Builds a speed and direction packet. Speed 0 is stop, the highest speed is 14, 28 or 126 depending on the amount of steps.
+// Addresses up to 127 use the short form, higher addresses the long form. Address 0 is the broadcast address.
+bool dcc_packet_speed(dcc_packet_t* packet, uint16_t address, dcc_speed_steps_t steps, uint8_t speed, bool forward);
+
+// Builds an emergency stop packet, use the broadcast address to stop all decoders
+bool dcc_packet_emergency_stop(dcc_packet_t* packet, uint16_t address);
+
+// Builds a function group packet. The lowest function of the group is bit 0 of the state, F0 is bit 0 of the F0-F4 group.
+bool dcc_packet_functions(dcc_packet_t* packet, uint16_t address, dcc_function_group_t group, uint8_t state);
+
+// Builds a basic accessory packet for one of the eight outputs of a decoder
+bool dcc_packet_basic_accessory(dcc_packet_t* packet, uint16_t address, uint8_t output, bool activate);
+
+// Builds an extended accessory packet that sets an aspect
+bool dcc_packet_extended_accessory(dcc_packet_t* packet, uint16_t address, uint8_t aspect);
+
+// Builds an operations mode (programming on main) packet that writes a CV byte. The CV address is zero based.
+bool dcc_packet_pom_write_cv(dcc_packet_t* packet, uint16_t address, uint16_t cvAddress, uint8_t data);
+
+// Builds an operations mode (programming on main) packet that writes a single CV bit. The CV address is zero based.
+bool dcc_packet_pom_write_cv_bit(dcc_packet_t* packet, uint16_t address, uint16_t cvAddress, uint8_t bit, uint8_t data);
+
+// Gets the function group that contains a function
+dcc_function_group_t dcc_packet_get_function_group(uint8_t function);
+
+// Gets the first function of a function group
+uint8_t dcc_packet_get_first_function(dcc_function_group_t group);
+
+#endif /* DCC_PACKET_H_ */
@@ -0,0 +1,27 @@
+#ifndef DCC_POM_H_
+#define DCC_POM_H_
+
+#include "dcc/dcc_packet.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DCC_POM_QUEUE_SIZE      (8)
+
+// Initializes the module
+void dcc_pom_initialize(void);
+
+// Queues an operations mode packet for a decoder on the main track, build it with dcc_packet_pom_write_cv or
+// dcc_packet_pom_write_cv_bit. Returns false when the queue is full.
+bool dcc_pom_queue_packet(uint16_t address, const dcc_packet_t* packet);
+
+// Gets the amount of queued CV operations
+uint8_t dcc_pom_get_queue_depth(void);
+
+// Gets the next programming packet to fill a gap on the track without taking it from the queue. Returns false once
+// between decoders to give the refresh traffic a slot, ignoreYield skips that when there is nothing to refresh.
+bool dcc_pom_get_packet(dcc_packet_t* packet, bool ignoreYield);
+
+// Call when a gap on the track was filled, programming tells if it was the packet from dcc_pom_get_packet
+void dcc_pom_packet_queued(bool programming);
+
+#endif /* DCC_POM_H_ */
@@ -0,0 +1,31 @@
+#ifndef DCC_RAILCOM_H_
+#define DCC_RAILCOM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DCC_RAILCOM_CHANNEL_1_SIZE    (2)
+#define DCC_RAILCOM_CHANNEL_2_SIZE    (6)
+
+typedef struct
+{
+  uint8_t dccMessageId;     // Packet that was sent right before the cutout
+  uint8_t channel1Length;
+  uint8_t channel1[DCC_RAILCOM_CHANNEL_1_SIZE];
+  uint8_t channel2Length;
+  uint8_t channel2[DCC_RAILCOM_CHANNEL_2_SIZE];
+} dcc_railcom_data_t;
+
+// Initializes the module
+void dcc_railcom_initialize(void);
+
+// Called from the DCC interrupt when a cutout starts
+void dcc_railcom_on_cutout_start(uint8_t dccMessageId);
+
+// Called from the DCC interrupt when a cutout ends
+void dcc_railcom_on_cutout_end(void);
+
+// Gets the data from the last cutout in which a decoder responded. Returns false if nothing new was received since the last call.
+bool dcc_railcom_get_data(dcc_railcom_data_t *data);
+
+#endif /* DCC_RAILCOM_H_ */
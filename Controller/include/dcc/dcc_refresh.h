@@ -0,0 +1,45 @@
+#ifndef DCC_REFRESH_H_
+#define DCC_REFRESH_H_
+
+#include "dcc/dcc_packet.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DCC_REFRESH_MAX_DECODERS      (8)
+#define DCC_REFRESH_MAX_FUNCTION      (28)
+#define DCC_REFRESH_MAX_SPEED         (126)
+
+typedef struct
+{
+  uint16_t address;       // Decoder address, 0 if the entry is not in use
+  uint8_t speed;          // 0 - 126, 128 speed step mode
+  bool forward;
+  uint32_t functions;     // F0 in bit 0 up to F28 in bit 28
+} dcc_refresh_entry_t;
+
+// Initializes the module
+void dcc_refresh_initialize(void);
+
+// Sets the speed and direction of a decoder, adding it to the table if needed
+bool dcc_refresh_set_speed(uint16_t address, uint8_t speed, bool forward);
+
+// Sets a single function of a decoder, adding it to the table if needed
+bool dcc_refresh_set_function(uint16_t address, uint8_t function, bool enabled);
+
+// Sets the speed of all decoders to 0, used after an emergency stop so the refresh doesn't start them again
+void dcc_refresh_stop_all(void);
+
+// Removes a decoder from the table
+bool dcc_refresh_release(uint16_t address);
+
+// Gets a table entry by index, returns NULL if the entry is not in use
+const dcc_refresh_entry_t* dcc_refresh_get_entry(uint8_t index);
+
+// Gets the next packet to fill a gap on the track. Changed decoder state goes first, then a round-robin refresh of all decoders.
+// Nothing moves on until dcc_refresh_packet_queued is called, a packet that did not fit in the track queue comes back next time.
+bool dcc_refresh_get_packet(dcc_packet_t* packet);
+
+// Call when the packet from the last dcc_refresh_get_packet is in the track queue
+void dcc_refresh_packet_queued(void);
+
+#endif /* DCC_REFRESH_H_ */
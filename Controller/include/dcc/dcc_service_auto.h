@@ -0,0 +1,22 @@
+#ifndef DCC_SERVICE_AUTO_H_
+#define DCC_SERVICE_AUTO_H_
+
+#include "dcc/dcc_service_mode.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Byte operations that find the programming method of the decoder on the programming track. A write tries the methods
+// in turn until the decoder acknowledges one, a verify only uses the first method that reaches the CV. The method that
+// got an ACK is remembered, later operations use it without probing. The programming track only holds one decoder at a
+// time, so the method is not tied to an address. Forget it when service mode is entered, the decoder may have changed.
+bool dcc_service_auto_set_cv(uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData);
+
+bool dcc_service_auto_verify_cv(uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData);
+
+// Gets the remembered method, returns false if it is not known yet
+bool dcc_service_auto_get_method(dcc_service_method_t* method);
+
+// Fixes the method, DCC_SERVICE_METHOD_COUNT forgets it so the next operation probes again
+void dcc_service_auto_set_method(dcc_service_method_t method);
+
+#endif /* DCC_SERVICE_AUTO_H_ */
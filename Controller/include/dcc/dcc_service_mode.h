@@ -11,6 +11,28 @@ typedef enum
   DCC_RESULT_TIMEOUT
 } dcc_result_t;
 
+typedef enum
+{
+  DCC_SERVICE_METHOD_DIRECT,
+  DCC_SERVICE_METHOD_PAGED,
+  DCC_SERVICE_METHOD_REGISTER,       // CV 1 to 4, 7, 8 and 29 only
+  DCC_SERVICE_METHOD_ADDRESS_ONLY,   // CV 1 only
+  DCC_SERVICE_METHOD_COUNT
+} dcc_service_method_t;
+
+typedef struct
+{
+  uint8_t threshold;      // ADC counts above the idle current baseline
+  uint8_t minWidthMs;
+  uint8_t maxWidthMs;
+} dcc_ack_config_t;
+
+typedef struct
+{
+  uint8_t widthMs;
+  uint16_t amplitude;     // Peak ADC counts above the baseline
+} dcc_ack_pulse_t;
+
 typedef void (*dcc_callback_t)(dcc_result_t result, void* userData);
 
 void dcc_service_mode_initialize(void);
@@ -19,6 +41,19 @@ void dcc_service_mode_on_current_sense_data(uint16_t data);
 
 void dcc_service_mode_tx_complete(const dcc_event_message_t* message);
 
+bool dcc_service_mode_is_busy(void);
+
+// Counts current sense samples, which arrive once per millisecond while the track is powered
+uint16_t dcc_service_mode_get_time_ms(void);
+
+void dcc_service_mode_set_ack_config(const dcc_ack_config_t* config);
+
+void dcc_service_mode_get_ack_config(dcc_ack_config_t* config);
+
+// Gets the last pulse that was accepted as an ACK, returns false if there was none yet
+bool dcc_service_mode_get_last_ack(dcc_ack_pulse_t* pulse);
+
+// Operations started from a result callback reuse the recovery resets of the previous operation instead of sending new ones
 bool dcc_service_mode_set_cv(uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData);
 
 bool dcc_service_mode_verify_cv(uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData);
@@ -27,4 +62,15 @@ bool dcc_service_mode_set_cv_bit(uint16_t cvAddress, uint8_t bit, uint8_t data,
 
 bool dcc_service_mode_verify_cv_bit(uint16_t cvAddress, uint8_t bit, uint8_t data, dcc_callback_t callback, void* userData);
 
+// Byte operations with a given programming method, bit operations and reads only exist in direct mode.
+// Address only mode refuses values above 127, it can only hold a short address.
+bool dcc_service_mode_set_cv_with_method(dcc_service_method_t method, uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData);
+
+bool dcc_service_mode_verify_cv_with_method(dcc_service_method_t method, uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData);
+
+bool dcc_service_mode_method_supports_cv(dcc_service_method_t method, uint16_t cvAddress);
+
+// Reads a CV with eight bit verifies and a final byte verify. The value is stored before the callback reports DCC_RESULT_ACK.
+bool dcc_service_mode_read_cv(uint16_t cvAddress, uint8_t* value, dcc_callback_t callback, void* userData);
+
 #endif /* DCC_SERVICE_MODE_H_ */
\ No newline at end of file
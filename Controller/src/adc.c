@@ -0,0 +1,221 @@
+#include "adc.h"
+#include "platform.h"
+#include <stddef.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+// What the conversion in progress is for, anything else is the index of a slow channel
+#define CONVERTING_NONE         (0xFF)
+#define CONVERTING_STREAM       (0xFE)
+
+typedef struct
+{
+  uint8_t channel;
+  adc_callback_t callback;
+} adc_slot_t;
+
+static adc_slot_t m_slots[ADC_MAX_CHANNELS];
+static volatile uint16_t m_values[ADC_MAX_CHANNELS];
+static volatile uint8_t m_slotCount;
+static uint8_t m_nextSlot;
+static volatile uint8_t m_converting;
+
+static volatile bool m_streaming;
+static uint8_t m_streamChannel;
+static adc_callback_t m_streamCallback;
+static uint8_t m_streamCount;
+static uint16_t m_lastStreamValue;
+static bool m_lent;                   // The conversion in progress was taken from the stream
+
+static inline void select_channel(uint8_t channel)
+{
+  // AVcc as reference
+  ADMUX = BIT(REFS0) | channel;
+}
+
+// ADIF is cleared by writing a one to it, so ADCSRA |= x would throw away a conversion that is waiting for its interrupt.
+// Every write to ADCSRA after the initialization goes through these two.
+static inline void set_control_bits(uint8_t mask)
+{
+  ADCSRA = (ADCSRA & ~BIT(ADIF)) | mask;
+}
+
+static inline void clear_control_bits(uint8_t mask)
+{
+  ADCSRA &= ~(BIT(ADIF) | mask);
+}
+
+static inline uint8_t take_next_slot(void)
+{
+  uint8_t slot = m_nextSlot;
+  m_nextSlot = (m_nextSlot + 1 < m_slotCount) ? m_nextSlot + 1 : 0;
+  return slot;
+}
+
+void adc_initialize(void)
+{
+  m_slotCount = 0;
+  m_nextSlot = 0;
+  m_converting = CONVERTING_NONE;
+  m_streaming = false;
+
+  select_channel(ADC_CHANNEL_SINGLE_0);
+
+  // Timer 1 overflow starts stream conversions, it only matters while auto trigger is on
+  ADCSRB = ADC_TRIGGER_SOURCE_TIM1_OVF;
+
+  // It takes 13 cycles for the ADC to perform its sampling, just put it at 1 MHz
+  ADCSRA = BIT(ADEN) | BIT(ADIE) | ADC_PRESCALER_16;
+}
+
+uint8_t adc_add_channel(uint8_t channel, adc_callback_t callback)
+{
+  if (m_slotCount == ADC_MAX_CHANNELS)
+  {
+    return ADC_HANDLE_INVALID;
+  }
+
+  uint8_t handle = m_slotCount;
+  m_slots[handle].channel = channel;
+  m_slots[handle].callback = callback;
+  m_values[handle] = 0;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    m_slotCount++;
+  }
+
+  return handle;
+}
+
+uint16_t adc_get_value(uint8_t handle)
+{
+  uint16_t value = 0;
+
+  if (handle < m_slotCount)
+  {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      value = m_values[handle];
+    }
+  }
+
+  return value;
+}
+
+void adc_start_stream(uint8_t channel, adc_callback_t callback)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    m_streamChannel = channel;
+    m_streamCallback = callback;
+    m_streamCount = 0;
+    m_lastStreamValue = 0;
+    m_lent = false;
+    m_streaming = true;
+
+    // A slow conversion that is still running selects the stream channel from the interrupt when it is done.
+    // Triggers that come in before that are ignored by the ADC.
+    if (m_converting == CONVERTING_NONE)
+    {
+      select_channel(channel);
+      m_converting = CONVERTING_STREAM;
+    }
+
+    set_control_bits(BIT(ADATE));
+  }
+}
+
+void adc_stop_stream(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    clear_control_bits(BIT(ADATE));
+    m_streaming = false;
+    m_lent = false;
+
+    // A conversion that was already triggered still completes, the interrupt drops a stream result
+    if ((ADCSRA & BIT(ADSC)) == 0)
+    {
+      m_converting = CONVERTING_NONE;
+    }
+  }
+}
+
+bool adc_is_streaming(void)
+{
+  return m_streaming;
+}
+
+void adc_tick(void)
+{
+  if (m_streaming || (m_slotCount == 0))
+  {
+    return;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if (m_converting == CONVERTING_NONE)
+    {
+      m_converting = take_next_slot();
+      select_channel(m_slots[m_converting].channel);
+      set_control_bits(BIT(ADSC));
+    }
+  }
+}
+
+ISR(ADC_vect)
+{
+  uint16_t value = ADCW;
+  uint8_t converted = m_converting;
+
+  // Pick the channel for the next conversion first, the next timer trigger can come while the callbacks run
+  if (m_streaming)
+  {
+    if ((++m_streamCount >= ADC_STREAM_SLOT_INTERVAL) && (m_slotCount > 0) && (converted == CONVERTING_STREAM))
+    {
+      m_streamCount = 0;
+      m_lent = true;
+      m_converting = take_next_slot();
+      select_channel(m_slots[m_converting].channel);
+    }
+    else
+    {
+      m_converting = CONVERTING_STREAM;
+      select_channel(m_streamChannel);
+    }
+
+    // Arm the trigger for the next overflow, writing the flag alone leaves the other timer 1 flags alone
+    TIFR1 = BIT(TOV1);
+  }
+  else
+  {
+    m_converting = CONVERTING_NONE;
+  }
+
+  if (converted == CONVERTING_STREAM)
+  {
+    if (m_streaming)
+    {
+      m_lastStreamValue = value;
+      m_streamCallback(value);
+    }
+  }
+  else if (converted != CONVERTING_NONE)
+  {
+    m_values[converted] = value;
+    if (m_slots[converted].callback != NULL)
+    {
+      m_slots[converted].callback(value);
+    }
+
+    if (m_lent)
+    {
+      m_lent = false;
+      // The stream lent us this conversion, it gets its previous sample again so its time base and averages stay right
+      m_streamCallback(m_lastStreamValue);
+    }
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef ADC_H_
+#define ADC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ADC_HANDLE_INVALID      (0xFF)
+#define ADC_MAX_CHANNELS        (4)
+
+// While a stream runs, one of every ADC_STREAM_SLOT_INTERVAL conversions is lent to the next slow channel
+#define ADC_STREAM_SLOT_INTERVAL  (32)
+
+// Called from the ADC interrupt with the raw 10 bit result, keep it short
+typedef void (*adc_callback_t)(uint16_t value);
+
+// Takes ownership of the ADC, nothing else should touch ADMUX, ADCSRA or ADCSRB after this.
+// Use ATOMIC_BLOCK to keep the callbacks out, masking ADIE in ADCSRA can clear a pending ADIF and lose a conversion.
+void adc_initialize(void);
+
+// Adds a slow channel that gets sampled round robin, the callback may be NULL. Returns ADC_HANDLE_INVALID when all slots are used.
+uint8_t adc_add_channel(uint8_t channel, adc_callback_t callback);
+
+// Gets the last result of a slow channel without waiting for a conversion, 0 until the first one is done
+uint16_t adc_get_value(uint8_t handle);
+
+// Converts one channel on every timer 1 overflow. The timer itself belongs to the caller. Every ADC_STREAM_SLOT_INTERVAL
+// conversions one goes to a slow channel and the callback gets the previous stream sample again, so the stream keeps its rate.
+void adc_start_stream(uint8_t channel, adc_callback_t callback);
+
+void adc_stop_stream(void);
+
+bool adc_is_streaming(void);
+
+// Call every millisecond, samples the next slow channel when no stream is running
+void adc_tick(void);
+
+#endif /* ADC_H_ */
@@ -5,7 +5,7 @@
 #include <stdlib.h>
 #include <errno.h>
 
-#define MAX_COMMANDS    (32)
+#define MAX_COMMANDS    (40)
 
 static uint8_t m_commandCount;
 static const command_t* m_commands[MAX_COMMANDS];
@@ -7,7 +7,14 @@
 #define COM_DCC_ERR_FORMAT      "INVALID FORMAT"
 #define COM_DCC_ERR_SIZE        "INVALID LENGTH"
 #define COM_DCC_ERR_QUEUE       "QUEUE FULL"
+#define COM_DCC_ERR_TABLE       "TABLE FULL"
 #define COM_DCC_TX_COMPLETE     ":TXC ID %u"
+#define COM_DCC_EMERGENCY_STOP  ":ESTOP %u US"
+#define COM_DCC_OVERCURRENT     ":TRIP %u CURRENT %u RETRY %u MS"
+#define COM_DCC_CURRENT         ":CUR "
+#define COM_DCC_CV_JOB          ":CVJ ID %u %s"
+#define COM_DCC_CV_RECORD       ":CVD "
+#define COM_DCC_CV_PROGRESS     ":CVP %u %s RETRY %u %u MS"
 
 #define COM_CRLF             "\r\n"
 #define COM_OK              "OK"
@@ -1,8 +1,16 @@
 #ifndef CONFIG_H_
 #define CONFIG_H_
 
+// The DCC output needs timer 4, only the ATmega2560 has it. The ATmega328P build is the PWM controller on its own.
+#if defined(__AVR_ATmega2560__)
+#define CONFIG_DCC
+#endif
 
+#if defined(CONFIG_DCC)
+#define SYSB_MAX_TIMERS     (8)
+#else
 #define SYSB_MAX_TIMERS     (5)
+#endif
 
 
 #endif /* CONFIG_H_ */
\ No newline at end of file
@@ -1,13 +1,75 @@
 #include "dcc/bdp.h"
 #include <string.h>
-#include <util/crc16.h>
+
+// CRC-16-XMODEM, polynomial 0x1021. Entry i is the CRC of the top bits of the register being i.
+#if BDP_CRC_METHOD == BDP_CRC_BYTE_TABLE
+const uint16_t bdp_crc_table[256] PROGMEM = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+#elif BDP_CRC_METHOD == BDP_CRC_NIBBLE_TABLE
+const uint16_t bdp_crc_table[16] PROGMEM = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+#endif
+
+static void clear_window(bdp_port_t *port);
+static bool handle_frame(bdp_port_t *port, const bdp_header_t *header);
 
 void bdp_port_initialize(bdp_port_t *port, bdp_transmit_t txFunction, bdp_handle_command_t handlerFunction)
 {
   port->handlerFunction = handlerFunction;
   port->txFunction = txFunction;
-  port->lastTransmittedResponseSize = 0;
-  port->lastRxSeqNumber = 0;
+  port->windowMask = 0;
+  clear_window(port);
+}
+
+bool bdp_port_set_window_size(bdp_port_t *port, uint8_t size)
+{
+  if ((size == 0) || (size > BDP_MAX_WINDOW_SIZE) || ((size & (size - 1)) != 0))
+  {
+    return false;
+  }
+
+  port->windowMask = size - 1;
+  clear_window(port);
+  return true;
+}
+
+uint8_t bdp_port_get_window_size(const bdp_port_t *port)
+{
+  return port->windowMask + 1;
 }
 
 bool bdp_port_received_command(bdp_port_t *port, const uint8_t *data, uint16_t dataLength)
@@ -31,7 +93,7 @@ bool bdp_port_received_command(bdp_port_t *port, const uint8_t *data, uint16_t d
   uint16_t crc = BDP_CRC_INIT;
   for (uint16_t i = 0; i < expectedLength; i++)
   {
-    crc = _crc_xmodem_update(crc, data[i]);
+    crc = bdp_crc_update(crc, data[i]);
   }
 
   if (crc != BDP_CRC_CHECK)
@@ -40,32 +102,81 @@ bool bdp_port_received_command(bdp_port_t *port, const uint8_t *data, uint16_t d
     return false;
   }
 
+  return handle_frame(port, header);
+}
+
+bool bdp_port_received_command_crc(bdp_port_t *port, const uint8_t *data, uint16_t dataLength, uint16_t crc)
+{
+  if (dataLength < sizeof(bdp_header_t))
+  {
+    return false;
+  }
+
+  const bdp_header_t *header = (bdp_header_t*)data;
+  if (dataLength != header->dataLength + sizeof(bdp_header_t) + BDP_CRC_LENGTH)
+  {
+    // The running CRC only means something when it covered exactly one message
+    return bdp_port_received_command(port, data, dataLength);
+  }
+
+  if (crc != BDP_CRC_CHECK)
+  {
+    return false;
+  }
+
+  return handle_frame(port, header);
+}
+
+static void clear_window(bdp_port_t *port)
+{
+  for (uint8_t i = 0; i < BDP_MAX_WINDOW_SIZE; i++)
+  {
+    port->window[i].state = BDP_SLOT_EMPTY;
+  }
+  port->hasRxSeqNumber = false;
+}
+
+static bool handle_frame(bdp_port_t *port, const bdp_header_t *header)
+{
   if (header->flags & BDP_FLAG_COMMAND)
   {
-    bool isNewCommand = false;
+    uint8_t seqNumber = header->seqNumber;
 
-    if (((header->flags & BDP_FLAG_RESET) == 0) && (port->lastRxSeqNumber == header->seqNumber))
+    if (header->flags & BDP_FLAG_RESET)
     {
-      // Repeated message and this is not a reset, we have already processed this!
-      isNewCommand = false;
+      clear_window(port);
     }
 
-    if (!isNewCommand && ((header->flags & BDP_FLAG_DO_NOT_RESPOND) == 0))
+    bdp_window_slot_t *slot = &port->window[seqNumber & port->windowMask];
+    if ((slot->state != BDP_SLOT_EMPTY) && (slot->seqNumber == seqNumber))
     {
-      // Not a new command, re-transmit the result from the previous time
-      if (port->lastTransmittedResponseSize > 0)
+      // Repeated message, we have already processed this! Re-transmit the result from the previous time if there was one.
+      if ((slot->state == BDP_SLOT_PENDING) || (slot->responseSize == 0) || ((header->flags & BDP_FLAG_DO_NOT_RESPOND) != 0))
       {
-        const bdp_header_t* responseHeader = (bdp_header_t*)&port->lastTransmittedResponse[0];
-        if (responseHeader->seqNumber == header->seqNumber)
-        {
-          // Stored response is for this command, transmit it
-          return port->txFunction(&port->lastTransmittedResponse[0], port->lastTransmittedResponseSize);
-        }
+        return true;
       }
+      return port->txFunction(&slot->response[0], slot->responseSize);
+    }
 
-      // Did not have the previous result, error
-      return false;
+    // Anything up to a window behind the newest command is a retry of one that got lost, older ones have left the cache.
+    // A window of 1 is stop and wait: any other sequence number is the next command, hosts may alternate between two.
+    uint8_t age = port->highestRxSeqNumber - seqNumber;
+    if (port->hasRxSeqNumber && (age < 128) && (port->windowMask != 0))
+    {
+      if (age > port->windowMask)
+      {
+        return false;
+      }
     }
+    else
+    {
+      port->highestRxSeqNumber = seqNumber;
+      port->hasRxSeqNumber = true;
+    }
+
+    slot->state = BDP_SLOT_PENDING;
+    slot->seqNumber = seqNumber;
+    slot->responseSize = 0;
 
     // Let the handler handle it
     if (!port->handlerFunction(header))
@@ -73,10 +184,15 @@ bool bdp_port_received_command(bdp_port_t *port, const uint8_t *data, uint16_t d
       // Handler did not handle this command at all, return an unsupported response code
       uint8_t responseData = BDP_RESULT_UNKNOWN_COMMAND;
 
-      (void) bdp_port_transmit_response(port, header->seqNumber, &responseData, sizeof(responseData));
+      (void) bdp_port_transmit_response(port, seqNumber, &responseData, sizeof(responseData));
     }
 
-    port->lastRxSeqNumber = header->seqNumber;
+    // The window may have been changed by the command itself
+    slot = &port->window[seqNumber & port->windowMask];
+    if ((slot->state == BDP_SLOT_PENDING) && (slot->seqNumber == seqNumber))
+    {
+      slot->state = BDP_SLOT_DONE;
+    }
     return true;
   }
 
@@ -84,6 +200,17 @@ bool bdp_port_received_command(bdp_port_t *port, const uint8_t *data, uint16_t d
   return true;
 }
 
+uint8_t *bdp_port_begin_response(bdp_port_t *port, uint8_t seqNumber)
+{
+  bdp_window_slot_t *slot = &port->window[seqNumber & port->windowMask];
+  if ((slot->state != BDP_SLOT_EMPTY) && (slot->seqNumber != seqNumber))
+  {
+    return NULL;
+  }
+
+  return &slot->response[sizeof(bdp_header_t)];
+}
+
 bool bdp_port_transmit_response(bdp_port_t *port, uint8_t seqNumber, const uint8_t *data, uint16_t dataLength)
 {
   uint16_t totalSize = sizeof(bdp_header_t) + dataLength + BDP_CRC_LENGTH;
@@ -94,28 +221,49 @@ bool bdp_port_transmit_response(bdp_port_t *port, uint8_t seqNumber, const uint8
     return false;
   }
 
-  // Create message
-  bdp_header_t *header = (bdp_header_t*)&port->lastTransmittedResponse[0];
-  header->flags = 0;
-  header->seqNumber = seqNumber;
-  header->dataLength = dataLength;
-
-  memcpy(&port->lastTransmittedResponse[sizeof(bdp_header_t)], data, dataLength);
+  // A response for a command that has left the window would overwrite a newer one
+  uint8_t *payload = bdp_port_begin_response(port, seqNumber);
+  if (payload == NULL)
+  {
+    return false;
+  }
+  bdp_window_slot_t *slot = &port->window[seqNumber & port->windowMask];
 
-  // Calculate and append CRC
-  uint16_t crcDataLength = dataLength + sizeof(bdp_header_t);
+  // Stage the message, the CRC is updated while the bytes are copied in
+  const bdp_header_t header = { .flags = 0, .seqNumber = seqNumber, .dataLength = dataLength };
+  const uint8_t *headerBytes = (const uint8_t*)&header;
+  uint8_t *out = &slot->response[0];
   uint16_t crc = BDP_CRC_INIT;
-  for (uint16_t i = 0; i < crcDataLength; i++)
+
+  for (uint8_t i = 0; i < sizeof(bdp_header_t); i++)
   {
-    crc = _crc_xmodem_update(crc, data[i]);
+    *out = headerBytes[i];
+    crc = bdp_crc_update(crc, *out++);
+  }
+  if (data == payload)
+  {
+    // Built in place
+    for (uint16_t i = 0; i < dataLength; i++)
+    {
+      crc = bdp_crc_update(crc, *out++);
+    }
+  }
+  else
+  {
+    // The window may have changed while the response was built, so the data can also be in another slot
+    for (uint16_t i = 0; i < dataLength; i++)
+    {
+      *out = data[i];
+      crc = bdp_crc_update(crc, *out++);
+    }
   }
 
-  port->lastTransmittedResponse[crcDataLength] = crc >> 8;
-  port->lastTransmittedResponse[crcDataLength + 1] = crc & 0xFF;
-
-  port->lastTransmittedResponseSize = totalSize;
+  *out++ = crc >> 8;
+  *out = crc & 0xFF;
 
-  port->txFunction(&port->lastTransmittedResponse[0], port->lastTransmittedResponseSize);
+  slot->state = BDP_SLOT_DONE;
+  slot->seqNumber = seqNumber;
+  slot->responseSize = totalSize;
 
-  return false;
+  return port->txFunction(&slot->response[0], slot->responseSize);
 }
@@ -0,0 +1,261 @@
+#include "dcc/bdp_console.h"
+#include "serial.h"
+#include "serial_console.h"
+#include <stddef.h>
+
+#define MAX_OPCODES       (16)
+
+// Caps the time spent in one poll when a host sends at line rate
+#define BYTES_PER_POLL    (32)
+
+typedef enum
+{
+  RX_STATE_TEXT,          // Bytes go to the text console
+  RX_STATE_FRAME,
+  RX_STATE_ESCAPE,        // The previous byte was BDP_CONSOLE_ESC
+  RX_STATE_DISCARD,       // The frame did not fit, drop everything up to the next end
+} rx_state_t;
+
+static const bdp_opcode_t* m_opcodes[MAX_OPCODES];
+static uint8_t m_opcodeCount;
+
+static bdp_port_t m_port;
+static rx_state_t m_rxState;
+static uint8_t m_frame[BDP_CONSOLE_MAX_FRAME];
+static uint8_t m_frameLength;
+static uint16_t m_frameCrc;             // Updated as the bytes come in, so the check at the end is free
+static uint8_t m_eventSeqNumber;
+
+static void store_frame_byte(uint8_t data);
+static bool transmit_frame(const uint8_t *data, uint16_t size);
+static void put_escaped(serial_tx_reservation_t *reservation, uint8_t data);
+static bool handle_command(const bdp_header_t *header);
+static bdp_result_code_t ping_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+static bdp_result_code_t window_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+
+static const bdp_opcode_t m_pingOpcode = {
+  .opcode = BDP_OPCODE_PING,
+  .handler = ping_opcode
+};
+
+static const bdp_opcode_t m_windowOpcode = {
+  .opcode = BDP_OPCODE_WINDOW,
+  .handler = window_opcode
+};
+
+void bdp_console_initialize(void)
+{
+  m_opcodeCount = 0;
+  m_rxState = RX_STATE_TEXT;
+  m_frameLength = 0;
+  m_eventSeqNumber = 0;
+
+  bdp_port_initialize(&m_port, transmit_frame, handle_command);
+
+  bdp_console_register(&m_pingOpcode);
+  bdp_console_register(&m_windowOpcode);
+}
+
+void bdp_console_register(const bdp_opcode_t *opcode)
+{
+  if (m_opcodeCount < MAX_OPCODES)
+  {
+    m_opcodes[m_opcodeCount++] = opcode;
+  }
+}
+
+void bdp_console_poll(void)
+{
+  uint8_t data;
+  for (uint8_t i = 0; (i < BYTES_PER_POLL) && serial_read_byte(&data); i++)
+  {
+    if (data == BDP_CONSOLE_END)
+    {
+      if ((m_rxState == RX_STATE_FRAME) && (m_frameLength > 0))
+      {
+        // Bad CRCs and partial frames are dropped by the port, the host retries with the same sequence number
+        (void)bdp_port_received_command_crc(&m_port, &m_frame[0], m_frameLength, m_frameCrc);
+        m_rxState = RX_STATE_TEXT;
+      }
+      else if ((m_rxState == RX_STATE_TEXT) || (m_rxState == RX_STATE_FRAME))
+      {
+        // Opening end, or an empty frame from a host that flushes the line with an extra end
+        m_rxState = RX_STATE_FRAME;
+      }
+      else
+      {
+        // End of a frame that was too long or cut off after an escape
+        m_rxState = RX_STATE_TEXT;
+      }
+      m_frameLength = 0;
+      m_frameCrc = BDP_CRC_INIT;
+      continue;
+    }
+
+    switch (m_rxState)
+    {
+    case RX_STATE_TEXT:
+      serial_console_handle_byte(data);
+      break;
+    case RX_STATE_FRAME:
+      if (data == BDP_CONSOLE_ESC)
+      {
+        m_rxState = RX_STATE_ESCAPE;
+        break;
+      }
+      store_frame_byte(data);
+      break;
+    case RX_STATE_ESCAPE:
+      m_rxState = RX_STATE_FRAME;
+      store_frame_byte((data == BDP_CONSOLE_ESC_END) ? BDP_CONSOLE_END : (data == BDP_CONSOLE_ESC_ESC) ? BDP_CONSOLE_ESC : data);
+      break;
+    case RX_STATE_DISCARD:
+      break;
+    }
+  }
+}
+
+static void store_frame_byte(uint8_t data)
+{
+  if (m_frameLength < sizeof(m_frame))
+  {
+    m_frame[m_frameLength++] = data;
+    m_frameCrc = bdp_crc_update(m_frameCrc, data);
+  }
+  else
+  {
+    m_rxState = RX_STATE_DISCARD;
+  }
+}
+
+static bool transmit_frame(const uint8_t *data, uint16_t size)
+{
+  // Escape straight into the transmit buffer. Worst case every byte needs an escape, never send half a frame.
+  serial_tx_reservation_t reservation;
+  if (!serial_tx_reserve(&reservation, 2 * size + 2))
+  {
+    return false;
+  }
+
+  serial_tx_put(&reservation, BDP_CONSOLE_END);
+  for (uint16_t i = 0; i < size; i++)
+  {
+    put_escaped(&reservation, data[i]);
+  }
+  serial_tx_put(&reservation, BDP_CONSOLE_END);
+
+  serial_tx_commit(&reservation);
+  return true;
+}
+
+bool bdp_console_send_event(uint8_t opcode, const uint8_t *data, uint8_t length)
+{
+  serial_tx_reservation_t reservation;
+  if (!serial_tx_reserve(&reservation, BDP_CONSOLE_EVENT_SIZE(length)))
+  {
+    return false;
+  }
+
+  // Nothing to cache for a retry, so the frame is escaped straight into the transmit buffer while the CRC is updated
+  const bdp_header_t header = { .flags = BDP_FLAG_EVENT, .seqNumber = m_eventSeqNumber++, .dataLength = 1 + length };
+  const uint8_t *headerBytes = (const uint8_t*)&header;
+  uint16_t crc = BDP_CRC_INIT;
+
+  serial_tx_put(&reservation, BDP_CONSOLE_END);
+  for (uint8_t i = 0; i < sizeof(bdp_header_t); i++)
+  {
+    crc = bdp_crc_update(crc, headerBytes[i]);
+    put_escaped(&reservation, headerBytes[i]);
+  }
+  crc = bdp_crc_update(crc, opcode);
+  put_escaped(&reservation, opcode);
+  for (uint8_t i = 0; i < length; i++)
+  {
+    crc = bdp_crc_update(crc, data[i]);
+    put_escaped(&reservation, data[i]);
+  }
+  put_escaped(&reservation, crc >> 8);
+  put_escaped(&reservation, crc & 0xFF);
+  serial_tx_put(&reservation, BDP_CONSOLE_END);
+
+  serial_tx_commit(&reservation);
+  return true;
+}
+
+static void put_escaped(serial_tx_reservation_t *reservation, uint8_t data)
+{
+  if (data == BDP_CONSOLE_END)
+  {
+    serial_tx_put(reservation, BDP_CONSOLE_ESC);
+    serial_tx_put(reservation, BDP_CONSOLE_ESC_END);
+  }
+  else if (data == BDP_CONSOLE_ESC)
+  {
+    serial_tx_put(reservation, BDP_CONSOLE_ESC);
+    serial_tx_put(reservation, BDP_CONSOLE_ESC_ESC);
+  }
+  else
+  {
+    serial_tx_put(reservation, data);
+  }
+}
+
+static bool handle_command(const bdp_header_t *header)
+{
+  const uint8_t *payload = (const uint8_t*)(header + 1);
+  if (header->dataLength == 0)
+  {
+    return false;
+  }
+
+  const bdp_opcode_t *opcode = NULL;
+  for (uint8_t i = 0; i < m_opcodeCount; i++)
+  {
+    if (m_opcodes[i]->opcode == payload[0])
+    {
+      opcode = m_opcodes[i];
+      break;
+    }
+  }
+
+  if (opcode == NULL)
+  {
+    return false;
+  }
+
+  // The port has claimed the window slot for this command, the handler writes its results straight into it
+  uint8_t *response = bdp_port_begin_response(&m_port, header->seqNumber);
+  if (response == NULL)
+  {
+    return true;
+  }
+
+  uint8_t responseLength = 0;
+  response[0] = opcode->handler(&payload[1], header->dataLength - 1, &response[1], &responseLength);
+
+  if ((header->flags & BDP_FLAG_DO_NOT_RESPOND) == 0)
+  {
+    (void)bdp_port_transmit_response(&m_port, header->seqNumber, &response[0], 1 + responseLength);
+  }
+
+  return true;
+}
+
+static bdp_result_code_t ping_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  return BDP_RESULT_OK;
+}
+
+static bdp_result_code_t window_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  // Changing the window forgets the cached responses, the response to this command goes into the new window
+  if ((length > 0) && !bdp_port_set_window_size(&m_port, data[0]))
+  {
+    return BDP_RESULT_INVALID_ARGUMENT;
+  }
+
+  response[0] = bdp_port_get_window_size(&m_port);
+  response[1] = BDP_MAX_WINDOW_SIZE;
+  *responseLength = 2;
+  return BDP_RESULT_OK;
+}
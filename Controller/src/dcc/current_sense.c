@@ -1,16 +1,77 @@
 #include "dcc/current_sense.h"
-#include "sysb/events.h"
-#include "arduino/platform.h"
-#include "arduino/gpio.h"
+#include "dcc/dcc.h"
+#include "events.h"
+#include "platform.h"
+#include "gpio.h"
+#include "adc.h"
 #include <avr/interrupt.h>
 #include <avr/cpufunc.h>
+#include <util/atomic.h>
 
-// The goal is to provide an averaged sample every millisecond or so. We use 32 samples
-#define SAMPLE_SUM_SHIFT          (5)
-#define MAX_SAMPLE_COUNT          (1 << SAMPLE_SUM_SHIFT)
+// The goal is to provide an averaged sample every millisecond or so. By default we average 32 samples taken at 32 kHz.
+#define DEFAULT_SAMPLE_PERIOD     (500)
+#define DEFAULT_AVERAGE_SHIFT     (5)
+// The ADC needs 13 of its 1 MHz clocks per conversion, leave room for the interrupt as well
+#define MIN_SAMPLE_PERIOD         (400)
+// At least one conversion per millisecond, the time base below moves by at most a millisecond per sample
+#define CYCLES_PER_MS             (F_CPU / 1000)
+#define MAX_SAMPLE_PERIOD         (CYCLES_PER_MS - 1)
+#define MAX_AVERAGE_SHIFT         (6)
+#define IIR_FRACTION_BITS         (6)
 
-static volatile uint16_t sampleCount;
-static volatile uint32_t sampleSum;
+// Close to full scale by default, what that means in amps depends on the sense resistor
+#define DEFAULT_TRIP_THRESHOLD    (900)
+// The first retry comes quickly, a short that stays doubles the wait every time
+#define FIRST_RETRY_DELAY_MS      (100)
+#define MAX_RETRY_DELAY_MS        (6400)
+// After running this long without a trip the next one starts with the first delay again
+#define HEALTHY_TIME_MS           (2000)
+
+static volatile uint8_t sampleCount;
+
+// Filter chain: optional median of 3, a moving average or second order CIC decimator, then an optional single pole IIR.
+// The configuration only changes with interrupts disabled.
+static current_sense_filter_t filter = { DEFAULT_SAMPLE_PERIOD, DEFAULT_AVERAGE_SHIFT, 1, 0, false };
+static uint8_t samplesPerOutput = 1 << DEFAULT_AVERAGE_SHIFT;
+static uint16_t medianHistory[2];
+static uint32_t integrator1;
+static uint32_t integrator2;
+static uint32_t previousIntegrator1;
+static uint32_t previousIntegrator2;
+static uint32_t previousComb;
+static int32_t iirState;
+
+// Interrupt cost in CPU cycles, timer 1 runs at the CPU clock and restarts with every conversion trigger
+static volatile uint16_t maxCycles;
+static volatile uint32_t cycleSum;
+static volatile uint16_t cycleCount;
+
+// Millisecond time base made from the sample period, so it stays right whatever the filter does to the output rate.
+// The trip retry, the telemetry ring and the samples posted to the main loop all run on it.
+static uint16_t msCycles;
+static uint16_t lastOutput;
+
+// Overcurrent trip, all of it runs in the ADC interrupt
+static volatile uint16_t tripThreshold = DEFAULT_TRIP_THRESHOLD;
+static volatile uint16_t tripCount;
+static volatile uint16_t peakCurrent;
+static volatile uint16_t retryDelayMs;      // Delay for the next retry, 0 when there was no recent trip
+static volatile uint16_t retryTimeLeftMs;   // Output is off while this is not 0
+static volatile uint16_t healthyTimeMs;
+
+// Telemetry ring, written by the ADC interrupt
+static current_sense_sample_t ring[CURRENT_SENSE_RING_SIZE];
+static volatile uint8_t ringReadIndex;
+static volatile uint8_t ringCount;
+static volatile uint8_t decimation = 1;
+static uint8_t decimationCounter;
+static uint16_t timeMs;
+
+static void reset_filter(void);
+
+static void on_sample(uint16_t sample);
+
+static inline void on_millisecond(void);
 
 void current_sense_initialize(void)
 {
@@ -19,66 +80,307 @@ void current_sense_initialize(void)
   TCCR1A = (1 << WGM11) | (1 << WGM10);
   TCCR1B = (1 << WGM12) | (1 << WGM13);
   // 16 MHz clock, with this we trigger at 32kHz
-  OCR1A = 500;
+  OCR1A = DEFAULT_SAMPLE_PERIOD;
 
-  // Set up ADC. It takes 13 cycles for the ADC to perform its sampling.
-  // Just put it at 1 MHz
-  ADCSRA = (1 << ADIE) | ADC_PRESCALER_16;
-
-  // Use ADC2 as input, this is pin PC2
+  // Use ADC2 as input, this is pin PC2. The ADC itself belongs to the scheduler, which has to be initialized first.
   gpio_reset_pin(GPIO_PORT_C, GPIO_PIN_2);
   gpio_configure_input(GPIO_PORT_C, GPIO_PIN_2);
-  ADMUX = (1 << REFS0) | ADC_CHANNEL_SINGLE_2;
-
-  // Use timer 1 overflow as trigger source
-  ADCSRB = ADC_TRIGGER_SOURCE_TIM1_OVF;
 }
 
 void current_sense_start(void)
 {
   // Reset timer and state
   sampleCount = 0;
-  sampleSum = 0;
+  reset_filter();
+  msCycles = 0;
+  lastOutput = 0;
+  retryDelayMs = 0;
+  retryTimeLeftMs = 0;
+  healthyTimeMs = 0;
   TCNT1 = 0;
   // Clear overflow flag
-  TIFR1 |= (1 << TOV1);
+  TIFR1 = (1 << TOV1);
 
   _MemoryBarrier();
 
   // Start timer
   TCCR1B |= TIMER_PRESCALER_1;
 
-  // Enable ADC and auto trigger
-  ADCSRA |= (1 << ADEN) | (1 << ADATE);
+  // Convert ADC2 on every overflow, the scheduler fits the slow channels in between
+  adc_start_stream(ADC_CHANNEL_SINGLE_2, on_sample);
 }
 
 void current_sense_stop(void)
 {
-  // Disable ADC and auto trigger
-  ADCSRA &= ~((1 << ADEN) | (1 << ADATE));
+  adc_stop_stream();
 
   // Stop timer
   TCCR1B &= ~(TIMER_PRESCALER_1);
 }
 
-ISR(ADC_vect)
+bool current_sense_set_filter(const current_sense_filter_t* config)
 {
-  sampleSum += ADCW;
-  if (++sampleCount == MAX_SAMPLE_COUNT)
+  if ((config->samplePeriod < MIN_SAMPLE_PERIOD) || (config->samplePeriod > MAX_SAMPLE_PERIOD) || (config->averageShift > MAX_AVERAGE_SHIFT) ||
+      (config->cicOrder < 1) || (config->cicOrder > 2) || (config->iirShift > 8))
   {
-    message_t message;
-    message.id = MESSAGE_ID_ADC_SAMPLES;
+    return false;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    filter = *config;
+    samplesPerOutput = 1 << config->averageShift;
+    OCR1A = config->samplePeriod;
+    sampleCount = 0;
+    reset_filter();
+  }
+  return true;
+}
+
+void current_sense_get_filter(current_sense_filter_t* config)
+{
+  *config = filter;
+}
 
-    sampleSum >>= SAMPLE_SUM_SHIFT;
-    uint16_t *data = (uint16_t*)&message.data[0];
-    *data = sampleSum;
+void current_sense_get_cycles(uint16_t* average, uint16_t* maximum)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    *average = (cycleCount == 0) ? 0 : (uint16_t)(cycleSum / cycleCount);
+    *maximum = maxCycles;
+  }
+}
+
+static void reset_filter(void)
+{
+  medianHistory[0] = medianHistory[1] = 0;
+  integrator1 = integrator2 = 0;
+  previousIntegrator1 = previousIntegrator2 = 0;
+  previousComb = 0;
+  iirState = 0;
+  maxCycles = 0;
+  cycleSum = 0;
+  cycleCount = 0;
+}
 
+static inline uint16_t median_of_3(uint16_t a, uint16_t b, uint16_t c)
+{
+  if (a > b)
+  {
+    uint16_t temp = a;
+    a = b;
+    b = temp;
+  }
+  // a <= b now, the median is b unless c is below it
+  if (c < b)
+  {
+    return (c > a) ? c : a;
+  }
+  return b;
+}
+
+void current_sense_set_trip_threshold(uint16_t threshold)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    tripThreshold = threshold;
+  }
+}
+
+void current_sense_get_trip_status(current_sense_trip_status_t* status)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    status->threshold = tripThreshold;
+    status->tripCount = tripCount;
+    status->peakCurrent = peakCurrent;
+    status->retryTimeLeftMs = retryTimeLeftMs;
+  }
+}
+
+void current_sense_reset_trip_status(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    tripCount = 0;
+    peakCurrent = 0;
+  }
+}
+
+void current_sense_set_decimation(uint8_t value)
+{
+  decimation = (value == 0) ? 1 : value;
+}
+
+uint8_t current_sense_get_decimation(void)
+{
+  return decimation;
+}
+
+uint8_t current_sense_read_samples(current_sense_sample_t* samples, uint8_t maxCount)
+{
+  uint8_t count = 0;
+
+  // The interrupt moves the read index itself when the ring overflows
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    while ((count < maxCount) && (ringCount > 0))
+    {
+      samples[count++] = ring[ringReadIndex];
+      ringReadIndex = (ringReadIndex + 1) % CURRENT_SENSE_RING_SIZE;
+      ringCount--;
+    }
+  }
+
+  return count;
+}
+
+uint8_t current_sense_get_sample_count(void)
+{
+  return ringCount;
+}
+
+// Runs in the ADC interrupt for every stream conversion
+static void on_sample(uint16_t sample)
+{
+  uint16_t startTicks = TCNT1;
+
+  if (filter.median)
+  {
+    // A single sample spike never makes it past the median
+    uint16_t filtered = median_of_3(sample, medianHistory[0], medianHistory[1]);
+    medianHistory[1] = medianHistory[0];
+    medianHistory[0] = sample;
+    sample = filtered;
+  }
+
+  if (sample > peakCurrent)
+  {
+    peakCurrent = sample;
+  }
+
+  // Check every sample so a short is caught within tens of microseconds instead of at the next average
+  if ((retryTimeLeftMs == 0) && (tripThreshold != 0) && (sample >= tripThreshold))
+  {
+    dcc_set_output_enabled(false);
+
+    tripCount++;
+    healthyTimeMs = 0;
+    retryDelayMs = (retryDelayMs == 0) ? FIRST_RETRY_DELAY_MS : retryDelayMs << 1;
+    if (retryDelayMs > MAX_RETRY_DELAY_MS)
+    {
+      retryDelayMs = MAX_RETRY_DELAY_MS;
+    }
+    retryTimeLeftMs = retryDelayMs;
+
+    message_t message;
+    message.id = MESSAGE_ID_OVERCURRENT;
+    current_sense_trip_message_t *trip = (current_sense_trip_message_t*)&message.data[0];
+    trip->tripCount = tripCount;
+    trip->current = sample;
+    trip->retryDelayMs = retryDelayMs;
     event_post_message(&message);
+  }
+
+  // The integrators wrap around, the differences taken at the output rate are still exact
+  integrator1 += sample;
+  if (filter.cicOrder == 2)
+  {
+    integrator2 += integrator1;
+  }
 
-    sampleSum = 0;
+  if (++sampleCount == samplesPerOutput)
+  {
+    uint16_t output;
+    if (filter.cicOrder == 2)
+    {
+      // Two combs, the gain is the square of the decimation factor
+      uint32_t comb = integrator2 - previousIntegrator2;
+      previousIntegrator2 = integrator2;
+      output = (comb - previousComb) >> (2 * filter.averageShift);
+      previousComb = comb;
+    }
+    else
+    {
+      output = (integrator1 - previousIntegrator1) >> filter.averageShift;
+      previousIntegrator1 = integrator1;
+    }
+
+    if (filter.iirShift != 0)
+    {
+      iirState += (((int32_t)output << IIR_FRACTION_BITS) - iirState) >> filter.iirShift;
+      output = iirState >> IIR_FRACTION_BITS;
+    }
+
+    lastOutput = output;
     sampleCount = 0;
   }
 
-  // Clear overflow flag
-  TIFR1 |= (1 << TOV1);
-}
\ No newline at end of file
+  // Timer 1 counts from 0 to samplePeriod for every trigger
+  msCycles += filter.samplePeriod + 1;
+  if (msCycles >= CYCLES_PER_MS)
+  {
+    msCycles -= CYCLES_PER_MS;
+    on_millisecond();
+  }
+
+  // The register pushes before the first line are not counted, they are the same for every filter configuration
+  uint16_t endTicks = TCNT1;
+  uint16_t cycles = endTicks - startTicks;
+  if (endTicks < startTicks)
+  {
+    // The timer passed TOP while we were busy
+    cycles += filter.samplePeriod + 1;
+  }
+  if (cycles > maxCycles)
+  {
+    maxCycles = cycles;
+  }
+  if (cycleCount < UINT16_MAX)
+  {
+    cycleSum += cycles;
+    cycleCount++;
+  }
+}
+
+// Runs in the ADC interrupt once per millisecond. The main loop gets the latest output sample at this rate
+// whatever the filter is set to, so a fast output cannot flood the event queue and ACK widths stay in ms.
+static inline void on_millisecond(void)
+{
+  if (retryTimeLeftMs != 0)
+  {
+    if (--retryTimeLeftMs == 0)
+    {
+      // Try again, the next sample trips right away if the short is still there
+      dcc_set_output_enabled(true);
+    }
+  }
+  else if ((retryDelayMs != 0) && (++healthyTimeMs == HEALTHY_TIME_MS))
+  {
+    retryDelayMs = 0;
+  }
+
+  message_t message;
+  message.id = MESSAGE_ID_ADC_SAMPLES;
+
+  uint16_t *data = (uint16_t*)&message.data[0];
+  *data = lastOutput;
+
+  event_post_message(&message);
+
+  timeMs++;
+  if (++decimationCounter >= decimation)
+  {
+    decimationCounter = 0;
+    if (ringCount == CURRENT_SENSE_RING_SIZE)
+    {
+      // Nobody is reading, drop the oldest sample
+      ringReadIndex = (ringReadIndex + 1) % CURRENT_SENSE_RING_SIZE;
+      ringCount--;
+    }
+    current_sense_sample_t* entry = &ring[(ringReadIndex + ringCount) % CURRENT_SENSE_RING_SIZE];
+    entry->timeMs = timeMs;
+    entry->value = lastOutput;
+    ringCount++;
+  }
+}
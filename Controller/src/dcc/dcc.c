@@ -1,58 +1,179 @@
 #include "dcc/dcc.h"
 #include "dcc/current_sense.h"
-#include "arduino/gpio.h"
-#include "arduino/platform.h"
-#include "sysb/timer.h"
-#include "sysb/events.h"
+#include "dcc/dcc_refresh.h"
+#include "dcc/dcc_pom.h"
+#include "dcc/dcc_service_mode.h"
+#include "dcc/dcc_railcom.h"
+#include "dcc/dcc_packet.h"
+#include "gpio.h"
+#include "platform.h"
+#include "timer.h"
+#include "events.h"
+#include "atomic.h"
 #include <stddef.h>
 #include <string.h>
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/cpufunc.h>
+#include <util/atomic.h>
 
 #define IDLE_TIME_MS                (28)        // Time since the start of the last message before we queue an idle message. Maximum is 30ms according to spec.
-#define MAX_BUFFER_SIZE             (32)        // Max size of a DCC message buffer
-#define NR_OF_BUFFERS               (5)         // Amount of DCC message buffers, depth of the transmission queue
+#define MAX_BUFFER_SIZE             (32)        // Max size of a DCC message
+#define NORMAL_ARENA_SIZE           (252)       // Bytes for packets in the transmission queue, about 20 packets of 3-4 bytes
+#define EXPRESS_ARENA_SIZE          (48)        // Bytes for packets in the express lane
 #define NORMAL_PREAMBLE_LENGTH      (16)        // Amount of 1 bits in a normal preamble
 #define LONG_PREAMBLE_LENGTH        (22)        // Amount of 1 bits in a long preamble used for service mode
 #define ONE_BIT_HALF_PERIOD_US      (58)        // Half period duration when outputting a 1 bit
 #define ZERO_BIT_HALF_PERIOD_US     (100)       // Half period duration when outputting a 0 bit
+#define CUTOUT_START_US             (29)        // Start of the RailCom cutout after the packet end bit, 26-32us according to spec
+#define CUTOUT_END_US               (470)       // End of the RailCom cutout after the packet end bit, 454-488us according to spec
+#define EMERGENCY_STOP_REPEAT_COUNT (5)         // Amount of broadcast emergency stop packets sent back to back
+#define MIN_PACKET_SIZE             (3)         // Decoders ignore anything shorter than address, instruction and checksum
 
-typedef struct
+// Timer 4 runs at 0.5us per tick, these are the compare values that get loaded for each bit. The timer counts from 0 up to and
+// including TOP, and an output switches when the tick that matches its compare value is over. Both are one less than the ticks wanted.
+#define ONE_BIT_COMPARE             (ONE_BIT_HALF_PERIOD_US * 2 - 1)
+#define ONE_BIT_TOP                 (ONE_BIT_HALF_PERIOD_US * 2 * 2 - 1)
+#define ZERO_BIT_COMPARE            (ZERO_BIT_HALF_PERIOD_US * 2 - 1)
+#define ZERO_BIT_TOP                (ZERO_BIT_HALF_PERIOD_US * 2 * 2 - 1)
+#define CUTOUT_START_COMPARE        (CUTOUT_START_US * 2 - 1)
+#define CUTOUT_END_TOP              (CUTOUT_END_US * 2 - 1)
+
+// Signal timing limits for a command station, NMRA S-9.1 and S-9.2 (and RP-9.2.2 for service mode, S-9.3.2 for the cutout)
+#define SPEC_ONE_BIT_HALF_PERIOD_MIN_US     (55)
+#define SPEC_ONE_BIT_HALF_PERIOD_MAX_US     (61)
+#define SPEC_ZERO_BIT_HALF_PERIOD_MIN_US    (95)
+#define SPEC_ZERO_BIT_HALF_PERIOD_MAX_US    (9900)
+#define SPEC_MIN_PREAMBLE_LENGTH            (14)
+#define SPEC_MIN_LONG_PREAMBLE_LENGTH       (20)
+#define SPEC_CUTOUT_START_MIN_US            (26)
+#define SPEC_CUTOUT_START_MAX_US            (32)
+#define SPEC_CUTOUT_END_MIN_US              (454)
+#define SPEC_CUTOUT_END_MAX_US              (488)
+
+// Any change to the timing constants has to stay within spec, the compiler checks so it can't slip through a refactoring
+_Static_assert((ONE_BIT_HALF_PERIOD_US >= SPEC_ONE_BIT_HALF_PERIOD_MIN_US) && (ONE_BIT_HALF_PERIOD_US <= SPEC_ONE_BIT_HALF_PERIOD_MAX_US), "1 bit half period out of spec");
+_Static_assert((ZERO_BIT_HALF_PERIOD_US >= SPEC_ZERO_BIT_HALF_PERIOD_MIN_US) && (ZERO_BIT_HALF_PERIOD_US <= SPEC_ZERO_BIT_HALF_PERIOD_MAX_US), "0 bit half period out of spec");
+_Static_assert(NORMAL_PREAMBLE_LENGTH >= SPEC_MIN_PREAMBLE_LENGTH, "Preamble too short");
+_Static_assert(LONG_PREAMBLE_LENGTH >= SPEC_MIN_LONG_PREAMBLE_LENGTH, "Service mode preamble too short");
+_Static_assert((CUTOUT_START_US >= SPEC_CUTOUT_START_MIN_US) && (CUTOUT_START_US <= SPEC_CUTOUT_START_MAX_US), "RailCom cutout start out of spec");
+_Static_assert((CUTOUT_END_US >= SPEC_CUTOUT_END_MIN_US) && (CUTOUT_END_US <= SPEC_CUTOUT_END_MAX_US), "RailCom cutout end out of spec");
+_Static_assert((ZERO_BIT_HALF_PERIOD_US * 2 * 2) <= 0xFFFF, "0 bit period does not fit in timer 4");
+_Static_assert((CUTOUT_END_US * 2) <= 0xFFFF, "RailCom cutout does not fit in timer 4");
+
+// Encoded packet: a start bit before every data byte and the packet end bit. The preamble is added by the interrupt.
+#define ENCODED_BIT_COUNT(size)     (((uint16_t)(size) * 9) + 1)
+#define ENCODED_SIZE(size)          ((ENCODED_BIT_COUNT(size) + 7) / 8)
+#define ENTRY_SIZE(size)            (sizeof(entry_t) + ENCODED_SIZE(size))
+#define PREAMBLE_LENGTH(flags)      (((flags) & DCC_MESSAGE_FLAG_LONG_PREAMBLE) ? LONG_PREAMBLE_LENGTH : NORMAL_PREAMBLE_LENGTH)
+
+// RailCom cutout progress. Each step happens at the start of a timer period, the compare values are loaded one period ahead.
+typedef enum
 {
-  bool inUse;
-  dcc_message_flags_t flags;
-  uint8_t messageId;
-  uint8_t size;
-  uint8_t data[MAX_BUFFER_SIZE];
-} buffer_t;
+  CUTOUT_STATE_NONE,
+  CUTOUT_STATE_PENDING,       // Packet end bit has been loaded, the cutout follows it
+  CUTOUT_STATE_LOADED,        // Cutout has been loaded, it starts with the next period
+  CUTOUT_STATE_RUNNING,       // Cutout is on the track, it ends with the next period
+} cutout_state_t;
 
+// Packets that only carry the latest state of a decoder. A newer packet of the same class for the same address makes a queued one obsolete.
 typedef enum
 {
-  DCC_STATE_IDLE,
-  DCC_STATE_PREAMBLE,
-  DCC_STATE_START_BIT,
-  DCC_STATE_DATA,
-  DCC_STATE_STOP_BIT
-} dcc_state_t;
+  PACKET_CLASS_NONE,          // Packet has to be sent as is
+  PACKET_CLASS_SPEED,
+  PACKET_CLASS_FUNCTION_GROUP_1,
+  PACKET_CLASS_FUNCTION_GROUP_2,
+  PACKET_CLASS_FUNCTION_GROUP_3,
+  PACKET_CLASS_FUNCTION_GROUP_4,
+  PACKET_CLASS_FUNCTION_GROUP_5,
+} packet_class_t;
+
+// Measurement of the time between an emergency stop request and the stop packet going on the wire
+typedef enum
+{
+  STOP_MEASURE_NONE,
+  STOP_MEASURE_WAITING,       // Emergency stop requested, the time on the wire is being added up
+  STOP_MEASURE_STARTING,      // First bit of the stop packet has been loaded, it starts with the next period
+} stop_measure_t;
+
+// Packet in a queue arena. Entries are stored back to back and never wrap around the end of the arena.
+typedef struct __attribute__((packed))
+{
+  uint8_t length;                     // Bytes taken by the entry including this header, 0 marks the unused end of the arena
+  uint8_t size;                       // Amount of data bytes in the packet
+  uint8_t flags;
+  uint8_t messageId;
+  uint8_t packetClass;
+  uint16_t address;                   // Decoder address, only valid when packetClass is set
+  uint8_t bits[];                     // Bit stream to put on the wire after the preamble, MSB first
+} entry_t;
+
+// FIFO of variable length entries in a byte arena. The write side is only touched by queue_data, the read side only by the ISR.
+typedef struct
+{
+  uint8_t* arena;
+  uint8_t size;                     // Size of the arena in bytes
+  uint8_t writeOffset;
+  volatile uint8_t writeCount;      // Amount of packets ever queued, wraps around
+  volatile uint8_t readOffset;
+  volatile uint8_t readCount;       // Amount of packets ever completed, wraps around
+} queue_t;
+
+_Static_assert(ENTRY_SIZE(MAX_BUFFER_SIZE) <= EXPRESS_ARENA_SIZE, "Largest packet does not fit in the express lane");
+_Static_assert(NORMAL_ARENA_SIZE <= 255, "Arena offsets are 8 bit");
 
 static uint8_t nextMessageId;
 static uint8_t idleInsertTimer;
 static bool isRunning;
-static buffer_t buffers[NR_OF_BUFFERS];
-static volatile buffer_t* volatile transmitBuffer;    // Buffer being transmitted right now. May be NULL
+static uint8_t normalArena[NORMAL_ARENA_SIZE];
+static uint8_t expressArena[EXPRESS_ARENA_SIZE];
+static queue_t normalQueue = { .arena = &normalArena[0], .size = NORMAL_ARENA_SIZE };
+static queue_t expressQueue = { .arena = &expressArena[0], .size = EXPRESS_ARENA_SIZE };
+static volatile entry_t* volatile transmitEntry;      // Entry being transmitted right now. May be NULL
+static queue_t* volatile transmitQueue;               // Queue that transmitEntry belongs to
+
+// Transmitter state, only touched by the ISR once the timer is running
+static const uint8_t* pendingData;
+static uint8_t preambleBitsLeft;
+static uint16_t bitsLeftToTransmit;       // Bits after the preamble
+static uint8_t bitsLeftInByte;
+static uint8_t currentData;
+static cutout_state_t cutoutState;
+static uint8_t cutoutMessageId;
+static uint16_t loadedPeriodUs;       // Duration of the timer period loaded by the last interrupt
+static uint16_t runningPeriodUs;      // Duration of the timer period that is on the wire now
+
+// Emergency stop, the broadcast stop packet is encoded once and sent straight from here
+static uint8_t emergencyStopEntry[ENTRY_SIZE(3)];
+static volatile bool emergencyStopRequested;
+static uint8_t emergencyStopRepeatsLeft;
+static uint16_t abortAtBitsLeft;      // The packet on the wire is cut off when this many bits are left, 0 to let it finish
+static stop_measure_t stopMeasureState;
+static uint16_t stopLatencyUs;
 
-// Pending data, set to a 10 1100 111000 11110000 1111100000 111111000000 11111110000000
-//static uint8_t pendingData[] = { 0xb3, 0x8f, 0x0f, 0x83, 0xf0, 0x3f, 0x80 };
-static volatile uint8_t pendingDataIndex = 0;
-static volatile uint8_t bitsLeftToTransmit = 0;
-static volatile uint8_t currentData = 0;
-static volatile dcc_state_t state = DCC_STATE_IDLE;
+static bool railcomEnabled;
+static volatile bool cutoutEnabled;       // RailCom is enabled and we are on the main track
 
 static dcc_mode_t activeMode;
 
-static bool queue_data(dcc_message_flags_t flags, const uint8_t* data, uint8_t size, uint8_t *messageIdOut);
+static volatile dcc_statistics_t statistics;      // Mostly updated by the ISR
+
+static bool queue_data(queue_t* queue, dcc_message_flags_t flags, const uint8_t* data, uint8_t size, uint8_t *messageIdOut);
+static inline uint8_t queue_depth(const queue_t* queue);
+static packet_class_t get_packet_class(const uint8_t* data, uint8_t size, uint16_t *addressOut);
+static bool replace_queued_packet(queue_t* queue, dcc_message_flags_t flags, packet_class_t packetClass, uint16_t address,
+                                  const uint8_t* data, uint8_t size, uint8_t *messageIdOut);
+static entry_t* allocate_entry(queue_t* queue, uint8_t length);
+static inline uint8_t next_offset(const queue_t* queue, uint8_t offset, uint8_t length);
+static inline entry_t* get_entry(const queue_t* queue, uint8_t* offset);
+static void encode_packet(uint8_t *output, const uint8_t* data, uint8_t size);
 static void on_idle_timer(uint8_t timer);
+static bool queue_refresh_packet(void);
+static void stop_queued_packets(void);
+static inline void load_entry(volatile entry_t* entry);
+static inline void begin_transmission(void);
+static inline void end_transmission(void);
+static inline void plan_abort(void);
 
 void dcc_initialize(void)
 {
@@ -64,9 +185,9 @@ void dcc_initialize(void)
   // Prescaler of 8 gives us that 0.5us resolution
   TCCR4B = (1 << WGM42) | (1 << WGM43);
   // Set up OCR and ICR for a '1 bit' output signal
-  OCR4B = 58 * 2;
-  OCR4C = 58 * 2;
-  OCR4A = 58 * 2 * 2;
+  OCR4B = ONE_BIT_COMPARE;
+  OCR4C = ONE_BIT_COMPARE;
+  OCR4A = ONE_BIT_TOP;
 
   // Set up IOs as output
   DDRH |= (1 << DDH3) | (1 << DDH4) | (1 << DDH5);
@@ -81,16 +202,41 @@ void dcc_initialize(void)
   // Timer for inserting idle packets
   idleInsertTimer = timer_create(TIMER_MODE_SINGLE, on_idle_timer);
 
+  dcc_packet_t stopPacket;
+  entry_t* stopEntry = (entry_t*)&emergencyStopEntry[0];
+  dcc_packet_emergency_stop(&stopPacket, 0);
+  memset(stopEntry, 0, sizeof(emergencyStopEntry));
+  stopEntry->length = sizeof(emergencyStopEntry);
+  stopEntry->size = stopPacket.size;
+  encode_packet(&stopEntry->bits[0], &stopPacket.data[0], stopPacket.size);
+
+  dcc_refresh_initialize();
+  dcc_pom_initialize();
+  dcc_service_mode_initialize();
+  dcc_railcom_initialize();
   current_sense_initialize();
 }
 
 void dcc_start(dcc_mode_t mode)
 {
   bitsLeftToTransmit = 0;
-  pendingDataIndex = 0;
+  bitsLeftInByte = 0;
+  pendingData = NULL;
   currentData = 0;
-  transmitBuffer = NULL;
-  state = DCC_STATE_IDLE;
+  preambleBitsLeft = 0;
+  transmitEntry = NULL;
+  transmitQueue = NULL;
+  cutoutState = CUTOUT_STATE_NONE;
+  loadedPeriodUs = runningPeriodUs = ONE_BIT_HALF_PERIOD_US * 2;
+  emergencyStopRequested = false;
+  emergencyStopRepeatsLeft = 0;
+  abortAtBitsLeft = 0;
+  stopMeasureState = STOP_MEASURE_NONE;
+  cutoutEnabled = railcomEnabled && (mode == DCC_MODE_OPERATION);
+  normalQueue.writeOffset = normalQueue.readOffset = 0;
+  normalQueue.writeCount = normalQueue.readCount = 0;
+  expressQueue.writeOffset = expressQueue.readOffset = 0;
+  expressQueue.writeCount = expressQueue.readCount = 0;
   activeMode = mode;
 
   current_sense_start();
@@ -99,8 +245,11 @@ void dcc_start(dcc_mode_t mode)
 
   // Reset timer
   TCNT4 = 0;
-  // Enable pin outputs now
-  TCCR4A |= (1 << COM4B1) | (1 << COM4C1) | (1 << COM4C0);
+  // Enable pin outputs now, the overcurrent trip may already be switching them
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    dcc_set_output_enabled(true);
+  }
 
   _MemoryBarrier();
 
@@ -128,7 +277,7 @@ void dcc_stop(void)
   _MemoryBarrier();
 
   // Disable pin outputs
-  TCCR4A &= ~((1 << COM4B1) | (1 << COM4C1) | (1 << COM4C0));
+  dcc_set_output_enabled(false);
   // Stop the timer
   TCCR4B &= ~TIMER_PRESCALER_8;
     
@@ -138,6 +287,19 @@ void dcc_stop(void)
   timer_stop(idleInsertTimer);
 }
 
+void dcc_set_output_enabled(bool enabled)
+{
+  // Without the compare outputs the pins fall back to their low port value, so the bridge stops driving the track
+  if (enabled)
+  {
+    TCCR4A |= (1 << COM4B1) | (1 << COM4C1) | (1 << COM4C0);
+  }
+  else
+  {
+    TCCR4A &= ~((1 << COM4B1) | (1 << COM4C1) | (1 << COM4C0));
+  }
+}
+
 bool dcc_is_started(void)
 {
   return isRunning;
@@ -148,6 +310,17 @@ dcc_mode_t dcc_get_mode(void)
   return activeMode;
 }
 
+void dcc_set_railcom_enabled(bool enabled)
+{
+  railcomEnabled = enabled;
+  cutoutEnabled = enabled && (activeMode == DCC_MODE_OPERATION);
+}
+
+bool dcc_is_railcom_enabled(void)
+{
+  return railcomEnabled;
+}
+
 void dcc_on_tx_started(void)
 {
   if (!isRunning)
@@ -155,21 +328,14 @@ void dcc_on_tx_started(void)
     return;
   }
 
-  uint8_t nrOfBuffersInUse = 0;
-
-  for (int i = 0; i < NR_OF_BUFFERS; i++)
-  {
-    if (buffers[i].inUse)
+  // Check if there is anything queued besides the packet currently being transmitted
+  if ((queue_depth(&normalQueue) + queue_depth(&expressQueue)) <= 1) {
+    // Fill the gap with decoder refresh traffic, otherwise start idle timer to ensure idle packets are transmitted after this one
+    if (!queue_refresh_packet())
     {
-      nrOfBuffersInUse++;
+      timer_start(idleInsertTimer, IDLE_TIME_MS);
     }
   }
-
-  // Check if there is anything queued besides the packet currently being transmitted
-  if (nrOfBuffersInUse <= 1) {
-    // Start idle timer to ensure idle packets are transmitted after this one
-    timer_start(idleInsertTimer, IDLE_TIME_MS);
-  }
 }
 
 void dcc_on_tx_completed(void)
@@ -178,8 +344,38 @@ void dcc_on_tx_completed(void)
   {
     return;
   }
+}
+
+void dcc_emergency_stop(void)
+{
+  if (!isRunning || (activeMode != DCC_MODE_OPERATION))
+  {
+    return;
+  }
+
+  // Only the DCC interrupt has to be held off, this may be called from another interrupt
+  NO_IRQ_BLOCK(TIMSK4, TOIE4)
+  {
+    emergencyStopRequested = true;
+    if (stopMeasureState == STOP_MEASURE_NONE)
+    {
+      stopMeasureState = STOP_MEASURE_WAITING;
+      stopLatencyUs = 0;
+    }
+  }
+}
+
+void dcc_on_emergency_stop(const dcc_emergency_stop_message_t* message)
+{
+  statistics.emergencyStopLatencyUs = message->latencyUs;
+  if (message->latencyUs > statistics.maxEmergencyStopLatencyUs)
+  {
+    statistics.maxEmergencyStopLatencyUs = message->latencyUs;
+  }
 
-  // TODO: Send notification?
+  // Nothing that was queued or refreshed before the stop may start the locomotives again
+  dcc_refresh_stop_all();
+  stop_queued_packets();
 }
 
 bool dcc_queue_data(const uint8_t* data, uint8_t size, uint8_t *messageIdOut)
@@ -189,7 +385,7 @@ bool dcc_queue_data(const uint8_t* data, uint8_t size, uint8_t *messageIdOut)
   {
     flags |= DCC_MESSAGE_FLAG_LONG_PREAMBLE;
   }
-  return queue_data(flags, data, size, messageIdOut);
+  return queue_data(&normalQueue, flags, data, size, messageIdOut);
 }
 
 bool dcc_queue_data_internal(const uint8_t* data, uint8_t size, uint8_t *messageIdOut)
@@ -199,45 +395,300 @@ bool dcc_queue_data_internal(const uint8_t* data, uint8_t size, uint8_t *message
   {
     flags |= DCC_MESSAGE_FLAG_LONG_PREAMBLE;
   }
-  return queue_data(flags, data, size, messageIdOut);
+  return queue_data(&normalQueue, flags, data, size, messageIdOut);
+}
+
+bool dcc_queue_data_express(const uint8_t* data, uint8_t size, uint8_t *messageIdOut)
+{
+  dcc_message_flags_t flags = DCC_MESSAGE_FLAG_EXPRESS;
+  if (DCC_MODE_SERVICE == activeMode)
+  {
+    flags |= DCC_MESSAGE_FLAG_LONG_PREAMBLE;
+  }
+  return queue_data(&expressQueue, flags, data, size, messageIdOut);
+}
+
+uint8_t dcc_get_queue_depth(void)
+{
+  return queue_depth(&normalQueue);
+}
+
+uint8_t dcc_get_express_queue_depth(void)
+{
+  return queue_depth(&expressQueue);
+}
+
+void dcc_get_statistics(dcc_statistics_t *statisticsOut)
+{
+  // The ISR updates multi byte counters
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    memcpy(statisticsOut, (void*)&statistics, sizeof(dcc_statistics_t));
+  }
+}
+
+void dcc_reset_statistics(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    memset((void*)&statistics, 0, sizeof(dcc_statistics_t));
+  }
+}
+
+static inline uint8_t queue_depth(const queue_t* queue)
+{
+  return (uint8_t)(queue->writeCount - queue->readCount);
 }
 
-static bool queue_data(dcc_message_flags_t flags, const uint8_t* data, uint8_t size, uint8_t *messageIdOut)
+static bool queue_data(queue_t* queue, dcc_message_flags_t flags, const uint8_t* data, uint8_t size, uint8_t *messageIdOut)
 {
   if ((size > MAX_BUFFER_SIZE) || (!isRunning))
   {
     return false;
   }
 
-  for (int i = 0; i < NR_OF_BUFFERS; i++)
+  // Decoder state on the main track: a queued packet that has not started yet can simply be overwritten with the newer state
+  uint16_t address = 0;
+  packet_class_t packetClass = PACKET_CLASS_NONE;
+  if ((queue == &normalQueue) && (activeMode == DCC_MODE_OPERATION))
   {
-    if (false == buffers[i].inUse)
+    packetClass = get_packet_class(data, size, &address);
+    if ((packetClass != PACKET_CLASS_NONE) && replace_queued_packet(queue, flags, packetClass, address, data, size, messageIdOut))
     {
-      // Found an empty buffer, try to place data in it
-      memcpy(&buffers[i].data[0], data, size);
-      buffers[i].size = size;
-      buffers[i].flags = flags;
-      buffers[i].messageId = nextMessageId;
-
-      // Make sure that the inUse flag is set last so the interrupt can safely read the buffer contents
-      _MemoryBarrier();
-      
-      buffers[i].inUse = true;
-
-      if (NULL != messageIdOut)
+      return true;
+    }
+  }
+
+  uint8_t length = ENTRY_SIZE(size);
+  entry_t* entry = allocate_entry(queue, length);
+  if (entry == NULL)
+  {
+    statistics.rejectedPackets++;
+    return false;
+  }
+
+  // Encode the packet into the arena so the interrupt only has to shift out bits
+  entry->length = length;
+  entry->size = size;
+  entry->flags = flags;
+  entry->messageId = nextMessageId;
+  entry->packetClass = packetClass;
+  entry->address = address;
+  encode_packet(&entry->bits[0], data, size);
+
+  queue->writeOffset = next_offset(queue, (uint8_t)((uint8_t*)entry - queue->arena), length);
+
+  // Make sure that the write count is updated last so the interrupt can safely read the entry contents
+  _MemoryBarrier();
+
+  queue->writeCount++;
+
+  uint8_t depth = queue_depth(queue);
+  if (queue == &expressQueue)
+  {
+    if (depth > statistics.expressHighWater)
+    {
+      statistics.expressHighWater = depth;
+    }
+  }
+  else if (depth > statistics.queueHighWater)
+  {
+    statistics.queueHighWater = depth;
+  }
+
+  if (NULL != messageIdOut)
+  {
+    *messageIdOut = nextMessageId;
+  }
+
+  nextMessageId++;
+
+  return true;
+}
+
+
+static packet_class_t get_packet_class(const uint8_t* data, uint8_t size, uint16_t *addressOut)
+{
+  // Multi function decoder address, short (0-127, 0 is broadcast) or long (two bytes starting with 11)
+  uint8_t index = 0;
+  if (data[0] < 0x80)
+  {
+    *addressOut = data[0];
+    index = 1;
+  }
+  else if ((data[0] >= 0xC0) && (data[0] <= 0xE7) && (size > 2))
+  {
+    *addressOut = ((uint16_t)(data[0] & 0x3F) << 8) | data[1];
+    index = 2;
+  }
+  else
+  {
+    // Accessory decoders and idle packets
+    return PACKET_CLASS_NONE;
+  }
+
+  // Only packets with a single instruction followed by the checksum, anything else may carry more than decoder state
+  uint8_t instruction = data[index];
+  if (((instruction & 0xC0) == 0x40) && (size == index + 2))
+  {
+    // 14/28 step speed and direction
+    return PACKET_CLASS_SPEED;
+  }
+  else if ((instruction == 0x3F) && (size == index + 3))
+  {
+    // 128 step speed control
+    return PACKET_CLASS_SPEED;
+  }
+  else if (((instruction & 0xE0) == 0x80) && (size == index + 2))
+  {
+    return PACKET_CLASS_FUNCTION_GROUP_1;
+  }
+  else if (((instruction & 0xF0) == 0xB0) && (size == index + 2))
+  {
+    return PACKET_CLASS_FUNCTION_GROUP_2;
+  }
+  else if (((instruction & 0xF0) == 0xA0) && (size == index + 2))
+  {
+    return PACKET_CLASS_FUNCTION_GROUP_3;
+  }
+  else if ((instruction == 0xDE) && (size == index + 3))
+  {
+    return PACKET_CLASS_FUNCTION_GROUP_4;
+  }
+  else if ((instruction == 0xDF) && (size == index + 3))
+  {
+    return PACKET_CLASS_FUNCTION_GROUP_5;
+  }
+
+  return PACKET_CLASS_NONE;
+}
+
+static bool replace_queued_packet(queue_t* queue, dcc_message_flags_t flags, packet_class_t packetClass, uint16_t address,
+                                  const uint8_t* data, uint8_t size, uint8_t *messageIdOut)
+{
+  // Encode up front so the interrupt is only held off for the copy
+  uint8_t bits[ENCODED_SIZE(MAX_BUFFER_SIZE)];
+  encode_packet(&bits[0], data, size);
+  bool replaced = false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    // The oldest packet may already be on the wire, it has to go out unchanged
+    uint8_t offset = queue->readOffset;
+    uint8_t depth = queue_depth(queue);
+    if (transmitQueue == queue)
+    {
+      offset = next_offset(queue, offset, get_entry(queue, &offset)->length);
+      depth--;
+    }
+
+    for (; depth != 0; depth--)
+    {
+      entry_t* entry = get_entry(queue, &offset);
+      if ((entry->packetClass == packetClass) && (entry->address == address))
       {
-        *messageIdOut = nextMessageId;
+        if (ENTRY_SIZE(size) <= entry->length)
+        {
+          // Last writer wins. The entry keeps its place in the queue and its message ID, so both requesters see the transmission.
+          memcpy(&entry->bits[0], &bits[0], ENCODED_SIZE(size));
+          entry->size = size;
+          entry->flags = flags;
+          if (NULL != messageIdOut)
+          {
+            *messageIdOut = entry->messageId;
+          }
+          replaced = true;
+        }
+        else
+        {
+          // The new packet is longer and has to be queued behind it, only the newest one may be replaced from now on
+          entry->packetClass = PACKET_CLASS_NONE;
+        }
+        break;
       }
 
-      nextMessageId++;
-
-      return true;
+      offset = next_offset(queue, offset, entry->length);
     }
   }
 
-  return false;
+  return replaced;
+}
+
+static entry_t* allocate_entry(queue_t* queue, uint8_t length)
+{
+  // Read the depth first, the interrupt only frees up more space after that
+  uint8_t depth = queue_depth(queue);
+  uint8_t readOffset = queue->readOffset;
+  uint8_t writeOffset = queue->writeOffset;
+
+  if (readOffset > writeOffset)
+  {
+    // Free space is the gap up to the oldest entry
+    return (length <= (readOffset - writeOffset)) ? (entry_t*)&queue->arena[writeOffset] : NULL;
+  }
+  else if ((readOffset == writeOffset) && (depth != 0))
+  {
+    // Completely full
+    return NULL;
+  }
+
+  // Free space is the end of the arena and the start up to the oldest entry. Entries are never split, so the end may be skipped.
+  if (length <= (queue->size - writeOffset))
+  {
+    return (entry_t*)&queue->arena[writeOffset];
+  }
+  else if (length <= readOffset)
+  {
+    // Mark the end as unused so the interrupt continues at the start
+    queue->arena[writeOffset] = 0;
+    return (entry_t*)&queue->arena[0];
+  }
+
+  return NULL;
 }
 
+static inline uint8_t next_offset(const queue_t* queue, uint8_t offset, uint8_t length)
+{
+  offset += length;
+  return (offset == queue->size) ? 0 : offset;
+}
+
+static inline entry_t* get_entry(const queue_t* queue, uint8_t* offset)
+{
+  // An entry with length 0 marks the unused end of the arena, the next entry is at the start
+  if (queue->arena[*offset] == 0)
+  {
+    *offset = 0;
+  }
+  return (entry_t*)&queue->arena[*offset];
+}
+
+
+static void encode_packet(uint8_t *output, const uint8_t* data, uint8_t size)
+{
+  uint16_t bitIndex = 0;
+
+  // Start with all zeroes, only the 1 bits need to be written
+  memset(output, 0, ENCODED_SIZE(size));
+
+  for (uint8_t i = 0; i < size; i++)
+  {
+    // Start bit is a 0, already there
+    bitIndex++;
+
+    // Data byte bits, MSB first
+    for (uint8_t mask = 0x80; mask != 0; mask >>= 1, bitIndex++)
+    {
+      if (data[i] & mask)
+      {
+        output[bitIndex >> 3] |= (0x80 >> (bitIndex & 7));
+      }
+    }
+  }
+
+  // Packet end bit is a 1
+  output[bitIndex >> 3] |= (0x80 >> (bitIndex & 7));
+}
 
 static void on_idle_timer(uint8_t timer)
 {
@@ -248,138 +699,358 @@ static void on_idle_timer(uint8_t timer)
 
   if (activeMode == DCC_MODE_SERVICE)
   {
-    // Service mode, send reset message
+    // Service mode, send reset message. Everything on the programming track needs the long preamble.
     const uint8_t idleMsg[] = { 0x00, 0x00, 0x00 };
   
-    queue_data(DCC_MESSAGE_FLAG_NONE, &idleMsg[0], sizeof(idleMsg), NULL);
+    queue_data(&normalQueue, DCC_MESSAGE_FLAG_LONG_PREAMBLE, &idleMsg[0], sizeof(idleMsg), NULL);
   }
-  else
+  else if (!queue_refresh_packet())
   {
-    // Operation mode, send idle message
+    // Operation mode without any decoders to refresh, send idle message
     const uint8_t idleMsg[] = { 0xFF, 0x00, 0xFF };
     
-    queue_data(DCC_MESSAGE_FLAG_NONE, &idleMsg[0], sizeof(idleMsg), NULL);
+    queue_data(&normalQueue, DCC_MESSAGE_FLAG_IDLE, &idleMsg[0], sizeof(idleMsg), NULL);
   }
 }
 
-ISR(TIMER4_OVF_vect)
+static void stop_queued_packets(void)
 {
-  // ISR state
-  static uint8_t preambleCounter;
+  uint8_t offset;
+  uint8_t depth;
 
-  // ISR variables
-  volatile buffer_t* newBuffer;
-  uint8_t outputBit;
-  message_t message;
-  dcc_event_message_t* msgData = (dcc_event_message_t*)&message.data[0];
+  // Only the main loop writes to the arena, so the entries can be walked once the starting point is known
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    offset = normalQueue.readOffset;
+    depth = queue_depth(&normalQueue);
+  }
 
-  switch (state)
+  // Speed packets in the queue become emergency stops for the same decoder. They keep their message ID, so the host still sees them go out.
+  for (; depth != 0; depth--)
   {
-    case DCC_STATE_IDLE:
+    const entry_t* entry = get_entry(&normalQueue, &offset);
+    dcc_packet_t packet;
+    if ((entry->packetClass == PACKET_CLASS_SPEED) && dcc_packet_emergency_stop(&packet, entry->address))
     {
-      // Look for a new buffer to transmit
-      for (int i = 0; i < NR_OF_BUFFERS; i++)
-      {
-        newBuffer = &buffers[i];
-        if (newBuffer->inUse)
-        {
-          // Found a buffer to transmit, move to PREAMBLE state
-          transmitBuffer = newBuffer;
-
-          // Indicate to application that a transmission has started
-          message.id = MESSAGE_ID_DCC_TX_STARTED;
-          msgData->flags = transmitBuffer->flags;
-          msgData->dccMessageId = transmitBuffer->messageId;
-          event_post_message(&message);
-
-          preambleCounter = (transmitBuffer->flags & DCC_MESSAGE_FLAG_LONG_PREAMBLE) ? LONG_PREAMBLE_LENGTH : NORMAL_PREAMBLE_LENGTH;
-          state = DCC_STATE_PREAMBLE;
-          break;
-        }
-      }
-      // Idle state is just transmitting 1
-      outputBit = 1;
-      break;
+      // The entry may have been sent in the meantime, the replacement checks this again with interrupts off
+      replace_queued_packet(&normalQueue, entry->flags, PACKET_CLASS_SPEED, entry->address, &packet.data[0], packet.size, NULL);
     }
-    case DCC_STATE_PREAMBLE:
+
+    offset = next_offset(&normalQueue, offset, entry->length);
+  }
+}
+
+static bool queue_refresh_packet(void)
+{
+  if (activeMode != DCC_MODE_OPERATION)
+  {
+    // Refresh packets only belong on the main track
+    return false;
+  }
+
+  // Programming on main goes first, it lets refresh traffic through between decoders.
+  // When there is nothing to refresh the second try lets the next programming operation go out right away.
+  dcc_packet_t packet;
+  bool programming = dcc_pom_get_packet(&packet, false);
+  if (!programming && !dcc_refresh_get_packet(&packet))
+  {
+    programming = dcc_pom_get_packet(&packet, true);
+    if (!programming)
     {
-      // Output the preamble bits
-      outputBit = 1;
-      preambleCounter--;
-      if (preambleCounter == 0)
-      {
-        // Get ready to transmit data
-        pendingDataIndex = 0;
-        state = DCC_STATE_START_BIT;
-      }
-      break;
+      return false;
     }
-    case DCC_STATE_START_BIT:
+  }
+
+  // A packet only counts as sent once it is in the queue, otherwise the same one is picked again
+  if (!queue_data(&normalQueue, DCC_MESSAGE_FLAG_NONE, &packet.data[0], packet.size, NULL))
+  {
+    return false;
+  }
+
+  dcc_pom_packet_queued(programming);
+  if (!programming)
+  {
+    dcc_refresh_packet_queued();
+  }
+  return true;
+}
+
+static inline void load_entry(volatile entry_t* entry)
+{
+  transmitEntry = entry;
+  pendingData = (const uint8_t*)&entry->bits[0];
+  preambleBitsLeft = PREAMBLE_LENGTH(entry->flags);
+  bitsLeftToTransmit = ENCODED_BIT_COUNT(entry->size);
+  bitsLeftInByte = 0;
+}
+
+static inline void begin_transmission(void)
+{
+  // An emergency stop goes before anything else. It doesn't belong to a queue and isn't reported to the application.
+  if (emergencyStopRepeatsLeft != 0)
+  {
+    emergencyStopRepeatsLeft--;
+    transmitQueue = NULL;
+    load_entry((entry_t*)&emergencyStopEntry[0]);
+    return;
+  }
+
+  // The express lane always goes first, otherwise take the oldest packet
+  queue_t* queue = &expressQueue;
+  if (queue->writeCount == queue->readCount)
+  {
+    queue = &normalQueue;
+    if (queue->writeCount == queue->readCount)
     {
-      // Output a 0, then output data
-      outputBit = 0;
+      // Nothing to send
+      return;
+    }
+  }
+
+  // The writer may have skipped the end of the arena
+  uint8_t offset = queue->readOffset;
+  volatile entry_t* newEntry = get_entry(queue, &offset);
+  queue->readOffset = offset;
+  transmitQueue = queue;
+  load_entry(newEntry);
+
+  // Indicate to application that a transmission has started
+  message_t message;
+  dcc_event_message_t* msgData = (dcc_event_message_t*)&message.data[0];
+  message.id = MESSAGE_ID_DCC_TX_STARTED;
+  msgData->flags = newEntry->flags;
+  msgData->dccMessageId = newEntry->messageId;
+  event_post_message(&message);
+}
+
+static inline void end_transmission(void)
+{
+  queue_t* queue = transmitQueue;
+  if (queue != NULL)
+  {
+    // Indicate to application that a transmission has completed
+    message_t message;
+    dcc_event_message_t* msgData = (dcc_event_message_t*)&message.data[0];
+    message.id = MESSAGE_ID_DCC_TX_COMPLETED;
+    msgData->flags = transmitEntry->flags;
+    msgData->dccMessageId = transmitEntry->messageId;
+    event_post_message(&message);
 
-      bitsLeftToTransmit = 8;
-      currentData = transmitBuffer->data[pendingDataIndex];
-      pendingDataIndex++;
+    // Release the entry back to the queue
+    queue->readOffset = next_offset(queue, queue->readOffset, transmitEntry->length);
+    queue->readCount++;
+  }
 
-      state = DCC_STATE_DATA;
-      break;
+  uint8_t flags = transmitEntry->flags;
+  if (flags & DCC_MESSAGE_FLAG_IDLE)
+  {
+    statistics.idlePackets++;
+  }
+  else
+  {
+    if (flags & DCC_MESSAGE_FLAG_USER_PROVIDED)
+    {
+      statistics.userPackets++;
     }
-    case DCC_STATE_DATA:
+    else
     {
-      // Output data byte bits, MSB first
-      if (bitsLeftToTransmit == 1)
-      {
-        // Last bit of byte, check which state to move to next
-        if (pendingDataIndex >= transmitBuffer->size)
-        {
-          // Done with transmitting after this bit
-          state = DCC_STATE_STOP_BIT;
-        }
-        else
-        {
-          // Got another data byte coming up
-          state = DCC_STATE_START_BIT;
-        }
-      }
+      statistics.internalPackets++;
+    }
+    statistics.packetBits += PREAMBLE_LENGTH(flags) + ENCODED_BIT_COUNT(transmitEntry->size);
+  }
 
-      outputBit = (currentData & 0x80);
-      bitsLeftToTransmit--;
-      currentData <<= 1;
+  if (cutoutEnabled)
+  {
+    // The RailCom cutout directly follows the packet end bit
+    cutoutMessageId = transmitEntry->messageId;
+    cutoutState = CUTOUT_STATE_PENDING;
+  }
+
+  transmitEntry = NULL;
+  transmitQueue = NULL;
+  abortAtBitsLeft = 0;
+}
+
+static inline void plan_abort(void)
+{
+  emergencyStopRequested = false;
+  emergencyStopRepeatsLeft = EMERGENCY_STOP_REPEAT_COUNT;
+  abortAtBitsLeft = 0;
+
+  volatile entry_t* entry = transmitEntry;
+  if ((entry == NULL) || (entry == (entry_t*)&emergencyStopEntry[0]))
+  {
+    // Nothing to cut off, the stop packets go out next
+    return;
+  }
 
-      break;      
+  if (preambleBitsLeft != 0)
+  {
+    // Still in the preamble, the stop preamble can take over right away
+    abortAtBitsLeft = bitsLeftToTransmit;
+    return;
+  }
+
+  uint16_t bitCount = ENCODED_BIT_COUNT(entry->size);
+  uint16_t sentBits = bitCount - bitsLeftToTransmit;
+  uint16_t bitIndex = 0;
+  uint8_t checksum = 0;
+  uint8_t byteCount = 0;
+
+  // The packet is cut off at the next start bit. A decoder sees the first stop preamble bit as packet end bit,
+  // so the cut moves on while the bytes sent up to there would pass as a complete packet.
+  while ((bitIndex < sentBits) || ((byteCount >= MIN_PACKET_SIZE) && (checksum == 0)))
+  {
+    uint8_t data = 0;
+    for (uint16_t i = bitIndex + 1; i <= bitIndex + 8; i++)
+    {
+      data = (data << 1) | ((entry->bits[i >> 3] >> (7 - (i & 7))) & 1);
     }
-    case DCC_STATE_STOP_BIT:
+    checksum ^= data;
+    byteCount++;
+    bitIndex += 9;
+
+    if (bitIndex + 1 >= bitCount)
     {
-      // Output a one bit and mark buffer as done
-      outputBit = 1;
+      // Only the packet end bit is left, let it finish
+      return;
+    }
+  }
 
-      // Indicate to application that a transmission has completed
-      message.id = MESSAGE_ID_DCC_TX_COMPLETED;
-      msgData->flags = transmitBuffer->flags;
-      msgData->dccMessageId = transmitBuffer->messageId;
+  abortAtBitsLeft = bitCount - bitIndex;
+}
+
+ISR(TIMER4_OVF_vect)
+{
+  // The line is kept busy with 1 bits while there is nothing to send
+  uint8_t outputBit = 1;
+
+  statistics.totalBits++;
+
+  // The period loaded last time has just started
+  uint16_t endedPeriodUs = runningPeriodUs;
+  runningPeriodUs = loadedPeriodUs;
+
+  if (stopMeasureState != STOP_MEASURE_NONE)
+  {
+    stopLatencyUs += endedPeriodUs;
+    if (stopMeasureState == STOP_MEASURE_STARTING)
+    {
+      // The stop packet is on the wire now
+      message_t message;
+      dcc_emergency_stop_message_t* msgData = (dcc_emergency_stop_message_t*)&message.data[0];
+      message.id = MESSAGE_ID_DCC_EMERGENCY_STOP;
+      msgData->latencyUs = stopLatencyUs;
       event_post_message(&message);
+      stopMeasureState = STOP_MEASURE_NONE;
+    }
+  }
+
+  if (emergencyStopRequested)
+  {
+    plan_abort();
+  }
+
+  if (cutoutState != CUTOUT_STATE_NONE)
+  {
+    switch (cutoutState)
+    {
+      case CUTOUT_STATE_PENDING:
+      {
+        // The packet end bit just started. The period after it drives the track like the first half of a 1 bit up to the cutout start,
+        // then both outputs stay low: B is cleared at its compare match and C is inverted with its compare value at TOP.
+        OCR4B = CUTOUT_START_COMPARE;
+        OCR4C = CUTOUT_END_TOP;
+        OCR4A = CUTOUT_END_TOP;
+        loadedPeriodUs = CUTOUT_END_US;
+        cutoutState = CUTOUT_STATE_LOADED;
+
+        // Get the next packet ready so its preamble follows the cutout
+        begin_transmission();
+        return;
+      }
+      case CUTOUT_STATE_LOADED:
+      {
+        // Cutout has started, listen for decoders
+        dcc_railcom_on_cutout_start(cutoutMessageId);
+        cutoutState = CUTOUT_STATE_RUNNING;
+        break;
+      }
+      default:
+      {
+        // Cutout is over, the track is driven again
+        dcc_railcom_on_cutout_end();
+        cutoutState = CUTOUT_STATE_NONE;
+        break;
+      }
+    }
+  }
 
-      transmitBuffer->inUse = false;
-      transmitBuffer = NULL;
+  if ((bitsLeftToTransmit != 0) && (bitsLeftToTransmit == abortAtBitsLeft))
+  {
+    // Emergency stop, the packet stays at the head of its queue and is sent again from the start later on
+    transmitEntry = NULL;
+    transmitQueue = NULL;
+    abortAtBitsLeft = 0;
+    begin_transmission();
+  }
 
-      state = DCC_STATE_IDLE;
+  if (bitsLeftToTransmit != 0)
+  {
+    if ((stopMeasureState == STOP_MEASURE_WAITING) && (transmitEntry == (entry_t*)&emergencyStopEntry[0]))
+    {
+      stopMeasureState = STOP_MEASURE_STARTING;
+    }
 
-      break;
+    if (preambleBitsLeft != 0)
+    {
+      // Preamble is all 1 bits, it isn't stored with the packet
+      preambleBitsLeft--;
     }
-    default:
+    else
     {
-      // Should never end up here
-      state = DCC_STATE_IDLE;
-      outputBit = 1;
-      transmitBuffer = NULL;
-      break;
+      // Shift out the next bit of the encoded packet
+      if (bitsLeftInByte == 0)
+      {
+        currentData = *pendingData++;
+        bitsLeftInByte = 8;
+      }
+
+      outputBit = currentData & 0x80;
+      currentData <<= 1;
+      bitsLeftInByte--;
+
+      if (--bitsLeftToTransmit == 0)
+      {
+        // That was the packet end bit
+        end_transmission();
+      }
     }
   }
+  else
+  {
+    // Pick up the next packet, its first preamble bit goes out after this 1 bit
+    begin_transmission();
+  }
+
+  if (outputBit)
+  {
+    OCR4B = ONE_BIT_COMPARE;
+    OCR4C = ONE_BIT_COMPARE;
+    OCR4A = ONE_BIT_TOP;
+    loadedPeriodUs = ONE_BIT_HALF_PERIOD_US * 2;
+  }
+  else
+  {
+    OCR4B = ZERO_BIT_COMPARE;
+    OCR4C = ZERO_BIT_COMPARE;
+    OCR4A = ZERO_BIT_TOP;
+    loadedPeriodUs = ZERO_BIT_HALF_PERIOD_US * 2;
+  }
 
-  uint8_t duration = outputBit ? ONE_BIT_HALF_PERIOD_US * 2 : ZERO_BIT_HALF_PERIOD_US * 2;
-  OCR4B = duration;
-  OCR4C = duration;
-  OCR4A = duration * 2;
+  // When the timer overflowed again while we were busy the new values are one period late
+  if (TIFR4 & (1 << TOV4))
+  {
+    statistics.overruns++;
+  }
 }
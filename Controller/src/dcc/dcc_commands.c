@@ -1,9 +1,20 @@
 #include "dcc/dcc_commands.h"
 #include "dcc/dcc.h"
 #include "dcc/dcc_service_mode.h"
-#include "sysb/commands.h"
-#include "sysb/timer.h"
-#include "arduino/platform.h"
+#include "dcc/dcc_service_auto.h"
+#include "dcc/dcc_cv_jobs.h"
+#include "dcc/dcc_cv_backup.h"
+#include "dcc/dcc_refresh.h"
+#include "dcc/dcc_packet.h"
+#include "dcc/dcc_pom.h"
+#include "dcc/dcc_railcom.h"
+#include "dcc/bdp_console.h"
+#include "commands.h"
+#include "timer.h"
+#include "log.h"
+#include "serial.h"
+#include "platform.h"
+#include "gpio.h"
 #include <string.h>
 #include <ctype.h>
 
@@ -11,13 +22,58 @@
 #define MODE_SERVICE      "SERVICE"
 #define MODE_OFF          "OFF"
 
+#define TX_REPORT_DELAY_MS    (20)      // Completions are collected for this long before they are reported in one line
+#define TX_REPORT_MAX_IDS     (8)       // Amount of completions reported in one line
+
+#define CURRENT_BLOCK_SAMPLES     (24)
+#define CURRENT_BLOCK_HEADER_SIZE (6)     // Time, interval, count and the first value
+// Every sample after the first takes a one byte delta, or an escape byte and the full value when it moved too much
+#define CURRENT_BLOCK_MAX_SIZE    (CURRENT_BLOCK_HEADER_SIZE + 3 * (CURRENT_BLOCK_SAMPLES - 1))
+#define CURRENT_DELTA_ESCAPE      (0x80)
+
+// The on board LED of the Arduino Mega, the blink rate shows the DCC mode
+static const gpio_info_t PIN_STATUS_LED = { .port = GPIO_PORT_B, .pin = GPIO_PIN_7 };
+
 static void on_timer(uint8_t timer);
+static void on_tx_report_timer(uint8_t timer);
+static void report_tx_completions(void);
 static void mode_command(const char *arguments, uint8_t length, const command_functions_t* output);
 static void send_command(const char *arguments, uint8_t length, const command_functions_t* output);
 static void set_cv_command(const char *arguments, uint8_t length, const command_functions_t* output);
 static void verify_cv_command(const char *arguments, uint8_t length, const command_functions_t* output);
 static void set_cv_bit_command(const char *arguments, uint8_t length, const command_functions_t* output);
 static void verify_cv_bit_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void read_cv_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void ack_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void cv_job_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void cv_dump_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void program_method_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void cv_restore_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void on_cv_record(const dcc_cv_record_t* record);
+static void on_cv_progress(const dcc_cv_progress_t* progress);
+static void on_cv_dump_finished(bool stopped, uint16_t nextCvAddress);
+static void on_cv_restore_finished(bool stopped, uint16_t nextCvAddress);
+static void speed_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void function_group_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void accessory_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void extended_accessory_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void loco_list_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void railcom_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void loco_speed_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void loco_function_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void loco_release_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void tx_report_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void statistics_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void emergency_stop_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void trip_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void current_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static void filter_command(const char *arguments, uint8_t length, const command_functions_t* output);
+static bool send_current_block(uint8_t minimumSamples);
+static uint8_t encode_current_block(uint8_t* block, uint8_t minimumSamples);
+static bdp_result_code_t send_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+static bdp_result_code_t loco_speed_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+static bdp_result_code_t emergency_stop_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+static bdp_result_code_t current_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
 
 static const command_t m_modeCommand = {
   .prefix = "DCC+M",
@@ -55,7 +111,176 @@ static const command_t m_verifyCVBitCommand = {
   .handler = verify_cv_bit_command
 };
 
+static const command_t m_readCVCommand = {
+  .prefix = "DCC+CV+R",
+  .summary = "Read the value of a CV, service mode only (LOCADDR CVADDR)",
+  .handler = read_cv_command
+};
+
+static const command_t m_ackCommand = {
+  .prefix = "DCC+ACK",
+  .summary = "Configures service mode ACK detection (THRESHOLD MINMS MAXMS). Omit the arguments to get the settings and the last ACK pulse.",
+  .handler = ack_command
+};
+
+static const command_t m_cvJobCommand = {
+  .prefix = "DCC+JOB",
+  .summary = "Queues a service mode job (W CVADDR VALUE, V CVADDR VALUE, WB CVADDR BIT VALUE, VB CVADDR BIT VALUE, R CVADDR), results are reported as " COM_DCC_CV_JOB ". Use CLEAR to drop pending jobs.",
+  .handler = cv_job_command
+};
+
+static const command_t m_programMethodCommand = {
+  .prefix = "DCC+PGM",
+  .summary = "Shows or sets the service mode programming method for the decoder on the programming track (DIRECT/PAGED/REGISTER/ADDRESS/AUTO). Entering service mode sets AUTO.",
+  .handler = program_method_command
+};
+
+static const command_t m_cvDumpCommand = {
+  .prefix = "DCC+CVD",
+  .summary = "Reads a CV range in service mode (FIRSTCV COUNT), records are reported as " COM_DCC_CV_RECORD "HEXSTRING. Use STOP and RESUME to pause.",
+  .handler = cv_dump_command
+};
+
+static const command_t m_cvRestoreCommand = {
+  .prefix = "DCC+CVR",
+  .summary = "Writes the CVs of a record from DCC+CVD that differ (HEXSTRING)",
+  .handler = cv_restore_command
+};
+
+static const command_t m_speedCommand = {
+  .prefix = "DCC+SPD",
+  .summary = "Sends a speed packet (LOCADDR SPEED DIR(1 = forward) [STEPS(14, 28, 128)])",
+  .handler = speed_command
+};
+
+static const command_t m_functionGroupCommand = {
+  .prefix = "DCC+FG",
+  .summary = "Sends a function group packet (LOCADDR GROUP(0 = F0-F4, 1 = F5-F8, 2 = F9-F12, 3 = F13-F20, 4 = F21-F28) STATE)",
+  .handler = function_group_command
+};
+
+static const command_t m_accessoryCommand = {
+  .prefix = "DCC+ACC",
+  .summary = "Sends a basic accessory packet (DECADDR OUTPUT(0-7) ON/OFF)",
+  .handler = accessory_command
+};
+
+static const command_t m_extendedAccessoryCommand = {
+  .prefix = "DCC+XACC",
+  .summary = "Sends an extended accessory packet (ACCADDR ASPECT)",
+  .handler = extended_accessory_command
+};
+
+static const command_t m_locoListCommand = {
+  .prefix = "DCC+LOC",
+  .summary = "Lists the decoders that are refreshed on the main track",
+  .handler = loco_list_command
+};
+
+static const command_t m_locoSpeedCommand = {
+  .prefix = "DCC+LOC+S",
+  .summary = "Sets the speed of a refreshed decoder (LOCADDR SPEED(0-126) DIR(1 = forward))",
+  .handler = loco_speed_command
+};
+
+static const command_t m_locoFunctionCommand = {
+  .prefix = "DCC+LOC+F",
+  .summary = "Sets a function of a refreshed decoder (LOCADDR FUNCTION(0-28) ON/OFF)",
+  .handler = loco_function_command
+};
+
+static const command_t m_locoReleaseCommand = {
+  .prefix = "DCC+LOC+R",
+  .summary = "Stops refreshing a decoder (LOCADDR)",
+  .handler = loco_release_command
+};
+
+static const command_t m_railcomCommand = {
+  .prefix = "DCC+RC",
+  .summary = "Enables or disables the RailCom cutout (ON/OFF). Omit the argument to get the last received RailCom data.",
+  .handler = railcom_command
+};
+
+static const command_t m_txReportCommand = {
+  .prefix = "DCC+TXC",
+  .summary = "Enables or disables the unsolicited " COM_DCC_TX_COMPLETE " lines for sent packets (ON/OFF)",
+  .handler = tx_report_command
+};
+
+static const command_t m_statisticsCommand = {
+  .prefix = "DCC+STAT",
+  .summary = "Shows the DCC line and queue statistics. Use RESET to clear them.",
+  .handler = statistics_command
+};
+
+static const command_t m_tripCommand = {
+  .prefix = "DCC+TRIP",
+  .summary = "Shows the overcurrent trip state. Set the trip level in raw ADC counts (THRESHOLD, 0 disables) or use RESET to clear the counters.",
+  .handler = trip_command
+};
+
+static const command_t m_currentCommand = {
+  .prefix = "DCC+CUR",
+  .summary = "Streams track current as " COM_DCC_CURRENT "HEXSTRING blocks (ON/OFF/DEC n). Omit the argument to send what is buffered once. BDP hosts use the current opcode instead.",
+  .handler = current_command
+};
+
+static const command_t m_filterCommand = {
+  .prefix = "DCC+FILT",
+  .summary = "Sets the current sense filter (PERIOD AVGSHIFT CICORDER IIRSHIFT MEDIAN ON/OFF). Omit the arguments to get it with the ADC interrupt cost in cycles.",
+  .handler = filter_command
+};
+
+static const command_t m_emergencyStopCommand = {
+  .prefix = "DCC+ESTOP",
+  .summary = "Stops all locomotives right away with broadcast emergency stops, the latency is reported as " COM_DCC_EMERGENCY_STOP,
+  .handler = emergency_stop_command
+};
+
 static uint8_t m_blinkTimer;
+static uint8_t m_txReportTimer;
+static bool m_txReportEnabled = true;
+static uint8_t m_txReportIds[TX_REPORT_MAX_IDS];
+static uint8_t m_txReportCount;
+static uint8_t m_readCVValue;
+static bool m_currentStreaming;
+static bool m_currentBinary;          // Blocks go out as BDP events instead of text lines
+static bool m_currentFlush;
+
+// Indexed by dcc_service_method_t
+static const char* const m_methodNames[] = { "DIRECT", "PAGED", "REGISTER", "ADDRESS" };
+
+static const dcc_cv_backup_handler_t m_cvDumpHandler = {
+  .on_record = on_cv_record,
+  .on_progress = on_cv_progress,
+  .on_finished = on_cv_dump_finished
+};
+
+static const dcc_cv_backup_handler_t m_cvRestoreHandler = {
+  .on_record = NULL,
+  .on_progress = on_cv_progress,
+  .on_finished = on_cv_restore_finished
+};
+
+static const bdp_opcode_t m_sendOpcode = {
+  .opcode = BDP_OPCODE_DCC_SEND,
+  .handler = send_opcode
+};
+
+static const bdp_opcode_t m_locoSpeedOpcode = {
+  .opcode = BDP_OPCODE_DCC_LOCO_SPEED,
+  .handler = loco_speed_opcode
+};
+
+static const bdp_opcode_t m_emergencyStopOpcode = {
+  .opcode = BDP_OPCODE_DCC_EMERGENCY_STOP,
+  .handler = emergency_stop_opcode
+};
+
+static const bdp_opcode_t m_currentOpcode = {
+  .opcode = BDP_OPCODE_DCC_CURRENT,
+  .handler = current_opcode
+};
 
 void dcc_commands_initialize(void)
 {
@@ -65,12 +290,87 @@ void dcc_commands_initialize(void)
   commands_register(&m_verifyCVCommand);
   commands_register(&m_setCVBitCommand);
   commands_register(&m_verifyCVBitCommand);
+  commands_register(&m_readCVCommand);
+  commands_register(&m_ackCommand);
+  commands_register(&m_cvJobCommand);
+  commands_register(&m_programMethodCommand);
+  commands_register(&m_cvDumpCommand);
+  commands_register(&m_cvRestoreCommand);
+  commands_register(&m_speedCommand);
+  commands_register(&m_functionGroupCommand);
+  commands_register(&m_accessoryCommand);
+  commands_register(&m_extendedAccessoryCommand);
+  commands_register(&m_locoListCommand);
+  commands_register(&m_locoSpeedCommand);
+  commands_register(&m_locoFunctionCommand);
+  commands_register(&m_locoReleaseCommand);
+  commands_register(&m_railcomCommand);
+  commands_register(&m_txReportCommand);
+  commands_register(&m_statisticsCommand);
+  commands_register(&m_emergencyStopCommand);
+  commands_register(&m_tripCommand);
+  commands_register(&m_currentCommand);
+  commands_register(&m_filterCommand);
 
+  bdp_console_register(&m_sendOpcode);
+  bdp_console_register(&m_locoSpeedOpcode);
+  bdp_console_register(&m_emergencyStopOpcode);
+  bdp_console_register(&m_currentOpcode);
+
+  gpio_configure_output(PIN_STATUS_LED.port, PIN_STATUS_LED.pin);
   m_blinkTimer = timer_create(TIMER_MODE_REPEATING, on_timer);
+  m_txReportTimer = timer_create(TIMER_MODE_SINGLE, on_tx_report_timer);
 
   timer_start(m_blinkTimer, 1000);
 }
 
+void dcc_commands_poll(void)
+{
+  if (m_currentFlush)
+  {
+    // Send everything that was buffered when the command came in, the rest follows on later polls when the serial port is busy
+    while ((current_sense_get_sample_count() > 0) && send_current_block(1))
+    {
+    }
+    m_currentFlush = (current_sense_get_sample_count() > 0);
+  }
+  else if (m_currentStreaming)
+  {
+    // Only full blocks while streaming, that keeps the per line overhead low
+    send_current_block(CURRENT_BLOCK_SAMPLES);
+  }
+}
+
+void dcc_commands_on_tx_completed(const dcc_event_message_t* event)
+{
+  // Only packets the host queued itself have an ID it knows about
+  if (!m_txReportEnabled || !(event->flags & DCC_MESSAGE_FLAG_USER_PROVIDED))
+  {
+    return;
+  }
+
+  m_txReportIds[m_txReportCount++] = event->dccMessageId;
+  if (m_txReportCount == TX_REPORT_MAX_IDS)
+  {
+    timer_stop(m_txReportTimer);
+    report_tx_completions();
+  }
+  else if (m_txReportCount == 1)
+  {
+    timer_start(m_txReportTimer, TX_REPORT_DELAY_MS);
+  }
+}
+
+void dcc_commands_on_emergency_stop(const dcc_emergency_stop_message_t* message)
+{
+  log_writeln_format(COM_DCC_EMERGENCY_STOP, message->latencyUs);
+}
+
+void dcc_commands_on_overcurrent(const current_sense_trip_message_t* message)
+{
+  log_writeln_format(COM_DCC_OVERCURRENT, message->tripCount, message->current, message->retryDelayMs);
+}
+
 static void mode_command(const char *arguments, uint8_t length, const command_functions_t* output)
 {
   if (commands_match(arguments, length, MODE_OPERATION))
@@ -89,6 +389,8 @@ static void mode_command(const char *arguments, uint8_t length, const command_fu
     if (!dcc_is_started() || (dcc_get_mode() != DCC_MODE_SERVICE))
     {
       dcc_stop();
+      // Another decoder may be on the programming track now
+      dcc_service_auto_set_method(DCC_SERVICE_METHOD_COUNT);
       dcc_start(DCC_MODE_SERVICE);
 
       timer_start(m_blinkTimer, 100);
@@ -208,6 +510,126 @@ static void send_command(const char *arguments, uint8_t length, const command_fu
   }
 }
 
+static void queue_packet(const dcc_packet_t* packet, const command_functions_t* output)
+{
+  uint8_t assignedId;
+  if (dcc_queue_data(&packet->data[0], packet->size, &assignedId))
+  {
+    output->writeln_format(OK_WITH_RESULT("ID %u"), assignedId);
+  }
+  else
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
+  }
+}
+
+static void speed_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint16_t address;
+  uint8_t speed;
+  uint8_t direction;
+  uint8_t stepCount = 128;
+  dcc_speed_steps_t steps;
+  dcc_packet_t packet;
+
+  if (!commands_get_u16(arguments, length, 0, &address) || !commands_get_u8(arguments, length, 1, &speed) || !commands_get_u8(arguments, length, 2, &direction))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  // Speed steps are optional
+  (void)commands_get_u8(arguments, length, 3, &stepCount);
+  switch (stepCount)
+  {
+    case 14:
+      steps = DCC_SPEED_STEPS_14;
+      break;
+    case 28:
+      steps = DCC_SPEED_STEPS_28;
+      break;
+    case 128:
+      steps = DCC_SPEED_STEPS_128;
+      break;
+    default:
+      output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+      return;
+  }
+
+  if (!dcc_packet_speed(&packet, address, steps, speed, direction != 0))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  queue_packet(&packet, output);
+}
+
+static void function_group_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint16_t address;
+  uint8_t group;
+  uint8_t state;
+  dcc_packet_t packet;
+
+  if (!commands_get_u16(arguments, length, 0, &address) || !commands_get_u8(arguments, length, 1, &group) || !commands_get_u8(arguments, length, 2, &state))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if ((group >= NR_OF_DCC_FUNCTION_GROUPS) || !dcc_packet_functions(&packet, address, group, state))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  queue_packet(&packet, output);
+}
+
+static void accessory_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint16_t address;
+  uint8_t accessoryOutput;
+  bool activate;
+  dcc_packet_t packet;
+
+  if (!commands_get_u16(arguments, length, 0, &address) || !commands_get_u8(arguments, length, 1, &accessoryOutput) || !commands_get_on_off(arguments, length, 2, &activate))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!dcc_packet_basic_accessory(&packet, address, accessoryOutput, activate))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  queue_packet(&packet, output);
+}
+
+static void extended_accessory_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint16_t address;
+  uint8_t aspect;
+  dcc_packet_t packet;
+
+  if (!commands_get_u16(arguments, length, 0, &address) || !commands_get_u8(arguments, length, 1, &aspect))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!dcc_packet_extended_accessory(&packet, address, aspect))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  queue_packet(&packet, output);
+}
+
 static void on_service_mode_result(dcc_result_t result, void* userData)
 {
   const command_functions_t* output = (const command_functions_t*)userData;
@@ -232,6 +654,55 @@ static void on_service_mode_result(dcc_result_t result, void* userData)
   }
 }
 
+static void on_read_cv_result(dcc_result_t result, void* userData)
+{
+  const command_functions_t* output = (const command_functions_t*)userData;
+
+  switch (result)
+  {
+    case DCC_RESULT_ACK:
+    {
+      output->writeln_format(OK_WITH_RESULT("VALUE %u"), m_readCVValue);
+      break;
+    }
+    case DCC_RESULT_NACK:
+    {
+      // The byte verify did not confirm the bits that were read
+      output->writeln(ERR_WITH_REASON("NO ACK"));
+      break;
+    }
+    case DCC_RESULT_TIMEOUT:
+    {
+      output->writeln(ERR_WITH_REASON("TIMEOUT"));
+      break;
+    }
+  }
+}
+
+static const char* get_result_text(dcc_result_t result)
+{
+  switch (result)
+  {
+    case DCC_RESULT_ACK:
+      return "ACK";
+    case DCC_RESULT_NACK:
+      return "NO ACK";
+    default:
+      return "TIMEOUT";
+  }
+}
+
+static void on_cv_job_result(const dcc_cv_job_t* job, dcc_result_t result, void* userData)
+{
+  // Jobs finish long after the command that queued them, so this is an unsolicited line
+  log_write_format(COM_DCC_CV_JOB, job->id, get_result_text(result));
+  if ((job->type == DCC_CV_JOB_READ) && (result == DCC_RESULT_ACK))
+  {
+    log_write_format(" VALUE %u", job->value);
+  }
+  log_writeln("");
+}
+
 static void set_cv_command(const char *arguments, uint8_t length, const command_functions_t* output)
 {
   uint16_t address;
@@ -258,14 +729,25 @@ static void set_cv_command(const char *arguments, uint8_t length, const command_
   {
     case DCC_MODE_OPERATION:
     {
-      // Use an operation mode command sequence
-      output->writeln(COM_ERR);
+      // Use an operation mode command sequence, there is no acknowledgment on the main track
+      dcc_packet_t packet;
+      if (!dcc_packet_pom_write_cv(&packet, address, cvAddress, data))
+      {
+        output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+        return;
+      }
+      if (!dcc_pom_queue_packet(address, &packet))
+      {
+        output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
+        return;
+      }
+      output->writeln(COM_OK);
       return;
     }
     case DCC_MODE_SERVICE:
     {
       // Use the service mode command sequence with acknowledgment
-      if (!dcc_service_mode_set_cv(cvAddress, data, on_service_mode_result, (void*)output))
+      if (!dcc_service_auto_set_cv(cvAddress, data, on_service_mode_result, (void*)output))
       {
         // Unable to start CV configuration process, return error
         output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
@@ -308,7 +790,7 @@ static void verify_cv_command(const char *arguments, uint8_t length, const comma
     case DCC_MODE_SERVICE:
     {
       // Use the service mode command sequence with acknowledgment
-      if (!dcc_service_mode_verify_cv(cvAddress, data, on_service_mode_result, (void*)output))
+      if (!dcc_service_auto_verify_cv(cvAddress, data, on_service_mode_result, (void*)output))
       {
         // Unable to start CV configuration process, return error
         output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
@@ -345,8 +827,19 @@ static void set_cv_bit_command(const char *arguments, uint8_t length, const comm
   {
     case DCC_MODE_OPERATION:
     {
-      // Use an operation mode command sequence
-      output->writeln(COM_ERR);
+      // Use an operation mode command sequence, there is no acknowledgment on the main track
+      dcc_packet_t packet;
+      if (!dcc_packet_pom_write_cv_bit(&packet, address, cvAddress, bit, data))
+      {
+        output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+        return;
+      }
+      if (!dcc_pom_queue_packet(address, &packet))
+      {
+        output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
+        return;
+      }
+      output->writeln(COM_OK);
       return;
     }
     case DCC_MODE_SERVICE:
@@ -406,7 +899,808 @@ static void verify_cv_bit_command(const char *arguments, uint8_t length, const c
   }
 }
 
-static void on_timer(uint8_t timer)
+static void read_cv_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint16_t address;
+  uint16_t cv;
+
+  if (!commands_get_u16(arguments, length, 0, &address) || !commands_get_u16(arguments, length, 1, &cv))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!dcc_is_started())
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
+    return;
+  }
+
+  dcc_mode_t mode = dcc_get_mode();
+  // Address is zero based, cv IDs are 1 based
+  uint16_t cvAddress = cv - 1;
+
+  switch (mode)
+  {
+    case DCC_MODE_OPERATION:
+    {
+      // Reading on the main track needs RailCom, there is no acknowledgment
+      output->writeln(COM_ERR);
+      return;
+    }
+    case DCC_MODE_SERVICE:
+    {
+      // Use the service mode bit verify sequences with acknowledgment
+      if (!dcc_service_mode_read_cv(cvAddress, &m_readCVValue, on_read_cv_result, (void*)output))
+      {
+        // Unable to start CV read process, return error
+        output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
+      }
+      return;
+    }
+  }
+}
+
+static void ack_command(const char *arguments, uint8_t length, const command_functions_t* output)
 {
-  arduino_toggle_led();
-}
\ No newline at end of file
+  dcc_ack_config_t config;
+
+  if (length == 0)
+  {
+    dcc_ack_pulse_t pulse;
+    dcc_service_mode_get_ack_config(&config);
+
+    output->writeln(COM_OK "+");
+    output->writeln_format("THRESHOLD %u MIN %u MAX %u+", config.threshold, config.minWidthMs, config.maxWidthMs);
+    if (dcc_service_mode_get_last_ack(&pulse))
+    {
+      output->writeln_format("LAST %u MS %u", pulse.widthMs, pulse.amplitude);
+    }
+    else
+    {
+      output->writeln("LAST NONE");
+    }
+    return;
+  }
+
+  // The pulse width is counted in 8 bits
+  if (!commands_get_u8(arguments, length, 0, &config.threshold) || !commands_get_u8(arguments, length, 1, &config.minWidthMs) || !commands_get_u8(arguments, length, 2, &config.maxWidthMs) ||
+      (config.minWidthMs == 0) || (config.minWidthMs > config.maxWidthMs) || (config.maxWidthMs == UINT8_MAX))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  dcc_service_mode_set_ack_config(&config);
+  output->writeln(COM_OK);
+}
+
+static void cv_job_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  if (length == 0)
+  {
+    output->writeln_format(OK_WITH_RESULT("PENDING %u"), dcc_cv_jobs_get_count());
+    return;
+  }
+  if (commands_match(arguments, length, "CLEAR"))
+  {
+    dcc_cv_jobs_clear();
+    output->writeln(COM_OK);
+    return;
+  }
+
+  const char* type;
+  uint8_t typeLength;
+  uint16_t cv;
+  dcc_cv_job_t job = { 0 };
+  bool valid = commands_get_string(arguments, length, 0, &type, &typeLength) && commands_get_u16(arguments, length, 1, &cv) && (cv > 0) && (cv <= 1024);
+
+  if (valid && commands_match(type, typeLength, "W"))
+  {
+    job.type = DCC_CV_JOB_WRITE;
+    valid = commands_get_u8(arguments, length, 2, &job.value);
+  }
+  else if (valid && commands_match(type, typeLength, "V"))
+  {
+    job.type = DCC_CV_JOB_VERIFY;
+    valid = commands_get_u8(arguments, length, 2, &job.value);
+  }
+  else if (valid && commands_match(type, typeLength, "WB"))
+  {
+    job.type = DCC_CV_JOB_WRITE_BIT;
+    valid = commands_get_u8(arguments, length, 2, &job.bit) && commands_get_u8(arguments, length, 3, &job.value);
+  }
+  else if (valid && commands_match(type, typeLength, "VB"))
+  {
+    job.type = DCC_CV_JOB_VERIFY_BIT;
+    valid = commands_get_u8(arguments, length, 2, &job.bit) && commands_get_u8(arguments, length, 3, &job.value);
+  }
+  else if (valid && commands_match(type, typeLength, "R"))
+  {
+    job.type = DCC_CV_JOB_READ;
+  }
+  else
+  {
+    valid = false;
+  }
+
+  if (!valid)
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!dcc_is_started() || (dcc_get_mode() != DCC_MODE_SERVICE))
+  {
+    // Jobs need the acknowledgment of the programming track
+    output->writeln(COM_ERR);
+    return;
+  }
+
+  // Address is zero based, cv IDs are 1 based
+  job.cvAddress = cv - 1;
+
+  uint8_t jobId;
+  if (!dcc_cv_jobs_queue(&job, on_cv_job_result, NULL, &jobId))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
+    return;
+  }
+
+  output->writeln_format(OK_WITH_RESULT("ID %u"), jobId);
+}
+
+static void program_method_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  const char* name;
+  uint8_t nameLength;
+  dcc_service_method_t method;
+
+  if (length == 0)
+  {
+    if (dcc_service_auto_get_method(&method))
+    {
+      output->writeln_format(OK_WITH_RESULT("%s"), m_methodNames[method]);
+    }
+    else
+    {
+      output->writeln(OK_WITH_RESULT("AUTO"));
+    }
+    return;
+  }
+
+  // AUTO forgets the method, the next operation probes again
+  commands_get_string(arguments, length, 0, &name, &nameLength);
+  for (method = DCC_SERVICE_METHOD_DIRECT; method < DCC_SERVICE_METHOD_COUNT; method++)
+  {
+    if (commands_match(name, nameLength, m_methodNames[method]))
+    {
+      break;
+    }
+  }
+  if ((method == DCC_SERVICE_METHOD_COUNT) && !commands_match(name, nameLength, "AUTO"))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  dcc_service_auto_set_method(method);
+  output->writeln(COM_OK);
+}
+
+static void on_cv_record(const dcc_cv_record_t* record)
+{
+  uint8_t buffer[DCC_CV_RECORD_MAX_SIZE];
+  uint8_t size = dcc_cv_backup_encode(record, &buffer[0]);
+
+  log_write_format(COM_DCC_CV_RECORD);
+  for (uint8_t i = 0; i < size; i++)
+  {
+    log_write_format("%02X", buffer[i]);
+  }
+  log_writeln("");
+}
+
+static void on_cv_progress(const dcc_cv_progress_t* progress)
+{
+  // CV IDs are 1 based
+  log_write_format(COM_DCC_CV_PROGRESS, progress->cvAddress + 1, get_result_text(progress->result), progress->retries, progress->durationMs);
+  log_writeln(progress->written ? " WRITTEN" : "");
+}
+
+static void on_cv_dump_finished(bool stopped, uint16_t nextCvAddress)
+{
+  if (stopped)
+  {
+    log_writeln_format(COM_DCC_CV_RECORD "STOPPED %u", nextCvAddress + 1);
+  }
+  else
+  {
+    log_writeln(COM_DCC_CV_RECORD "END");
+  }
+}
+
+static void on_cv_restore_finished(bool stopped, uint16_t nextCvAddress)
+{
+  log_writeln(stopped ? ":CVR STOPPED" : ":CVR END");
+}
+
+static void cv_dump_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  if (commands_match(arguments, length, "STOP"))
+  {
+    dcc_cv_backup_stop();
+    output->writeln(COM_OK);
+    return;
+  }
+
+  bool started;
+  if (commands_match(arguments, length, "RESUME"))
+  {
+    started = dcc_cv_backup_resume();
+  }
+  else
+  {
+    uint16_t cv;
+    uint16_t count;
+    if (!commands_get_u16(arguments, length, 0, &cv) || !commands_get_u16(arguments, length, 1, &count) || (cv == 0))
+    {
+      output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+      return;
+    }
+    if (!dcc_is_started() || (dcc_get_mode() != DCC_MODE_SERVICE))
+    {
+      // Reading needs the acknowledgment of the programming track
+      output->writeln(COM_ERR);
+      return;
+    }
+    // Address is zero based, cv IDs are 1 based
+    started = dcc_cv_backup_dump(cv - 1, count, &m_cvDumpHandler);
+  }
+
+  if (!started)
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
+    return;
+  }
+  output->writeln(COM_OK);
+}
+
+static void cv_restore_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint8_t buffer[DCC_CV_RECORD_MAX_SIZE];
+  uint8_t size = 0;
+  dcc_cv_record_t record;
+
+  if (((length & 1) != 0) || (length > (2 * sizeof(buffer))))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_SIZE));
+    return;
+  }
+
+  for (uint8_t i = 0; i < length; i += 2)
+  {
+    uint8_t high;
+    uint8_t low;
+    if (!getHexNibble(arguments[i], &high) || !getHexNibble(arguments[i + 1], &low))
+    {
+      output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+      return;
+    }
+    buffer[size++] = (high << 4) | low;
+  }
+
+  if (!dcc_cv_backup_decode(&buffer[0], size, &record))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!dcc_is_started() || (dcc_get_mode() != DCC_MODE_SERVICE))
+  {
+    output->writeln(COM_ERR);
+    return;
+  }
+
+  if (record.bitmap == 0)
+  {
+    // None of the CVs could be read during the dump, nothing to write
+    output->writeln(COM_OK);
+    on_cv_restore_finished(false, record.baseCvAddress);
+    return;
+  }
+
+  if (!dcc_cv_backup_restore(&record, &m_cvRestoreHandler))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_QUEUE));
+    return;
+  }
+  output->writeln(COM_OK);
+}
+
+static void loco_list_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  output->writeln(COM_OK "+");
+  for (uint8_t i = 0; i < DCC_REFRESH_MAX_DECODERS; i++)
+  {
+    const dcc_refresh_entry_t* entry = dcc_refresh_get_entry(i);
+    if (entry != NULL)
+    {
+      output->writeln_format("addr:%u spd:%u dir:%u fn:%08lX+", entry->address, entry->speed, entry->forward, entry->functions);
+    }
+  }
+  output->writeln("");
+}
+
+static void loco_speed_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint16_t address;
+  uint8_t speed;
+  uint8_t direction;
+
+  if (!commands_get_u16(arguments, length, 0, &address) || !commands_get_u8(arguments, length, 1, &speed) || !commands_get_u8(arguments, length, 2, &direction) || (speed > DCC_REFRESH_MAX_SPEED))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!dcc_refresh_set_speed(address, speed, direction != 0))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_TABLE));
+    return;
+  }
+
+  output->writeln(COM_OK);
+}
+
+static void loco_function_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint16_t address;
+  uint8_t function;
+  bool enabled;
+
+  if (!commands_get_u16(arguments, length, 0, &address) || !commands_get_u8(arguments, length, 1, &function) || !commands_get_on_off(arguments, length, 2, &enabled) || (function > DCC_REFRESH_MAX_FUNCTION))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!dcc_refresh_set_function(address, function, enabled))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_TABLE));
+    return;
+  }
+
+  output->writeln(COM_OK);
+}
+
+static void loco_release_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint16_t address;
+
+  if (!commands_get_u16(arguments, length, 0, &address))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!dcc_refresh_release(address))
+  {
+    output->writeln(COM_ERR);
+    return;
+  }
+
+  output->writeln(COM_OK);
+}
+
+static void railcom_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  bool enabled;
+
+  if (length == 0)
+  {
+    dcc_railcom_data_t data;
+    if (!dcc_railcom_get_data(&data))
+    {
+      output->writeln_format(OK_WITH_RESULT("%s"), dcc_is_railcom_enabled() ? "ON" : "OFF");
+      return;
+    }
+
+    output->writeln(COM_OK "+");
+    output->writeln_format("ID %u+", data.dccMessageId);
+    output->write_format("CH1 ");
+    for (uint8_t i = 0; i < data.channel1Length; i++)
+    {
+      output->write_format("%02X", data.channel1[i]);
+    }
+    output->writeln("+");
+    output->write_format("CH2 ");
+    for (uint8_t i = 0; i < data.channel2Length; i++)
+    {
+      output->write_format("%02X", data.channel2[i]);
+    }
+    output->writeln("");
+  }
+  else if (commands_get_on_off(arguments, length, 0, &enabled))
+  {
+    dcc_set_railcom_enabled(enabled);
+    output->writeln(COM_OK);
+  }
+  else
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+  }
+}
+
+static void on_timer(uint8_t timer)
+{
+  gpio_toggle_pin(PIN_STATUS_LED.port, PIN_STATUS_LED.pin);
+}
+
+static void tx_report_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  bool enabled;
+  if (!commands_get_on_off(arguments, length, 0, &enabled))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!enabled)
+  {
+    timer_stop(m_txReportTimer);
+    m_txReportCount = 0;
+  }
+  m_txReportEnabled = enabled;
+  output->writeln(COM_OK);
+}
+
+static void on_tx_report_timer(uint8_t timer)
+{
+  report_tx_completions();
+}
+
+static void report_tx_completions(void)
+{
+  if (m_txReportCount == 0)
+  {
+    return;
+  }
+
+  // All completions that came in since the first one share a single line, for example ":TXC ID 4 5 6"
+  log_write_format(COM_DCC_TX_COMPLETE, m_txReportIds[0]);
+  for (uint8_t i = 1; i < m_txReportCount; i++)
+  {
+    log_write_format(" %u", m_txReportIds[i]);
+  }
+  log_writeln("");
+
+  m_txReportCount = 0;
+}
+
+static void statistics_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  if (commands_match(arguments, length, "RESET"))
+  {
+    dcc_reset_statistics();
+    output->writeln(COM_OK);
+    return;
+  }
+  else if (length != 0)
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  dcc_statistics_t statistics;
+  dcc_get_statistics(&statistics);
+
+  // Everything that is not part of a user or internal packet is idle time on the line, in tenths of a percent
+  // Both bit counts are scaled down first so the multiplication fits in 32 bits
+  uint32_t totalBits = statistics.totalBits;
+  uint32_t packetBits = statistics.packetBits;
+  while (totalBits > 0x3FFFFFUL)
+  {
+    totalBits >>= 1;
+    packetBits >>= 1;
+  }
+
+  uint16_t idlePermille = 1000;
+  if (packetBits >= totalBits)
+  {
+    // A packet that was already on the wire during a reset is counted completely
+    idlePermille = 0;
+  }
+  else if (totalBits != 0)
+  {
+    idlePermille = 1000 - (uint16_t)((packetBits * 1000) / totalBits);
+  }
+
+  output->writeln(COM_OK "+");
+  output->writeln_format("USER %lu+", statistics.userPackets);
+  output->writeln_format("INTERNAL %lu+", statistics.internalPackets);
+  output->writeln_format("IDLE %lu+", statistics.idlePackets);
+  output->writeln_format("BITS %lu+", statistics.totalBits);
+  output->writeln_format("IDLE TIME %u.%u%%+", idlePermille / 10, idlePermille % 10);
+  output->writeln_format("QUEUE MAX %u/%u+", statistics.queueHighWater, statistics.expressHighWater);
+  output->writeln_format("REJECTED %u+", statistics.rejectedPackets);
+  output->writeln_format("OVERRUNS %u+", statistics.overruns);
+  output->writeln_format("ESTOP LATENCY %u/%u US", statistics.emergencyStopLatencyUs, statistics.maxEmergencyStopLatencyUs);
+}
+
+static void emergency_stop_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  if (!dcc_is_started() || (dcc_get_mode() != DCC_MODE_OPERATION))
+  {
+    output->writeln(COM_ERR);
+    return;
+  }
+
+  dcc_emergency_stop();
+  output->writeln(COM_OK);
+}
+
+static void trip_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint16_t threshold;
+
+  if (commands_match(arguments, length, "RESET"))
+  {
+    current_sense_reset_trip_status();
+    output->writeln(COM_OK);
+    return;
+  }
+  else if (length != 0)
+  {
+    if (!commands_get_u16(arguments, length, 0, &threshold) || (threshold > 1023))
+    {
+      output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+      return;
+    }
+    current_sense_set_trip_threshold(threshold);
+    output->writeln(COM_OK);
+    return;
+  }
+
+  current_sense_trip_status_t status;
+  current_sense_get_trip_status(&status);
+
+  output->writeln(COM_OK "+");
+  output->writeln_format("THRESHOLD %u+", status.threshold);
+  output->writeln_format("TRIPS %u+", status.tripCount);
+  output->writeln_format("PEAK %u+", status.peakCurrent);
+  if (status.retryTimeLeftMs != 0)
+  {
+    output->writeln_format("OFF RETRY %u MS", status.retryTimeLeftMs);
+  }
+  else
+  {
+    output->writeln("ON");
+  }
+}
+
+static void current_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  uint8_t decimation;
+
+  if (length == 0)
+  {
+    m_currentFlush = true;
+  }
+  else if (commands_match(arguments, length, "ON"))
+  {
+    m_currentStreaming = true;
+    m_currentBinary = false;
+  }
+  else if (commands_match(arguments, length, "OFF"))
+  {
+    m_currentStreaming = false;
+    m_currentBinary = false;
+  }
+  else
+  {
+    const char* name;
+    uint8_t nameLength;
+    if (!commands_get_string(arguments, length, 0, &name, &nameLength) || !commands_match(name, nameLength, "DEC") ||
+        !commands_get_u8(arguments, length, 1, &decimation) || (decimation == 0))
+    {
+      output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+      return;
+    }
+    current_sense_set_decimation(decimation);
+  }
+
+  output->writeln(COM_OK);
+}
+
+static void append_hex(char* line, uint8_t* length, uint8_t data)
+{
+  static const char digits[] = "0123456789ABCDEF";
+  line[(*length)++] = digits[data >> 4];
+  line[(*length)++] = digits[data & 0x0F];
+}
+
+// Sends one block of samples, as a BDP event when a BDP host turned streaming on, otherwise as ":CUR " and the block in hex
+static bool send_current_block(uint8_t minimumSamples)
+{
+  uint8_t block[CURRENT_BLOCK_MAX_SIZE];
+  char line[sizeof(COM_DCC_CURRENT) - 1 + 2 * CURRENT_BLOCK_MAX_SIZE + 2];
+
+  if (serial_get_tx_free() < (m_currentBinary ? BDP_CONSOLE_EVENT_SIZE(CURRENT_BLOCK_MAX_SIZE) : sizeof(line)))
+  {
+    // Never send half a block, wait for the serial port to catch up
+    return false;
+  }
+
+  uint8_t blockLength = encode_current_block(&block[0], minimumSamples);
+  if (blockLength == 0)
+  {
+    return false;
+  }
+
+  if (m_currentBinary)
+  {
+    return bdp_console_send_event(BDP_OPCODE_DCC_CURRENT, &block[0], blockLength);
+  }
+
+  uint8_t length = sizeof(COM_DCC_CURRENT) - 1;
+  memcpy(&line[0], COM_DCC_CURRENT, length);
+  for (uint8_t i = 0; i < blockLength; i++)
+  {
+    append_hex(line, &length, block[i]);
+  }
+  line[length++] = '\r';
+  line[length++] = '\n';
+  serial_send((const uint8_t*)&line[0], length);
+  return true;
+}
+
+// Takes the next block of samples, returns its size or 0 when there are fewer than minimumSamples. The block is:
+//   time of the first sample (2 bytes), interval in ms (1 byte), sample count (1 byte), first value (2 bytes),
+//   then a signed byte delta to the previous value for every other sample, or 0x80 followed by the full value.
+// A block ends early at a gap in the samples, so the time of every sample follows from the header.
+static uint8_t encode_current_block(uint8_t* block, uint8_t minimumSamples)
+{
+  static current_sense_sample_t samples[CURRENT_BLOCK_SAMPLES];
+  static uint8_t sampleCount;
+  uint8_t length = 0;
+
+  if ((sampleCount + current_sense_get_sample_count()) < minimumSamples)
+  {
+    return 0;
+  }
+
+  // Samples left over after a gap in the previous block go first
+  sampleCount += current_sense_read_samples(&samples[sampleCount], CURRENT_BLOCK_SAMPLES - sampleCount);
+  if (sampleCount == 0)
+  {
+    return 0;
+  }
+
+  uint16_t interval = (sampleCount > 1) ? (uint16_t)(samples[1].timeMs - samples[0].timeMs) : 0;
+  uint8_t count = 1;
+  if ((interval == 0) || (interval > UINT8_MAX))
+  {
+    // A single sample, or a gap right after the first one
+    interval = current_sense_get_decimation();
+  }
+  else
+  {
+    while ((count < sampleCount) && ((uint16_t)(samples[count].timeMs - samples[count - 1].timeMs) == interval))
+    {
+      count++;
+    }
+  }
+
+  block[length++] = samples[0].timeMs >> 8;
+  block[length++] = samples[0].timeMs & 0xFF;
+  block[length++] = interval;
+  block[length++] = count;
+  block[length++] = samples[0].value >> 8;
+  block[length++] = samples[0].value & 0xFF;
+  for (uint8_t i = 1; i < count; i++)
+  {
+    int16_t delta = (int16_t)(samples[i].value - samples[i - 1].value);
+    if ((delta >= -127) && (delta <= 127))
+    {
+      block[length++] = (uint8_t)delta;
+    }
+    else
+    {
+      block[length++] = CURRENT_DELTA_ESCAPE;
+      block[length++] = samples[i].value >> 8;
+      block[length++] = samples[i].value & 0xFF;
+    }
+  }
+
+  // Keep what comes after the gap for the next block
+  sampleCount -= count;
+  memmove(&samples[0], &samples[count], sampleCount * sizeof(samples[0]));
+  return length;
+}
+
+static void filter_command(const char *arguments, uint8_t length, const command_functions_t* output)
+{
+  current_sense_filter_t filter;
+
+  if (length == 0)
+  {
+    uint16_t average;
+    uint16_t maximum;
+    current_sense_get_filter(&filter);
+    current_sense_get_cycles(&average, &maximum);
+
+    output->writeln(COM_OK "+");
+    output->writeln_format("PERIOD %u AVGSHIFT %u CICORDER %u IIRSHIFT %u MEDIAN %u+", filter.samplePeriod, filter.averageShift, filter.cicOrder, filter.iirShift, filter.median);
+    output->writeln_format("CYCLES %u MAX %u", average, maximum);
+    return;
+  }
+
+  if (!commands_get_u16(arguments, length, 0, &filter.samplePeriod) || !commands_get_u8(arguments, length, 1, &filter.averageShift) ||
+      !commands_get_u8(arguments, length, 2, &filter.cicOrder) || !commands_get_u8(arguments, length, 3, &filter.iirShift) ||
+      !commands_get_on_off(arguments, length, 4, &filter.median))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  if (!current_sense_set_filter(&filter))
+  {
+    output->writeln(ERR_WITH_REASON(COM_DCC_ERR_FORMAT));
+    return;
+  }
+
+  output->writeln(COM_OK);
+}
+
+static bdp_result_code_t send_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  if ((length == 0) || (length > DCC_PACKET_MAX_SIZE))
+  {
+    return BDP_RESULT_INVALID_ARGUMENT;
+  }
+
+  if (!dcc_queue_data(data, length, &response[0]))
+  {
+    return BDP_RESULT_FAILED;
+  }
+
+  *responseLength = 1;
+  return BDP_RESULT_OK;
+}
+
+static bdp_result_code_t loco_speed_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  if ((length < 4) || (data[2] > DCC_REFRESH_MAX_SPEED))
+  {
+    return BDP_RESULT_INVALID_ARGUMENT;
+  }
+
+  uint16_t address = ((uint16_t)data[0] << 8) | data[1];
+  return dcc_refresh_set_speed(address, data[2], data[3] != 0) ? BDP_RESULT_OK : BDP_RESULT_FAILED;
+}
+
+static bdp_result_code_t emergency_stop_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  if (!dcc_is_started() || (dcc_get_mode() != DCC_MODE_OPERATION))
+  {
+    return BDP_RESULT_FAILED;
+  }
+
+  dcc_emergency_stop();
+  return BDP_RESULT_OK;
+}
+
+static bdp_result_code_t current_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  if (length > 0)
+  {
+    // There is only one stream, so this also stops one started with DCC+CUR ON
+    m_currentStreaming = (data[0] != 0);
+    m_currentBinary = m_currentStreaming;
+  }
+
+  response[0] = m_currentBinary ? 1 : 0;
+  *responseLength = 1;
+  return BDP_RESULT_OK;
+}
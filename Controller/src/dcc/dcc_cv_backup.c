@@ -0,0 +1,344 @@
+#include "dcc/dcc_cv_backup.h"
+#include <stddef.h>
+
+// A NACK on a read or verify is retried, decoders miss the occasional packet on a dirty programming track
+#define MAX_RETRIES     (2)
+#define CV_ADDRESS_MAX  (0x3FF)
+
+typedef enum
+{
+  BACKUP_STATE_IDLE,
+  BACKUP_STATE_DUMP,
+  BACKUP_STATE_RESTORE_VERIFY,
+  BACKUP_STATE_RESTORE_WRITE,
+  BACKUP_STATE_STOPPED
+} backup_state_t;
+
+static backup_state_t m_state;
+static const dcc_cv_backup_handler_t* m_handler;
+static dcc_cv_record_t m_record;
+static uint8_t m_valueCount;        // Values in the record so far
+static uint16_t m_cvAddress;        // CV that is being worked on
+static uint16_t m_cvsLeft;
+static uint8_t m_recordIndex;       // Restore only, bit of the record that is being worked on
+static uint8_t m_readValue;
+static uint8_t m_retries;
+static bool m_written;
+static uint16_t m_startTime;
+static bool m_stopRequested;
+
+static bool begin_dump(void);
+static bool start_dump_cv(void);
+static bool start_restore_cv(void);
+static bool next_restore_cv(void);
+static void on_dump_result(dcc_result_t result, void* userData);
+static void on_restore_result(dcc_result_t result, void* userData);
+static void report_progress(dcc_result_t result);
+static void finish(bool stopped);
+
+bool dcc_cv_backup_dump(uint16_t firstCvAddress, uint16_t count, const dcc_cv_backup_handler_t* handler)
+{
+  if ((m_state == BACKUP_STATE_DUMP) || (m_state == BACKUP_STATE_RESTORE_VERIFY) || (m_state == BACKUP_STATE_RESTORE_WRITE))
+  {
+    return false;
+  }
+  if ((count == 0) || (firstCvAddress > CV_ADDRESS_MAX) || (count > (CV_ADDRESS_MAX + 1 - firstCvAddress)))
+  {
+    return false;
+  }
+
+  m_handler = handler;
+  m_cvAddress = firstCvAddress;
+  m_cvsLeft = count;
+  m_record.baseCvAddress = firstCvAddress;
+  m_record.bitmap = 0;
+  m_valueCount = 0;
+
+  return begin_dump();
+}
+
+bool dcc_cv_backup_resume(void)
+{
+  if (m_state != BACKUP_STATE_STOPPED)
+  {
+    return false;
+  }
+
+  return begin_dump();
+}
+
+void dcc_cv_backup_stop(void)
+{
+  if (m_state != BACKUP_STATE_IDLE)
+  {
+    m_stopRequested = true;
+  }
+}
+
+bool dcc_cv_backup_restore(const dcc_cv_record_t* record, const dcc_cv_backup_handler_t* handler)
+{
+  if ((m_state != BACKUP_STATE_IDLE) && (m_state != BACKUP_STATE_STOPPED))
+  {
+    return false;
+  }
+  if ((record->baseCvAddress > (CV_ADDRESS_MAX + 1 - DCC_CV_RECORD_CVS)) || (record->bitmap == 0) || dcc_service_mode_is_busy())
+  {
+    // A record without values has nothing to write
+    return false;
+  }
+
+  // A restore replaces a stopped dump, it can not be resumed after this
+  m_handler = handler;
+  m_record = *record;
+  m_recordIndex = 0;
+  m_valueCount = 0;
+  m_stopRequested = false;
+  m_state = BACKUP_STATE_RESTORE_VERIFY;
+
+  if (!next_restore_cv())
+  {
+    m_state = BACKUP_STATE_IDLE;
+    return false;
+  }
+  return true;
+}
+
+bool dcc_cv_backup_is_busy(void)
+{
+  return (m_state != BACKUP_STATE_IDLE) && (m_state != BACKUP_STATE_STOPPED);
+}
+
+uint8_t dcc_cv_backup_encode(const dcc_cv_record_t* record, uint8_t* buffer)
+{
+  uint8_t size = 0;
+  buffer[size++] = record->baseCvAddress >> 8;
+  buffer[size++] = record->baseCvAddress & 0xFF;
+  buffer[size++] = record->bitmap;
+
+  for (uint8_t i = 0; i < DCC_CV_RECORD_CVS; i++)
+  {
+    if (record->bitmap & (1 << i))
+    {
+      buffer[size] = record->values[size - 3];
+      size++;
+    }
+  }
+  return size;
+}
+
+bool dcc_cv_backup_decode(const uint8_t* buffer, uint8_t size, dcc_cv_record_t* record)
+{
+  if (size < 3)
+  {
+    return false;
+  }
+
+  record->baseCvAddress = ((uint16_t)buffer[0] << 8) | buffer[1];
+  record->bitmap = buffer[2];
+
+  uint8_t valueCount = 0;
+  for (uint8_t i = 0; i < DCC_CV_RECORD_CVS; i++)
+  {
+    if (record->bitmap & (1 << i))
+    {
+      valueCount++;
+    }
+  }
+  if (size != (3 + valueCount))
+  {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < valueCount; i++)
+  {
+    record->values[i] = buffer[3 + i];
+  }
+  return true;
+}
+
+static bool begin_dump(void)
+{
+  m_state = BACKUP_STATE_DUMP;
+  m_stopRequested = false;
+  m_retries = 0;
+  if (!start_dump_cv())
+  {
+    // The engine is busy with something else, the dump can be resumed later
+    m_state = BACKUP_STATE_STOPPED;
+    return false;
+  }
+  return true;
+}
+
+static bool start_dump_cv(void)
+{
+  m_startTime = dcc_service_mode_get_time_ms();
+  return dcc_service_mode_read_cv(m_cvAddress, &m_readValue, on_dump_result, NULL);
+}
+
+static void on_dump_result(dcc_result_t result, void* userData)
+{
+  if (result == DCC_RESULT_TIMEOUT)
+  {
+    // Keep the partial record, a resume starts again with this CV
+    report_progress(result);
+    finish(true);
+    return;
+  }
+
+  if ((result == DCC_RESULT_NACK) && (m_retries < MAX_RETRIES))
+  {
+    if (m_stopRequested)
+    {
+      // The CV is not done yet, it is not reported and a resume reads it again with fresh retries
+      finish(true);
+      return;
+    }
+    m_retries++;
+    start_dump_cv();
+    return;
+  }
+
+  // A CV that keeps failing is not implemented by the decoder, it is left out of the record
+  report_progress(result);
+  if (result == DCC_RESULT_ACK)
+  {
+    m_record.bitmap |= 1 << (m_cvAddress - m_record.baseCvAddress);
+    m_record.values[m_valueCount++] = m_readValue;
+  }
+
+  m_cvAddress++;
+  m_cvsLeft--;
+  m_retries = 0;
+
+  if ((m_cvsLeft == 0) || ((m_cvAddress - m_record.baseCvAddress) == DCC_CV_RECORD_CVS))
+  {
+    if (m_handler->on_record != NULL)
+    {
+      m_handler->on_record(&m_record);
+    }
+    m_record.baseCvAddress = m_cvAddress;
+    m_record.bitmap = 0;
+    m_valueCount = 0;
+  }
+
+  if (m_cvsLeft == 0)
+  {
+    finish(false);
+  }
+  else if (m_stopRequested)
+  {
+    finish(true);
+  }
+  else
+  {
+    // Started from the result callback, so the read shares the recovery resets of the previous one
+    start_dump_cv();
+  }
+}
+
+static bool next_restore_cv(void)
+{
+  // Find the next CV in the record
+  while (m_recordIndex < DCC_CV_RECORD_CVS)
+  {
+    if (m_record.bitmap & (1 << m_recordIndex))
+    {
+      m_cvAddress = m_record.baseCvAddress + m_recordIndex;
+      m_retries = 0;
+      m_written = false;
+      m_state = BACKUP_STATE_RESTORE_VERIFY;
+      m_startTime = dcc_service_mode_get_time_ms();
+      return start_restore_cv();
+    }
+    m_recordIndex++;
+  }
+  return false;
+}
+
+static bool start_restore_cv(void)
+{
+  uint8_t value = m_record.values[m_valueCount];
+  if (m_state == BACKUP_STATE_RESTORE_WRITE)
+  {
+    return dcc_service_mode_set_cv(m_cvAddress, value, on_restore_result, NULL);
+  }
+  return dcc_service_mode_verify_cv(m_cvAddress, value, on_restore_result, NULL);
+}
+
+static void on_restore_result(dcc_result_t result, void* userData)
+{
+  if (result == DCC_RESULT_TIMEOUT)
+  {
+    report_progress(result);
+    finish(true);
+    return;
+  }
+
+  if (m_state == BACKUP_STATE_RESTORE_WRITE)
+  {
+    // Not every decoder acknowledges a write, the verify that follows decides
+    m_written = true;
+    m_state = BACKUP_STATE_RESTORE_VERIFY;
+    start_restore_cv();
+    return;
+  }
+
+  if ((result == DCC_RESULT_NACK) && (m_retries < MAX_RETRIES))
+  {
+    if (m_stopRequested)
+    {
+      // Stopped before the CV was done, it is not reported as a NACK
+      finish(true);
+      return;
+    }
+
+    // The CV differs, write it and check again. Only the writes after the first one are retries.
+    if (m_written)
+    {
+      m_retries++;
+    }
+    m_state = BACKUP_STATE_RESTORE_WRITE;
+    start_restore_cv();
+    return;
+  }
+
+  report_progress(result);
+  m_recordIndex++;
+  m_valueCount++;
+
+  if (m_stopRequested)
+  {
+    finish(true);
+  }
+  else if (!next_restore_cv())
+  {
+    finish(false);
+  }
+}
+
+static void report_progress(dcc_result_t result)
+{
+  if (m_handler->on_progress != NULL)
+  {
+    dcc_cv_progress_t progress;
+    progress.cvAddress = m_cvAddress;
+    progress.result = result;
+    progress.retries = m_retries;
+    progress.written = m_written;
+    progress.durationMs = dcc_service_mode_get_time_ms() - m_startTime;
+    m_handler->on_progress(&progress);
+  }
+}
+
+static void finish(bool stopped)
+{
+  // Only a dump can be resumed
+  m_state = (stopped && (m_state == BACKUP_STATE_DUMP)) ? BACKUP_STATE_STOPPED : BACKUP_STATE_IDLE;
+  m_stopRequested = false;
+
+  if (m_handler->on_finished != NULL)
+  {
+    m_handler->on_finished(stopped, m_cvAddress);
+  }
+}
@@ -0,0 +1,141 @@
+#include "dcc/dcc_cv_jobs.h"
+#include <stddef.h>
+
+typedef struct
+{
+  dcc_cv_job_t job;
+  dcc_cv_job_callback_t callback;
+  void* userData;
+} entry_t;
+
+static entry_t m_jobs[DCC_CV_JOBS_QUEUE_SIZE];
+static uint8_t m_readIndex;
+static uint8_t m_count;
+static uint8_t m_nextId;
+static bool m_running;
+
+static void start_next_job(void);
+static bool start_job(entry_t* entry);
+static void on_job_result(dcc_result_t result, void* userData);
+
+bool dcc_cv_jobs_queue(const dcc_cv_job_t* job, dcc_cv_job_callback_t callback, void* userData, uint8_t* jobIdOut)
+{
+  if (m_count == DCC_CV_JOBS_QUEUE_SIZE)
+  {
+    return false;
+  }
+  if (!m_running && dcc_service_mode_is_busy())
+  {
+    // A single operation from somewhere else is still running
+    return false;
+  }
+
+  entry_t* entry = &m_jobs[(m_readIndex + m_count) % DCC_CV_JOBS_QUEUE_SIZE];
+  entry->job = *job;
+  entry->job.id = m_nextId++;
+  entry->callback = callback;
+  entry->userData = userData;
+  m_count++;
+
+  if (jobIdOut != NULL)
+  {
+    *jobIdOut = entry->job.id;
+  }
+
+  if (!m_running)
+  {
+    start_next_job();
+  }
+
+  return true;
+}
+
+void dcc_cv_jobs_clear(void)
+{
+  // Keep the running job, its result still has to come in
+  m_count = m_running ? 1 : 0;
+}
+
+uint8_t dcc_cv_jobs_get_count(void)
+{
+  return m_count;
+}
+
+static void start_next_job(void)
+{
+  while (m_count > 0)
+  {
+    entry_t* entry = &m_jobs[m_readIndex];
+    m_running = true;
+    if (start_job(entry))
+    {
+      return;
+    }
+
+    // Only an invalid CV address gets here, report it like a missing decoder and move on
+    m_running = false;
+    m_readIndex = (m_readIndex + 1) % DCC_CV_JOBS_QUEUE_SIZE;
+    m_count--;
+    if (entry->callback != NULL)
+    {
+      entry->callback(&entry->job, DCC_RESULT_NACK, entry->userData);
+    }
+  }
+}
+
+static bool start_job(entry_t* entry)
+{
+  dcc_cv_job_t* job = &entry->job;
+
+  switch (job->type)
+  {
+    case DCC_CV_JOB_WRITE:
+      return dcc_service_mode_set_cv(job->cvAddress, job->value, on_job_result, entry);
+    case DCC_CV_JOB_VERIFY:
+      return dcc_service_mode_verify_cv(job->cvAddress, job->value, on_job_result, entry);
+    case DCC_CV_JOB_WRITE_BIT:
+      return dcc_service_mode_set_cv_bit(job->cvAddress, job->bit, job->value, on_job_result, entry);
+    case DCC_CV_JOB_VERIFY_BIT:
+      return dcc_service_mode_verify_cv_bit(job->cvAddress, job->bit, job->value, on_job_result, entry);
+    case DCC_CV_JOB_READ:
+      return dcc_service_mode_read_cv(job->cvAddress, &job->value, on_job_result, entry);
+  }
+
+  return false;
+}
+
+static void on_job_result(dcc_result_t result, void* userData)
+{
+  // Release the slot first, the callback may queue more jobs into it
+  entry_t finished = *(entry_t*)userData;
+  m_running = false;
+  m_readIndex = (m_readIndex + 1) % DCC_CV_JOBS_QUEUE_SIZE;
+  m_count--;
+
+  if (finished.callback != NULL)
+  {
+    finished.callback(&finished.job, result, finished.userData);
+  }
+
+  if (result == DCC_RESULT_TIMEOUT)
+  {
+    // The track is gone or the engine was stopped, the remaining jobs would only time out one by one
+    while (m_count > 0)
+    {
+      entry_t* entry = &m_jobs[m_readIndex];
+      m_readIndex = (m_readIndex + 1) % DCC_CV_JOBS_QUEUE_SIZE;
+      m_count--;
+      if (entry->callback != NULL)
+      {
+        entry->callback(&entry->job, DCC_RESULT_TIMEOUT, entry->userData);
+      }
+    }
+    return;
+  }
+
+  // Still inside the service mode result callback, so the next job shares the recovery resets of this one
+  if (!m_running)
+  {
+    start_next_job();
+  }
+}
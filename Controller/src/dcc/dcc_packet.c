@@ -0,0 +1,237 @@
+#include "dcc/dcc_packet.h"
+
+static const uint8_t m_firstFunction[NR_OF_DCC_FUNCTION_GROUPS] = { 0, 5, 9, 13, 21 };
+
+static bool begin_packet(dcc_packet_t* packet, uint16_t address);
+static bool pom_packet(dcc_packet_t* packet, uint16_t address, uint8_t instruction, uint16_t cvAddress, uint8_t data);
+static void finish_packet(dcc_packet_t* packet);
+
+void dcc_packet_idle(dcc_packet_t* packet)
+{
+  packet->data[0] = 0xFF;
+  packet->data[1] = 0x00;
+  packet->size = 2;
+  finish_packet(packet);
+}
+
+bool dcc_packet_speed(dcc_packet_t* packet, uint16_t address, dcc_speed_steps_t steps, uint8_t speed, bool forward)
+{
+  if (!begin_packet(packet, address))
+  {
+    return false;
+  }
+
+  // Step value 1 is the emergency stop, so all moving speeds are shifted up by one (or by three for 28 steps)
+  switch (steps)
+  {
+    case DCC_SPEED_STEPS_14:
+    {
+      if (speed > 14)
+      {
+        return false;
+      }
+      // 01DCSSSS, the C bit controls the headlight in 14 step mode and is left off
+      packet->data[packet->size++] = 0x40 | (forward ? 0x20 : 0x00) | (speed ? speed + 1 : 0);
+      break;
+    }
+    case DCC_SPEED_STEPS_28:
+    {
+      if (speed > 28)
+      {
+        return false;
+      }
+      // 01DCSSSS, the C bit is the least significant bit of the speed
+      uint8_t value = speed ? speed + 3 : 0;
+      packet->data[packet->size++] = 0x40 | (forward ? 0x20 : 0x00) | ((value & 1) << 4) | (value >> 1);
+      break;
+    }
+    case DCC_SPEED_STEPS_128:
+    {
+      if (speed > 126)
+      {
+        return false;
+      }
+      // Advanced operations instruction, 128 speed step control
+      packet->data[packet->size++] = 0x3F;
+      packet->data[packet->size++] = (forward ? 0x80 : 0x00) | (speed ? speed + 1 : 0);
+      break;
+    }
+    default:
+    {
+      return false;
+    }
+  }
+
+  finish_packet(packet);
+  return true;
+}
+
+bool dcc_packet_emergency_stop(dcc_packet_t* packet, uint16_t address)
+{
+  if (!begin_packet(packet, address))
+  {
+    return false;
+  }
+
+  // Speed and direction instruction with the emergency stop step, the direction bit may be ignored by decoders
+  packet->data[packet->size++] = 0x41;
+
+  finish_packet(packet);
+  return true;
+}
+
+bool dcc_packet_functions(dcc_packet_t* packet, uint16_t address, dcc_function_group_t group, uint8_t state)
+{
+  if (!begin_packet(packet, address))
+  {
+    return false;
+  }
+
+  switch (group)
+  {
+    case DCC_FUNCTION_GROUP_F0_F4:
+    {
+      // 100DDDDD, F0 is bit 4 and F1-F4 are bits 0-3
+      packet->data[packet->size++] = 0x80 | ((state & 1) << 4) | ((state >> 1) & 0x0F);
+      break;
+    }
+    case DCC_FUNCTION_GROUP_F5_F8:
+    {
+      packet->data[packet->size++] = 0xB0 | (state & 0x0F);
+      break;
+    }
+    case DCC_FUNCTION_GROUP_F9_F12:
+    {
+      packet->data[packet->size++] = 0xA0 | (state & 0x0F);
+      break;
+    }
+    case DCC_FUNCTION_GROUP_F13_F20:
+    {
+      packet->data[packet->size++] = 0xDE;
+      packet->data[packet->size++] = state;
+      break;
+    }
+    case DCC_FUNCTION_GROUP_F21_F28:
+    {
+      packet->data[packet->size++] = 0xDF;
+      packet->data[packet->size++] = state;
+      break;
+    }
+    default:
+    {
+      return false;
+    }
+  }
+
+  finish_packet(packet);
+  return true;
+}
+
+bool dcc_packet_basic_accessory(dcc_packet_t* packet, uint16_t address, uint8_t output, bool activate)
+{
+  if ((address > DCC_PACKET_MAX_BASIC_ACCESSORY) || (output > 7))
+  {
+    return false;
+  }
+
+  // {10AAAAAA} {1AAADCCC}, the upper three address bits are sent inverted
+  packet->data[0] = 0x80 | (address & 0x3F);
+  packet->data[1] = 0x80 | ((~(address >> 6) & 0x07) << 4) | (activate ? 0x08 : 0x00) | output;
+  packet->size = 2;
+
+  finish_packet(packet);
+  return true;
+}
+
+bool dcc_packet_extended_accessory(dcc_packet_t* packet, uint16_t address, uint8_t aspect)
+{
+  if (address > DCC_PACKET_MAX_EXT_ACCESSORY)
+  {
+    return false;
+  }
+
+  // {10AAAAAA} {0AAA0AA1} {XXXXXXXX}, the upper three address bits are sent inverted
+  packet->data[0] = 0x80 | ((address >> 2) & 0x3F);
+  packet->data[1] = ((~(address >> 8) & 0x07) << 4) | ((address & 0x03) << 1) | 0x01;
+  packet->data[2] = aspect;
+  packet->size = 3;
+
+  finish_packet(packet);
+  return true;
+}
+
+bool dcc_packet_pom_write_cv(dcc_packet_t* packet, uint16_t address, uint16_t cvAddress, uint8_t data)
+{
+  // The fixed 0xEC indicates a long form write byte instruction
+  return pom_packet(packet, address, 0xEC, cvAddress, data);
+}
+
+bool dcc_packet_pom_write_cv_bit(dcc_packet_t* packet, uint16_t address, uint16_t cvAddress, uint8_t bit, uint8_t data)
+{
+  // The fixed 0xE8 indicates a long form bit manipulation instruction, 0xF0 in the data byte makes it a write
+  uint8_t dataByte = 0xF0 | (bit & 0x7) | ((data & 1) << 3);
+  return pom_packet(packet, address, 0xE8, cvAddress, dataByte);
+}
+
+dcc_function_group_t dcc_packet_get_function_group(uint8_t function)
+{
+  dcc_function_group_t group = DCC_FUNCTION_GROUP_F0_F4;
+  while ((group + 1 < NR_OF_DCC_FUNCTION_GROUPS) && (function >= m_firstFunction[group + 1]))
+  {
+    group++;
+  }
+  return group;
+}
+
+uint8_t dcc_packet_get_first_function(dcc_function_group_t group)
+{
+  return m_firstFunction[group];
+}
+
+static bool begin_packet(dcc_packet_t* packet, uint16_t address)
+{
+  if (address <= DCC_PACKET_MAX_SHORT_ADDRESS)
+  {
+    packet->data[0] = address;
+    packet->size = 1;
+  }
+  else if (address <= DCC_PACKET_MAX_LONG_ADDRESS)
+  {
+    packet->data[0] = 0xC0 | (address >> 8);
+    packet->data[1] = address & 0xFF;
+    packet->size = 2;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+static bool pom_packet(dcc_packet_t* packet, uint16_t address, uint8_t instruction, uint16_t cvAddress, uint8_t data)
+{
+  // Broadcast CV writes are not something we ever want on the main track
+  if ((address == DCC_PACKET_BROADCAST_ADDRESS) || (cvAddress > DCC_PACKET_MAX_CV_ADDRESS) || !begin_packet(packet, address))
+  {
+    return false;
+  }
+
+  // {1110CCVV} {VVVVVVVV} {DDDDDDDD}
+  packet->data[packet->size++] = instruction | (cvAddress >> 8);
+  packet->data[packet->size++] = cvAddress & 0xFF;
+  packet->data[packet->size++] = data;
+
+  finish_packet(packet);
+  return true;
+}
+
+static void finish_packet(dcc_packet_t* packet)
+{
+  // Error detection byte, XOR of all previous bytes
+  uint8_t checksum = 0;
+  for (uint8_t i = 0; i < packet->size; i++)
+  {
+    checksum ^= packet->data[i];
+  }
+  packet->data[packet->size++] = checksum;
+}
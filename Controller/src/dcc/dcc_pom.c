@@ -0,0 +1,92 @@
+#include "dcc/dcc_pom.h"
+#include <stddef.h>
+
+// Decoders only act on a CV write after receiving two identical packets in a row, send a few more in case one gets lost on the rails
+#define REPEAT_COUNT      (4)
+// Operations for the same decoder go out back to back, up to this many before the refresh traffic gets a slot
+#define MAX_BATCH_LENGTH  (8)
+
+typedef struct
+{
+  uint16_t address;
+  dcc_packet_t packet;
+} job_t;
+
+static job_t m_jobs[DCC_POM_QUEUE_SIZE];
+static uint8_t m_readIndex;
+static uint8_t m_count;
+static uint8_t m_repeatsLeft;
+static uint8_t m_batchLength;
+static bool m_yield;
+
+void dcc_pom_initialize(void)
+{
+  m_readIndex = 0;
+  m_count = 0;
+  m_repeatsLeft = REPEAT_COUNT;
+  m_batchLength = 0;
+  m_yield = false;
+}
+
+uint8_t dcc_pom_get_queue_depth(void)
+{
+  return m_count;
+}
+
+bool dcc_pom_queue_packet(uint16_t address, const dcc_packet_t* packet)
+{
+  if (m_count >= DCC_POM_QUEUE_SIZE)
+  {
+    return false;
+  }
+
+  uint8_t writeIndex = (m_readIndex + m_count) % DCC_POM_QUEUE_SIZE;
+  m_jobs[writeIndex].address = address;
+  m_jobs[writeIndex].packet = *packet;
+  m_count++;
+
+  return true;
+}
+
+bool dcc_pom_get_packet(dcc_packet_t* packet, bool ignoreYield)
+{
+  if ((m_count == 0) || (m_yield && !ignoreYield))
+  {
+    // Give the refresh traffic one slot between CV operations so running trains keep getting their packets
+    return false;
+  }
+
+  // The repeats of one operation go out back to back, nothing else may be sent to the decoder in between
+  *packet = m_jobs[m_readIndex].packet;
+  return true;
+}
+
+void dcc_pom_packet_queued(bool programming)
+{
+  // Any other packet that makes it to the track is the slot the refresh traffic was waiting for
+  m_yield = false;
+  if (!programming)
+  {
+    return;
+  }
+
+  if (--m_repeatsLeft == 0)
+  {
+    uint16_t address = m_jobs[m_readIndex].address;
+
+    m_repeatsLeft = REPEAT_COUNT;
+    m_readIndex = (m_readIndex + 1) % DCC_POM_QUEUE_SIZE;
+    m_count--;
+
+    // Keep going if the next operation is for the same decoder, otherwise let the refresh traffic through
+    if ((m_count > 0) && (m_jobs[m_readIndex].address == address) && (++m_batchLength < MAX_BATCH_LENGTH))
+    {
+      m_yield = false;
+    }
+    else
+    {
+      m_batchLength = 0;
+      m_yield = true;
+    }
+  }
+}
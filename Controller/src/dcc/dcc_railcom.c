@@ -0,0 +1,77 @@
+#include "dcc/dcc_railcom.h"
+#include "arduino/serial1.h"
+#include <string.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+// Timer 4 restarts at the start of the cutout and runs at 0.5us per tick. Channel 1 bytes are done by 177us, channel 2 starts at 193us.
+#define CHANNEL_2_START_TICKS     (193 * 2)
+
+static dcc_railcom_data_t m_capture;              // Written by the receive interrupt during a cutout
+static volatile dcc_railcom_data_t m_lastData;    // Last completed cutout with a response
+static volatile bool m_hasNewData;
+
+static void on_receive(uint8_t data);
+
+void dcc_railcom_initialize(void)
+{
+  serial1_initialize();
+  serial1_set_receive_enabled(false);
+  serial1_set_receive_callback(on_receive);
+
+  m_hasNewData = false;
+}
+
+void dcc_railcom_on_cutout_start(uint8_t dccMessageId)
+{
+  m_capture.dccMessageId = dccMessageId;
+  m_capture.channel1Length = 0;
+  m_capture.channel2Length = 0;
+
+  serial1_set_receive_enabled(true);
+}
+
+void dcc_railcom_on_cutout_end(void)
+{
+  serial1_set_receive_enabled(false);
+
+  if ((m_capture.channel1Length > 0) || (m_capture.channel2Length > 0))
+  {
+    memcpy((void*)&m_lastData, &m_capture, sizeof(m_capture));
+    m_hasNewData = true;
+  }
+}
+
+bool dcc_railcom_get_data(dcc_railcom_data_t *data)
+{
+  if (!m_hasNewData)
+  {
+    return false;
+  }
+
+  // The DCC interrupt may overwrite the data after the next cutout
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    memcpy(data, (void*)&m_lastData, sizeof(dcc_railcom_data_t));
+    m_hasNewData = false;
+  }
+
+  return true;
+}
+
+static void on_receive(uint8_t data)
+{
+  // The byte has just been completely received, so its timing tells us which channel it belongs to
+  if (TCNT4 < CHANNEL_2_START_TICKS)
+  {
+    if (m_capture.channel1Length < DCC_RAILCOM_CHANNEL_1_SIZE)
+    {
+      m_capture.channel1[m_capture.channel1Length++] = data;
+    }
+  }
+  else if (m_capture.channel2Length < DCC_RAILCOM_CHANNEL_2_SIZE)
+  {
+    m_capture.channel2[m_capture.channel2Length++] = data;
+  }
+}
@@ -0,0 +1,279 @@
+#include "dcc/dcc_refresh.h"
+#include <stddef.h>
+#include <string.h>
+
+// Packet groups that make up the state of a single decoder, the speed packet followed by the DCC function groups
+typedef enum
+{
+  GROUP_SPEED,
+  GROUP_F0_F4,
+  NR_OF_GROUPS = GROUP_F0_F4 + NR_OF_DCC_FUNCTION_GROUPS
+} group_t;
+
+typedef struct
+{
+  dcc_refresh_entry_t state;
+  uint8_t changedGroups;      // Groups that have changed since they were last sent
+} decoder_t;
+
+static decoder_t m_decoders[DCC_REFRESH_MAX_DECODERS];
+static uint8_t m_refreshIndex;
+static uint8_t m_refreshGroup;
+static uint8_t m_changedIndex;
+static uint16_t m_lastAddress;
+
+// The packet dcc_refresh_get_packet handed out, the scheduler only moves on once it is queued
+static decoder_t* m_picked;           // NULL for an idle packet
+static group_t m_pickedGroup;
+static uint8_t m_pickedChangedIndex;
+static uint8_t m_pickedRefreshIndex;
+static uint8_t m_pickedRefreshGroup;
+
+static decoder_t* find_decoder(uint16_t address, bool create);
+static bool is_group_active(const decoder_t* decoder, group_t group);
+static uint8_t get_function_state(const decoder_t* decoder, dcc_function_group_t group);
+
+void dcc_refresh_initialize(void)
+{
+  memset(&m_decoders[0], 0, sizeof(m_decoders));
+  m_refreshIndex = 0;
+  m_refreshGroup = 0;
+  m_changedIndex = 0;
+  m_lastAddress = 0;
+  m_picked = NULL;
+}
+
+bool dcc_refresh_set_speed(uint16_t address, uint8_t speed, bool forward)
+{
+  if (speed > DCC_REFRESH_MAX_SPEED)
+  {
+    return false;
+  }
+
+  decoder_t* decoder = find_decoder(address, true);
+  if (decoder == NULL)
+  {
+    return false;
+  }
+
+  if ((decoder->state.speed != speed) || (decoder->state.forward != forward))
+  {
+    decoder->state.speed = speed;
+    decoder->state.forward = forward;
+    decoder->changedGroups |= (1 << GROUP_SPEED);
+  }
+  return true;
+}
+
+bool dcc_refresh_set_function(uint16_t address, uint8_t function, bool enabled)
+{
+  if (function > DCC_REFRESH_MAX_FUNCTION)
+  {
+    return false;
+  }
+
+  decoder_t* decoder = find_decoder(address, true);
+  if (decoder == NULL)
+  {
+    return false;
+  }
+
+  uint32_t mask = ((uint32_t)1 << function);
+  bool wasEnabled = (decoder->state.functions & mask) != 0;
+  if (wasEnabled == enabled)
+  {
+    return true;
+  }
+
+  decoder->state.functions ^= mask;
+  decoder->changedGroups |= (1 << (GROUP_F0_F4 + dcc_packet_get_function_group(function)));
+  return true;
+}
+
+void dcc_refresh_stop_all(void)
+{
+  for (uint8_t i = 0; i < DCC_REFRESH_MAX_DECODERS; i++)
+  {
+    decoder_t* decoder = &m_decoders[i];
+    if ((decoder->state.address != 0) && (decoder->state.speed != 0))
+    {
+      decoder->state.speed = 0;
+      decoder->changedGroups |= (1 << GROUP_SPEED);
+    }
+  }
+}
+
+bool dcc_refresh_release(uint16_t address)
+{
+  decoder_t* decoder = find_decoder(address, false);
+  if (decoder == NULL)
+  {
+    return false;
+  }
+
+  decoder->state.address = 0;
+  decoder->changedGroups = 0;
+  return true;
+}
+
+const dcc_refresh_entry_t* dcc_refresh_get_entry(uint8_t index)
+{
+  if ((index >= DCC_REFRESH_MAX_DECODERS) || (m_decoders[index].state.address == 0))
+  {
+    return NULL;
+  }
+  return &m_decoders[index].state;
+}
+
+bool dcc_refresh_get_packet(dcc_packet_t* packet)
+{
+  decoder_t* selected = NULL;
+  group_t selectedGroup = GROUP_SPEED;
+  uint8_t changedIndex = m_changedIndex;
+  uint8_t refreshIndex = m_refreshIndex;
+  uint8_t refreshGroup = m_refreshGroup;
+
+  // Changed state goes first, the search starts after the last changed decoder that was served so they all get a turn
+  for (uint8_t i = 0; (i < DCC_REFRESH_MAX_DECODERS) && (selected == NULL); i++)
+  {
+    uint8_t index = (changedIndex + i) % DCC_REFRESH_MAX_DECODERS;
+    decoder_t* decoder = &m_decoders[index];
+    if ((decoder->state.address == 0) || (decoder->changedGroups == 0) || (decoder->state.address == m_lastAddress))
+    {
+      continue;
+    }
+
+    for (uint8_t group = 0; group < NR_OF_GROUPS; group++)
+    {
+      if (decoder->changedGroups & (1 << group))
+      {
+        selected = decoder;
+        selectedGroup = group;
+        changedIndex = (index + 1) % DCC_REFRESH_MAX_DECODERS;
+        break;
+      }
+    }
+  }
+
+  // Nothing changed, continue the round-robin refresh. Decoders take turns for each group so packets to the same address are spread out.
+  for (uint8_t i = 0; (i < DCC_REFRESH_MAX_DECODERS * NR_OF_GROUPS) && (selected == NULL); i++)
+  {
+    decoder_t* decoder = &m_decoders[refreshIndex];
+    group_t group = refreshGroup;
+
+    if (++refreshIndex >= DCC_REFRESH_MAX_DECODERS)
+    {
+      refreshIndex = 0;
+      refreshGroup = (refreshGroup + 1) % NR_OF_GROUPS;
+    }
+
+    if ((decoder->state.address != 0) && is_group_active(decoder, group))
+    {
+      selected = decoder;
+      selectedGroup = group;
+    }
+  }
+
+  if (selected == NULL)
+  {
+    // Nothing in the table
+    m_lastAddress = 0;
+    return false;
+  }
+
+  if (selected->state.address == m_lastAddress)
+  {
+    // Packets to the same decoder need some space in between, put an idle packet in the gap.
+    // The scheduler position is left alone so the selected packet is the next one to go out.
+    dcc_packet_idle(packet);
+    m_picked = NULL;
+    return true;
+  }
+
+  m_picked = selected;
+  m_pickedGroup = selectedGroup;
+  m_pickedChangedIndex = changedIndex;
+  m_pickedRefreshIndex = refreshIndex;
+  m_pickedRefreshGroup = refreshGroup;
+
+  if (selectedGroup == GROUP_SPEED)
+  {
+    dcc_packet_speed(packet, selected->state.address, DCC_SPEED_STEPS_128, selected->state.speed, selected->state.forward);
+  }
+  else
+  {
+    dcc_function_group_t functionGroup = selectedGroup - GROUP_F0_F4;
+    dcc_packet_functions(packet, selected->state.address, functionGroup, get_function_state(selected, functionGroup));
+  }
+  return true;
+}
+
+void dcc_refresh_packet_queued(void)
+{
+  if (m_picked == NULL)
+  {
+    // The idle packet is the space in between
+    m_lastAddress = 0;
+    return;
+  }
+
+  // The change is on its way to the decoder now
+  m_picked->changedGroups &= ~(1 << m_pickedGroup);
+  m_changedIndex = m_pickedChangedIndex;
+  m_refreshIndex = m_pickedRefreshIndex;
+  m_refreshGroup = m_pickedRefreshGroup;
+  m_lastAddress = m_picked->state.address;
+  m_picked = NULL;
+}
+
+static decoder_t* find_decoder(uint16_t address, bool create)
+{
+  if ((address == DCC_PACKET_BROADCAST_ADDRESS) || (address > DCC_PACKET_MAX_LONG_ADDRESS))
+  {
+    return NULL;
+  }
+
+  decoder_t* freeDecoder = NULL;
+  for (uint8_t i = 0; i < DCC_REFRESH_MAX_DECODERS; i++)
+  {
+    if (m_decoders[i].state.address == address)
+    {
+      return &m_decoders[i];
+    }
+    if ((freeDecoder == NULL) && (m_decoders[i].state.address == 0))
+    {
+      freeDecoder = &m_decoders[i];
+    }
+  }
+
+  if (!create || (freeDecoder == NULL))
+  {
+    return NULL;
+  }
+
+  // New decoder, make sure it gets its complete state as soon as possible
+  memset(freeDecoder, 0, sizeof(decoder_t));
+  freeDecoder->state.address = address;
+  freeDecoder->state.forward = true;
+  freeDecoder->changedGroups = (1 << GROUP_SPEED) | (1 << GROUP_F0_F4);
+  return freeDecoder;
+}
+
+static bool is_group_active(const decoder_t* decoder, group_t group)
+{
+  if (group <= GROUP_F0_F4)
+  {
+    return true;
+  }
+
+  // Decoders start with all functions off, so groups without any enabled function do not need a refresh
+  return get_function_state(decoder, group - GROUP_F0_F4) != 0;
+}
+
+static uint8_t get_function_state(const decoder_t* decoder, dcc_function_group_t group)
+{
+  uint8_t firstFunction = dcc_packet_get_first_function(group);
+  uint8_t nrOfFunctions = (group + 1 < NR_OF_DCC_FUNCTION_GROUPS) ? dcc_packet_get_first_function(group + 1) - firstFunction : DCC_REFRESH_MAX_FUNCTION + 1 - firstFunction;
+
+  return (decoder->state.functions >> firstFunction) & ((1 << nrOfFunctions) - 1);
+}
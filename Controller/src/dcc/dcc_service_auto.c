@@ -0,0 +1,112 @@
+#include "dcc/dcc_service_auto.h"
+#include <stddef.h>
+
+// The method that worked for the decoder on the programming track
+static bool m_known;
+static dcc_service_method_t m_knownMethod;
+
+// The running operation
+static uint16_t m_cvAddress;
+static uint8_t m_data;
+static bool m_write;
+static bool m_probing;
+static dcc_service_method_t m_method;
+static void* m_userData;
+static dcc_callback_t m_callback;
+
+static bool begin(bool write, uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData);
+static bool start_from(dcc_service_method_t method);
+static void on_result(dcc_result_t result, void* userData);
+
+bool dcc_service_auto_set_cv(uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData)
+{
+  return begin(true, cvAddress, data, callback, userData);
+}
+
+bool dcc_service_auto_verify_cv(uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData)
+{
+  return begin(false, cvAddress, data, callback, userData);
+}
+
+bool dcc_service_auto_get_method(dcc_service_method_t* method)
+{
+  if (!m_known)
+  {
+    return false;
+  }
+
+  *method = m_knownMethod;
+  return true;
+}
+
+void dcc_service_auto_set_method(dcc_service_method_t method)
+{
+  m_known = (method != DCC_SERVICE_METHOD_COUNT);
+  m_knownMethod = method;
+}
+
+static bool begin(bool write, uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData)
+{
+  if (dcc_service_mode_is_busy())
+  {
+    return false;
+  }
+
+  m_cvAddress = cvAddress;
+  m_data = data;
+  m_write = write;
+  m_userData = userData;
+  m_callback = callback;
+
+  if (m_known)
+  {
+    // Known decoder, a NACK is a real answer now. Fails if the method can not reach the CV.
+    m_probing = false;
+    m_method = m_knownMethod;
+    if (write)
+    {
+      return dcc_service_mode_set_cv_with_method(m_method, cvAddress, data, on_result, NULL);
+    }
+    return dcc_service_mode_verify_cv_with_method(m_method, cvAddress, data, on_result, NULL);
+  }
+
+  // A verify NACK can just as well mean the CV holds another value, only writes move on to the next method after one.
+  // A verify still starts with the best method that reaches the CV, and its ACK tells us the method.
+  m_probing = true;
+  return start_from(DCC_SERVICE_METHOD_DIRECT);
+}
+
+static bool start_from(dcc_service_method_t method)
+{
+  // Skip the methods that can not reach the CV, direct mode is the most capable and goes first
+  for (; method < DCC_SERVICE_METHOD_COUNT; method++)
+  {
+    bool started = m_write ?
+      dcc_service_mode_set_cv_with_method(method, m_cvAddress, m_data, on_result, NULL) :
+      dcc_service_mode_verify_cv_with_method(method, m_cvAddress, m_data, on_result, NULL);
+    if (started)
+    {
+      m_method = method;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void on_result(dcc_result_t result, void* userData)
+{
+  if (m_probing)
+  {
+    if (result == DCC_RESULT_ACK)
+    {
+      dcc_service_auto_set_method(m_method);
+    }
+    else if ((result == DCC_RESULT_NACK) && m_write && start_from(m_method + 1))
+    {
+      // Still inside the service mode callback, so the next method shares the recovery resets
+      return;
+    }
+  }
+
+  m_callback(result, m_userData);
+}
@@ -1,13 +1,22 @@
 #include "dcc/dcc_service_mode.h"
 #include "dcc/dcc.h"
-#include "sysb/timer.h"
-#include "arduino/gpio.h"
+#include "timer.h"
+#include "gpio.h"
 #include <stddef.h>
 
 #define DIRECT_MODE_MESSAGE_LENGTH    (4)
+#define REGISTER_MODE_MESSAGE_LENGTH  (3)
+#define RESET_PACKET_COUNT            (3)
+#define OPERATION_PACKET_COUNT        (5)
+#define RECOVERY_PACKET_COUNT         (6)
+#define REGISTER_WRITE_RECOVERY_COUNT (10)    // Register and paged mode writes need a longer recovery time
+#define PAGE_REGISTER                 (5)     // Register 6, zero based
 #define TIMEOUT_DURATION_MS           (500)
-#define CURRENT_SENSE_HISTORY_LENGTH  (12)
-#define ACKNOWLEDGE_PULSE_THRESHOLD   (5)
+#define ACK_DEFAULT_THRESHOLD         (5)     // ADC counts above the baseline
+#define ACK_DEFAULT_MIN_WIDTH_MS      (5)     // The spec asks for 6 ms, allow for sample alignment
+#define ACK_DEFAULT_MAX_WIDTH_MS      (8)
+#define BASELINE_FRACTION_BITS        (4)     // The baseline is kept with 4 fractional bits
+#define BASELINE_EMA_SHIFT            (3)     // Every idle sample moves the baseline 1/8 of the way
 
 typedef enum
 {
@@ -21,19 +30,56 @@ static const uint8_t m_resetMessage[] = { 0, 0, 0 };
 
 
 static uint8_t m_directModeMessage[DIRECT_MODE_MESSAGE_LENGTH];
+static uint8_t m_messageLength;
+static uint8_t m_recoveryCount;
 static uint8_t m_messageId;
 static uint8_t m_timeoutTimer;
 static uint8_t m_stateCounter;
 static service_mode_state_t m_state;
 static void* m_callbackUserData;
 static dcc_callback_t m_callback;
-static uint16_t m_currentSenseHistory[CURRENT_SENSE_HISTORY_LENGTH];
 static bool m_ackDetected;
+static bool m_chained;
+
+// ACK detection, samples arrive once per millisecond so a run length in samples is a width in ms
+static dcc_ack_config_t m_ackConfig = { ACK_DEFAULT_THRESHOLD, ACK_DEFAULT_MIN_WIDTH_MS, ACK_DEFAULT_MAX_WIDTH_MS };
+static uint16_t m_baseline;
+static bool m_hasBaseline;
+static uint8_t m_pulseWidth;
+static uint16_t m_pulsePeak;
+static dcc_ack_pulse_t m_lastPulse;
+static bool m_hasLastPulse;
+static uint16_t m_time;
+
+// CV read state, a read is a chain of bit verifies followed by a byte verify of the assembled value
+static uint16_t m_readCvAddress;
+static uint8_t m_readBit;
+static uint8_t m_readValue;
+static uint8_t* m_readResult;
+static void* m_readUserData;
+static dcc_callback_t m_readCallback;
+
+// Data register operation that follows the page register write of the non direct methods
+static uint8_t m_pagedRegister;
+static uint8_t m_pagedData;
+static bool m_pagedWrite;
+static void* m_pagedUserData;
+static dcc_callback_t m_pagedCallback;
+
+// Register mode gives access to these CVs only, zero based and indexed by register
+static const uint16_t m_registerCvs[] = { 0, 1, 2, 3, 28, 0xFFFF, 6, 7 };
 
 static void on_timer(uint8_t id);
 static bool begin_direct_mode(uint16_t cvAddress, uint8_t firstByte, uint8_t data, dcc_callback_t callback, void* userData);
+static bool begin_register_mode(uint8_t reg, bool write, uint8_t data, dcc_callback_t callback, void* userData);
+static bool begin_paged_mode(uint8_t page, uint8_t reg, bool write, uint8_t data, dcc_callback_t callback, void* userData);
+static bool begin_method(dcc_service_method_t method, bool write, uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData);
+static bool begin_sequence(dcc_callback_t callback, void* userData);
+static void on_page_written(dcc_result_t result, void* userData);
 static void enter_state(service_mode_state_t state);
 static void evaluate_state(void);
+static void finish(dcc_result_t result);
+static void on_read_step(dcc_result_t result, void* userData);
 
 void dcc_service_mode_initialize(void)
 {
@@ -67,6 +113,94 @@ bool dcc_service_mode_verify_cv_bit(uint16_t cvAddress, uint8_t bit, uint8_t dat
   return begin_direct_mode(cvAddress, 0x78, dataByte, callback, userData);
 }
 
+bool dcc_service_mode_set_cv_with_method(dcc_service_method_t method, uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData)
+{
+  return begin_method(method, true, cvAddress, data, callback, userData);
+}
+
+bool dcc_service_mode_verify_cv_with_method(dcc_service_method_t method, uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData)
+{
+  return begin_method(method, false, cvAddress, data, callback, userData);
+}
+
+bool dcc_service_mode_method_supports_cv(dcc_service_method_t method, uint16_t cvAddress)
+{
+  switch (method)
+  {
+    case DCC_SERVICE_METHOD_DIRECT:
+    case DCC_SERVICE_METHOD_PAGED:
+      return cvAddress <= 0x3FF;
+    case DCC_SERVICE_METHOD_REGISTER:
+    {
+      if (cvAddress > 0x3FF)
+      {
+        return false;
+      }
+      for (uint8_t i = 0; i < sizeof(m_registerCvs) / sizeof(m_registerCvs[0]); i++)
+      {
+        if (m_registerCvs[i] == cvAddress)
+        {
+          return true;
+        }
+      }
+      return false;
+    }
+    case DCC_SERVICE_METHOD_ADDRESS_ONLY:
+      return cvAddress == 0;
+    default:
+      return false;
+  }
+}
+
+void dcc_service_mode_set_ack_config(const dcc_ack_config_t* config)
+{
+  m_ackConfig = *config;
+}
+
+void dcc_service_mode_get_ack_config(dcc_ack_config_t* config)
+{
+  *config = m_ackConfig;
+}
+
+bool dcc_service_mode_get_last_ack(dcc_ack_pulse_t* pulse)
+{
+  if (!m_hasLastPulse)
+  {
+    return false;
+  }
+
+  *pulse = m_lastPulse;
+  return true;
+}
+
+uint16_t dcc_service_mode_get_time_ms(void)
+{
+  return m_time;
+}
+
+bool dcc_service_mode_is_busy(void)
+{
+  return m_state != SERVICE_MODE_STATE_IDLE;
+}
+
+bool dcc_service_mode_read_cv(uint16_t cvAddress, uint8_t* value, dcc_callback_t callback, void* userData)
+{
+  // Every bit is checked against a 1, the final byte verify catches bits that were misread
+  if (!dcc_service_mode_verify_cv_bit(cvAddress, 0, 1, on_read_step, NULL))
+  {
+    return false;
+  }
+
+  m_readCvAddress = cvAddress;
+  m_readBit = 0;
+  m_readValue = 0;
+  m_readResult = value;
+  m_readUserData = userData;
+  m_readCallback = callback;
+
+  return true;
+}
+
 void dcc_service_mode_tx_complete(const dcc_event_message_t* message)
 {
   if (m_state == SERVICE_MODE_STATE_IDLE)
@@ -83,34 +217,57 @@ void dcc_service_mode_tx_complete(const dcc_event_message_t* message)
 
 void dcc_service_mode_on_current_sense_data(uint16_t data)
 {
-  // Push back history
-  for (uint8_t i = CURRENT_SENSE_HISTORY_LENGTH - 1; i > 0; --i)
+  uint16_t baseline = m_baseline >> BASELINE_FRACTION_BITS;
+
+  m_time++;
+
+  if (!m_hasBaseline || (m_pulseWidth > m_ackConfig.maxWidthMs))
   {
-    m_currentSenseHistory[i] = m_currentSenseHistory[i - 1];
+    // First sample or a lasting load change, restart the baseline from here instead of ramping towards it
+    m_baseline = data << BASELINE_FRACTION_BITS;
+    m_hasBaseline = true;
+    m_pulseWidth = 0;
+    m_pulsePeak = 0;
   }
-  m_currentSenseHistory[0] = data;
-
-  // Look for ACK pulses
-  if ((m_state == SERVICE_MODE_STATE_DIRECT_PACKETS) || (m_state == SERVICE_MODE_STATE_RECOVERY_TIME))
+  else if (data > baseline + m_ackConfig.threshold)
   {
-    // 0 1 2 3 4 5 6 7 8 9 10
-    // L ? H H H H ? ? ? ? L
-    // Check if index 0 and 10 are both low
-    uint16_t lowLevel = (m_currentSenseHistory[0] + m_currentSenseHistory[10]) >> 1;
-    uint16_t threshold = lowLevel + ACKNOWLEDGE_PULSE_THRESHOLD;
-    if (
-    (m_currentSenseHistory[2] > threshold) &&
-    (m_currentSenseHistory[3] > threshold) &&
-    (m_currentSenseHistory[4] > threshold) &&
-    (m_currentSenseHistory[5] > threshold)
-    )
+    // Above threshold, the baseline is frozen while the pulse lasts
+    m_pulseWidth++;
+    if (data > m_pulsePeak)
     {
-      // Found one!
-      m_ackDetected = true;
-      // TODO: We could stop sending more messages right now and going straight to the end
+      m_pulsePeak = data;
     }
   }
+  else
+  {
+    if (m_pulseWidth > 0)
+    {
+      // Pulse ended, anything shorter than an ACK is noise. Longer ones were already dropped as a load change above.
+      if (m_pulseWidth >= m_ackConfig.minWidthMs)
+      {
+        m_lastPulse.widthMs = m_pulseWidth;
+        m_lastPulse.amplitude = m_pulsePeak - baseline;
+        m_hasLastPulse = true;
 
+        if ((m_state == SERVICE_MODE_STATE_DIRECT_PACKETS) || (m_state == SERVICE_MODE_STATE_RECOVERY_TIME))
+        {
+          // Found one!
+          m_ackDetected = true;
+          if (m_state == SERVICE_MODE_STATE_DIRECT_PACKETS)
+          {
+            // The decoder has answered, no need to send the remaining packets. Recovery starts after the packet in flight.
+            m_stateCounter = 0;
+          }
+        }
+      }
+      m_pulseWidth = 0;
+      m_pulsePeak = 0;
+    }
+
+    // Track the idle current
+    int16_t delta = (int16_t)((data << BASELINE_FRACTION_BITS) - m_baseline);
+    m_baseline += delta >> BASELINE_EMA_SHIFT;
+  }
 
   uint8_t bits = data >> 7;
   
@@ -142,17 +299,112 @@ static bool begin_direct_mode(uint16_t cvAddress, uint8_t firstByte, uint8_t dat
   m_directModeMessage[2] = data;
   // Fourth byte, error detection, XOR of all previous bytes
   m_directModeMessage[3] = m_directModeMessage[0] ^ m_directModeMessage[1] ^ m_directModeMessage[2];
+  m_messageLength = DIRECT_MODE_MESSAGE_LENGTH;
+  m_recoveryCount = RECOVERY_PACKET_COUNT;
+
+  return begin_sequence(callback, userData);
+}
+
+static bool begin_register_mode(uint8_t reg, bool write, uint8_t data, dcc_callback_t callback, void* userData)
+{
+  if (m_state != SERVICE_MODE_STATE_IDLE)
+  {
+    // Already busy
+    return false;
+  }
 
+  // 0111CRRR, C is set for a write. Register and paged mode use the same packets, paged mode sets up the page register first.
+  m_directModeMessage[0] = 0x70 | (write ? 0x08 : 0) | (reg & 0x07);
+  m_directModeMessage[1] = data;
+  m_directModeMessage[2] = m_directModeMessage[0] ^ m_directModeMessage[1];
+  m_messageLength = REGISTER_MODE_MESSAGE_LENGTH;
+  m_recoveryCount = write ? REGISTER_WRITE_RECOVERY_COUNT : RECOVERY_PACKET_COUNT;
+
+  return begin_sequence(callback, userData);
+}
+
+static bool begin_paged_mode(uint8_t page, uint8_t reg, bool write, uint8_t data, dcc_callback_t callback, void* userData)
+{
+  if (!begin_register_mode(PAGE_REGISTER, true, page, on_page_written, NULL))
+  {
+    return false;
+  }
+
+  m_pagedRegister = reg;
+  m_pagedData = data;
+  m_pagedWrite = write;
+  m_pagedUserData = userData;
+  m_pagedCallback = callback;
+  return true;
+}
+
+static bool begin_method(dcc_service_method_t method, bool write, uint16_t cvAddress, uint8_t data, dcc_callback_t callback, void* userData)
+{
+  if (!dcc_service_mode_method_supports_cv(method, cvAddress))
+  {
+    return false;
+  }
+
+  switch (method)
+  {
+    case DCC_SERVICE_METHOD_DIRECT:
+    {
+      return begin_direct_mode(cvAddress, write ? 0x7C : 0x74, data, callback, userData);
+    }
+    case DCC_SERVICE_METHOD_PAGED:
+    {
+      // Four CVs per page, pages are 1 based. Page 256 wraps to 0 in the 8 bit page register.
+      return begin_paged_mode((cvAddress >> 2) + 1, cvAddress & 0x03, write, data, callback, userData);
+    }
+    case DCC_SERVICE_METHOD_REGISTER:
+    case DCC_SERVICE_METHOD_ADDRESS_ONLY:
+    default:
+    {
+      // Both start with a page preset to page 1, so decoders that also know paged mode map registers 1 to 4 to CV 1 to 4
+      uint8_t reg = 0;
+      while (m_registerCvs[reg] != cvAddress)
+      {
+        reg++;
+      }
+      if ((method == DCC_SERVICE_METHOD_ADDRESS_ONLY) && (data > 0x7F))
+      {
+        // Only short addresses exist in address only mode, anything else would program some other address
+        return false;
+      }
+      return begin_paged_mode(1, reg, write, data, callback, userData);
+    }
+  }
+}
+
+static bool begin_sequence(dcc_callback_t callback, void* userData)
+{
   m_callbackUserData = userData;
   m_callback = callback;
 
-  // Kick off state machine
-  enter_state(SERVICE_MODE_STATE_INIT_SEQUENCE);
+  // Kick off state machine. An operation started right after another one can skip the reset packets,
+  // the decoder just received the recovery resets of the previous operation.
+  enter_state(m_chained ? SERVICE_MODE_STATE_DIRECT_PACKETS : SERVICE_MODE_STATE_INIT_SEQUENCE);
   evaluate_state();
 
   return true;
 }
 
+static void on_page_written(dcc_result_t result, void* userData)
+{
+  // Not every decoder acknowledges the page register, only a timeout stops the operation
+  if (result == DCC_RESULT_TIMEOUT)
+  {
+    m_pagedCallback(DCC_RESULT_TIMEOUT, m_pagedUserData);
+    return;
+  }
+
+  if (!begin_register_mode(m_pagedRegister, m_pagedWrite, m_pagedData, m_pagedCallback, m_pagedUserData))
+  {
+    // Not expected, the state machine is idle again at this point
+    m_pagedCallback(DCC_RESULT_TIMEOUT, m_pagedUserData);
+  }
+}
+
 static void enter_state(service_mode_state_t state)
 {
   switch (state)
@@ -167,21 +419,21 @@ static void enter_state(service_mode_state_t state)
     }
     case SERVICE_MODE_STATE_INIT_SEQUENCE:
     {
-      m_stateCounter = 3;
+      m_stateCounter = RESET_PACKET_COUNT;
       m_ackDetected = false;
       timer_start(m_timeoutTimer, TIMEOUT_DURATION_MS);
       break;
     }
     case SERVICE_MODE_STATE_DIRECT_PACKETS:
     {
-      m_stateCounter = 5;
+      m_stateCounter = OPERATION_PACKET_COUNT;
       m_ackDetected = false;
       timer_start(m_timeoutTimer, TIMEOUT_DURATION_MS);
       break;
     }
     case SERVICE_MODE_STATE_RECOVERY_TIME:
     {
-      m_stateCounter = 6;
+      m_stateCounter = m_recoveryCount;
       // Note that we do not clear the ACK detection here, it may have been set properly during the DIRECT_PACKETS state
       timer_start(m_timeoutTimer, TIMEOUT_DURATION_MS);
       break;
@@ -204,7 +456,7 @@ static void evaluate_state(void)
     {
       if (m_stateCounter > 0)
       {
-        dcc_queue_data_internal(&m_resetMessage[0], sizeof(m_resetMessage), &m_messageId);
+        dcc_queue_data_express(&m_resetMessage[0], sizeof(m_resetMessage), &m_messageId);
         m_stateCounter--;
       }
       else
@@ -220,7 +472,7 @@ static void evaluate_state(void)
     {
       if (m_stateCounter > 0)
       {
-        dcc_queue_data_internal(&m_directModeMessage[0], DIRECT_MODE_MESSAGE_LENGTH, &m_messageId);
+        dcc_queue_data_express(&m_directModeMessage[0], m_messageLength, &m_messageId);
         m_stateCounter--;
       }
       else
@@ -236,19 +488,13 @@ static void evaluate_state(void)
     {
       if (m_stateCounter > 0)
       {
-        dcc_queue_data_internal(&m_resetMessage[0], sizeof(m_resetMessage), &m_messageId);
+        dcc_queue_data_express(&m_resetMessage[0], sizeof(m_resetMessage), &m_messageId);
         m_stateCounter--;
       }
       else
       {
         // Finished
-        if (m_callback != NULL)
-        {
-          dcc_result_t result = m_ackDetected ? DCC_RESULT_ACK : DCC_RESULT_NACK;
-          m_callback(result, m_callbackUserData);
-        }
-        // Move to next state
-        enter_state(SERVICE_MODE_STATE_IDLE);
+        finish(m_ackDetected ? DCC_RESULT_ACK : DCC_RESULT_NACK);
       }
       break;
     }
@@ -263,10 +509,66 @@ static void on_timer(uint8_t id)
   }
 
   // Timeout, abort
-  if (m_callback != NULL)
+  finish(DCC_RESULT_TIMEOUT);
+}
+
+static void finish(dcc_result_t result)
+{
+  // Go idle before reporting, so the callback can start the next operation right away
+  dcc_callback_t callback = m_callback;
+  void* userData = m_callbackUserData;
+  enter_state(SERVICE_MODE_STATE_IDLE);
+
+  if (callback != NULL)
   {
-    m_callback(DCC_RESULT_TIMEOUT, m_callbackUserData);
+    // After a timeout the track may not have carried the recovery resets
+    m_chained = (result != DCC_RESULT_TIMEOUT);
+    callback(result, userData);
+    m_chained = false;
   }
+}
 
-  enter_state(SERVICE_MODE_STATE_IDLE);
+static void on_read_step(dcc_result_t result, void* userData)
+{
+  bool started;
+
+  if (result == DCC_RESULT_TIMEOUT)
+  {
+    m_readCallback(DCC_RESULT_TIMEOUT, m_readUserData);
+    return;
+  }
+
+  if (m_readBit < 8)
+  {
+    // Bit verify finished, an ACK means the bit is set
+    if (result == DCC_RESULT_ACK)
+    {
+      m_readValue |= (1 << m_readBit);
+    }
+
+    if (++m_readBit < 8)
+    {
+      started = dcc_service_mode_verify_cv_bit(m_readCvAddress, m_readBit, 1, on_read_step, NULL);
+    }
+    else
+    {
+      started = dcc_service_mode_verify_cv(m_readCvAddress, m_readValue, on_read_step, NULL);
+    }
+  }
+  else
+  {
+    // Byte verify finished, only an ACK confirms the value
+    if (result == DCC_RESULT_ACK)
+    {
+      *m_readResult = m_readValue;
+    }
+    m_readCallback(result, m_readUserData);
+    return;
+  }
+
+  if (!started)
+  {
+    // Not expected, the state machine is idle again and the first step already checked the address
+    m_readCallback(DCC_RESULT_TIMEOUT, m_readUserData);
+  }
 }
\ No newline at end of file
@@ -16,7 +16,9 @@ typedef enum
 {
   MESSAGE_ID_DCC_TX_STARTED,
   MESSAGE_ID_DCC_TX_COMPLETED,
+  MESSAGE_ID_DCC_EMERGENCY_STOP,
   MESSAGE_ID_ADC_SAMPLES,
+  MESSAGE_ID_OVERCURRENT,
 } message_id_t;
 
 typedef struct 
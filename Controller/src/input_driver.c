@@ -1,8 +1,9 @@
 #include "platform.h"
 #include "input_driver.h"
 #include "gpio.h"
+#include "adc.h"
+#include <stddef.h>
 #include <avr/io.h>
-#include <util/delay.h>
 
 // These pins are using the internal pullup and are active low
 const gpio_info_t PIN_FORWARDS = { .port = GPIO_PORT_C, .pin = GPIO_PIN_2 };
@@ -11,12 +12,17 @@ const gpio_info_t PIN_BACKWARDS = { .port = GPIO_PORT_C, .pin = GPIO_PIN_1 };
 // This pin is also the ADC0 input
 const gpio_info_t PIN_THROTTLE = { .port = GPIO_PORT_C, .pin = GPIO_PIN_0 };
 
+static uint8_t m_throttleHandle = ADC_HANDLE_INVALID;
+
 void input_driver_initialize(void)
 {
   gpio_set_pin(PIN_FORWARDS.port, PIN_FORWARDS.pin);
   gpio_configure_input(PIN_FORWARDS.port, PIN_FORWARDS.pin);
   gpio_set_pin(PIN_BACKWARDS.port, PIN_BACKWARDS.pin);
   gpio_configure_input(PIN_BACKWARDS.port, PIN_BACKWARDS.pin);
+
+  // The scheduler samples the throttle in the background, between current sense conversions when those are running
+  m_throttleHandle = adc_add_channel(ADC_CHANNEL_SINGLE_0, NULL);
 }
 
 input_direction_t input_driver_get_direction(void)
@@ -35,17 +41,6 @@ input_direction_t input_driver_get_direction(void)
 
 uint16_t input_driver_get_throttle(void)
 {
-  // Vcc as ref, ADC2 as input
-  ADMUX = BIT(REFS0) | ADC_CHANNEL_SINGLE_0;
-
-  // Enable ADC, start a conversion
-  ADCSRA = BIT(ADEN) | BIT(ADSC) | ADC_PRESCALER_16;
-
-  // Wait for ADC to finish converting
-  while ((ADCSRA & BIT(ADSC)) != 0) {
-    _delay_us(1);
-  }
-
-  // Read the result and return it
-  return ADCW;
-}
\ No newline at end of file
+  // Latest result, never waits for the converter
+  return adc_get_value(m_throttleHandle);
+}
@@ -1,5 +1,6 @@
 #include "locomotive_settings.h"
 #include "commands.h"
+#include "dcc/bdp_console.h"
 
 #include <stddef.h>
 #include <stdlib.h>
@@ -20,6 +21,9 @@ static uint8_t m_activeProfile = NO_PROFILE;
 static void set_profile_command(const char *arguments, uint8_t length, const command_functions_t *output);
 static void get_profile_command(const char *arguments, uint8_t length, const command_functions_t *output);
 static void apply_profile_command(const char *arguments, uint8_t length, const command_functions_t *output);
+static bdp_result_code_t get_profile_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+static bdp_result_code_t set_profile_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+static bdp_result_code_t apply_profile_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
 
 static const command_t m_commandSetProfile = {
   .prefix = "PR+SET",
@@ -39,6 +43,21 @@ static const command_t m_commandApplyProfile = {
   .handler = apply_profile_command,
 };
 
+static const bdp_opcode_t m_opcodeGetProfile = {
+  .opcode = BDP_OPCODE_PROFILE_GET,
+  .handler = get_profile_opcode,
+};
+
+static const bdp_opcode_t m_opcodeSetProfile = {
+  .opcode = BDP_OPCODE_PROFILE_SET,
+  .handler = set_profile_opcode,
+};
+
+static const bdp_opcode_t m_opcodeApplyProfile = {
+  .opcode = BDP_OPCODE_PROFILE_ACTIVE,
+  .handler = apply_profile_opcode,
+};
+
 static inline int16_t linear_iterp(int16_t from, int16_t to, int16_t fraction)
 {
   // from + (to - from) * (fraction / 255)
@@ -51,6 +70,9 @@ void locomotive_settings_initialize(void)
   commands_register(&m_commandGetProfile);
   commands_register(&m_commandSetProfile);
   commands_register(&m_commandApplyProfile);
+  bdp_console_register(&m_opcodeGetProfile);
+  bdp_console_register(&m_opcodeSetProfile);
+  bdp_console_register(&m_opcodeApplyProfile);
 
   // Kato ED75
   m_profiles[0].vMin = 68;
@@ -247,4 +269,50 @@ static void apply_profile_command(const char *arguments, uint8_t length, const c
   }
 
   output->writeln_format(OK_WITH_RESULT("active:%u"), m_activeProfile);
-}
\ No newline at end of file
+}
+
+static bdp_result_code_t get_profile_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  if ((length < 1) || (data[0] >= NR_OF_PROFILES))
+  {
+    return BDP_RESULT_INVALID_ARGUMENT;
+  }
+
+  const locomotive_profile_t *prof = &m_profiles[data[0]];
+  response[0] = prof->vMin;
+  response[1] = prof->vMid;
+  response[2] = prof->vMax;
+  response[3] = prof->acc;
+  response[4] = prof->dec;
+  response[5] = prof->boostPower;
+  *responseLength = 6;
+  return BDP_RESULT_OK;
+}
+
+static bdp_result_code_t set_profile_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  if ((length < 7) || (data[0] >= NR_OF_PROFILES))
+  {
+    return BDP_RESULT_INVALID_ARGUMENT;
+  }
+
+  locomotive_profile_t *prof = &m_profiles[data[0]];
+  prof->vMin = data[1];
+  prof->vMid = data[2];
+  prof->vMax = data[3];
+  prof->acc = data[4];
+  prof->dec = data[5];
+  prof->boostPower = data[6];
+  return BDP_RESULT_OK;
+}
+
+static bdp_result_code_t apply_profile_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  if (length > 0)
+  {
+    m_activeProfile = (data[0] < NR_OF_PROFILES) ? data[0] : NO_PROFILE;
+  }
+
+  response[(*responseLength)++] = m_activeProfile;
+  return BDP_RESULT_OK;
+}
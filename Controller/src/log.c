@@ -3,8 +3,15 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
 
-static char printBuffer[200];
+// Formatted output goes straight into the transmit buffer through this stream, a line that does not fit is dropped
+static int put_char(char chr, FILE *stream);
+static FILE m_stream = FDEV_SETUP_STREAM(put_char, NULL, _FDEV_SETUP_WRITE);
+static serial_tx_reservation_t m_reservation;
+static bool m_overflowed;
+
+static void write_format(const char* string, va_list args, bool newline);
 
 void log_initialize(void)
 {
@@ -24,23 +31,51 @@ void log_writeln_format(const char* string, ...)
 {
   va_list args;
   va_start(args, string);
-  vsnprintf(printBuffer, sizeof(printBuffer), string, args);
-  va_end(args); 
-
-  log_writeln(printBuffer);
+  write_format(string, args, true);
+  va_end(args);
 }
 
 void log_write_format(const char* string, ...)
 {
   va_list args;
   va_start(args, string);
-  vsnprintf(printBuffer, sizeof(printBuffer), string, args);
+  write_format(string, args, false);
   va_end(args);
-  uint8_t length = strnlen(printBuffer, UINT8_MAX);
-  serial_send((const uint8_t*)printBuffer, length);
 }
 
 void log_write_char(const char chr)
 {
   serial_send_byte((uint8_t) chr);
-}
\ No newline at end of file
+}
+
+static void write_format(const char* string, va_list args, bool newline)
+{
+  if (!serial_tx_reserve(&m_reservation, serial_get_tx_free()))
+  {
+    return;
+  }
+
+  m_overflowed = false;
+  vfprintf(&m_stream, string, args);
+  if (newline)
+  {
+    // CR LF
+    put_char(0x0D, &m_stream);
+    put_char(0x0A, &m_stream);
+  }
+
+  if (!m_overflowed)
+  {
+    serial_tx_commit(&m_reservation);
+  }
+}
+
+static int put_char(char chr, FILE *stream)
+{
+  if (!serial_tx_put(&m_reservation, (uint8_t)chr))
+  {
+    m_overflowed = true;
+    return 1;
+  }
+  return 0;
+}
@@ -8,12 +8,20 @@
 #include "commands.h"
 #include "serial_console.h"
 #include "input_driver.h"
+#include "adc.h"
 #include "pwm_driver.h"
 #include "led_driver.h"
 #include "locomotive_settings.h"
 #include "curves.h"
 #include "util/delay.h"
 #include "events.h"
+#include "config.h"
+#include "dcc/bdp_console.h"
+#if defined(CONFIG_DCC)
+#include "dcc/dcc.h"
+#include "dcc/dcc_commands.h"
+#include "dcc/dcc_service_mode.h"
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -46,6 +54,12 @@ static void reset_command(const char *arguments, uint8_t length, const command_f
 
 static void debug_command(const char *arguments, uint8_t length, const command_functions_t *output);
 
+static bdp_result_code_t pc_control_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+
+static bdp_result_code_t throttle_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+
+static bdp_result_code_t throttle_get_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength);
+
 static const command_t m_pcCommand = {
     .prefix = "PC",
     .summary = "Enables or disables PC control",
@@ -70,12 +84,29 @@ static const command_t m_debugCommand = {
     .handler = debug_command,
 };
 
+static const bdp_opcode_t m_pcControlOpcode = {
+    .opcode = BDP_OPCODE_PC_CONTROL,
+    .handler = pc_control_opcode,
+};
+
+static const bdp_opcode_t m_throttleOpcode = {
+    .opcode = BDP_OPCODE_THROTTLE,
+    .handler = throttle_opcode,
+};
+
+static const bdp_opcode_t m_throttleGetOpcode = {
+    .opcode = BDP_OPCODE_THROTTLE_GET,
+    .handler = throttle_get_opcode,
+};
+
 int main(void)
 {
   commands_initialize();
   log_initialize();
   timer_initialize();
   serial_console_initialize();
+  bdp_console_initialize();
+  adc_initialize();
 
   input_driver_initialize();
   pwm_driver_initialize();
@@ -83,6 +114,11 @@ int main(void)
 
   locomotive_settings_initialize();
 
+#if defined(CONFIG_DCC)
+  dcc_initialize();
+  dcc_commands_initialize();
+#endif
+
   // Set up timer 2 as a systick timer of 1 ms
   // No outputs, mode 2 (CTC) to clear on capture compare, we get an OC2A interrupt every time the counter gets to OCR2A
   TCCR2A = (1 << WGM21);
@@ -106,6 +142,10 @@ int main(void)
   commands_register(&m_debugCommand);
   commands_register(&m_resetCommand);
 
+  bdp_console_register(&m_pcControlOpcode);
+  bdp_console_register(&m_throttleOpcode);
+  bdp_console_register(&m_throttleGetOpcode);
+
   m_pcTimeoutTimer = timer_create(TIMER_MODE_SINGLE, pc_timer_callback);
 
   uint8_t controlTimer = timer_create(TIMER_MODE_REPEATING, control_task);
@@ -130,33 +170,58 @@ int main(void)
       sei();
       timer_tick(currentTicks - previousTicks);
       previousTicks = currentTicks;
+      adc_tick();
     }
 
+    // Drain all messages, the DCC interrupt posts two for every packet and the queue is small
     message_t message;
-    if (event_get_message(&message))
+    while (event_get_message(&message))
     {
       switch (message.id)
       {
+#if defined(CONFIG_DCC)
       case MESSAGE_ID_DCC_TX_STARTED:
       {
+        dcc_on_tx_started();
         break;
       }
       case MESSAGE_ID_DCC_TX_COMPLETED:
       {
+        const dcc_event_message_t *event = (const dcc_event_message_t *)&message.data[0];
+        dcc_on_tx_completed();
+        dcc_service_mode_tx_complete(event);
+        dcc_commands_on_tx_completed(event);
+        break;
+      }
+      case MESSAGE_ID_DCC_EMERGENCY_STOP:
+      {
+        const dcc_emergency_stop_message_t *stop = (const dcc_emergency_stop_message_t *)&message.data[0];
+        dcc_on_emergency_stop(stop);
+        dcc_commands_on_emergency_stop(stop);
+        break;
+      }
+      case MESSAGE_ID_OVERCURRENT:
+      {
+        const current_sense_trip_message_t *trip = (const current_sense_trip_message_t *)&message.data[0];
+        dcc_commands_on_overcurrent(trip);
         break;
       }
       case MESSAGE_ID_ADC_SAMPLES:
       {
         const uint16_t *adcData = (const uint16_t *)&message.data[0];
-        static uint8_t ctr = 0;
-        if (++ctr == 0)
-          log_writeln_format("%u", *adcData);
+        dcc_service_mode_on_current_sense_data(*adcData);
         break;
       }
+#endif
+      default:
+        break;
       }
     }
 
-    serial_console_poll();
+#if defined(CONFIG_DCC)
+    dcc_commands_poll();
+#endif
+    bdp_console_poll();
   }
 }
 
@@ -166,6 +231,12 @@ ISR(TIMER2_COMPA_vect)
   events_set_flags(EVENT_FLAG_TICK);
 }
 
+static void set_pc_control(bool enabled)
+{
+  m_pcControl = enabled;
+  led_driver_set(LED_PC_CONTROL, enabled ? LED_MODE_ON : LED_MODE_DISABLED);
+}
+
 static void pc_command(const char *arguments, uint8_t length, const command_functions_t *output)
 {
   const char *arg0 = NULL;
@@ -178,14 +249,12 @@ static void pc_command(const char *arguments, uint8_t length, const command_func
 
   if (commands_match(arg0, arg0Length, "ON"))
   {
-    m_pcControl = true;
-    led_driver_set(LED_PC_CONTROL, LED_MODE_ON);
+    set_pc_control(true);
     output->writeln(COM_OK);
   }
   else if (commands_match(arg0, arg0Length, "OFF"))
   {
-    m_pcControl = false;
-    led_driver_set(LED_PC_CONTROL, LED_MODE_DISABLED);
+    set_pc_control(false);
     output->writeln(COM_OK);
   }
   else
@@ -405,4 +474,58 @@ static void control_task(uint8_t timerHandle)
 
     led_driver_set(LED_PWM_ON, LED_MODE_BLINK);
   }
-}
\ No newline at end of file
+}
+
+static bdp_result_code_t pc_control_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  if (length > 0)
+  {
+    set_pc_control(data[0] != 0);
+  }
+
+  response[(*responseLength)++] = m_pcControl;
+  return BDP_RESULT_OK;
+}
+
+static bdp_result_code_t throttle_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  if (length < 1)
+  {
+    return BDP_RESULT_INVALID_ARGUMENT;
+  }
+
+  // Same as DC FWD, DC REV and DC STOP
+  if (data[0] == 0)
+  {
+    m_pcSpeed = 0;
+    timer_stop(m_pcTimeoutTimer);
+    return BDP_RESULT_OK;
+  }
+
+  if ((length < 2) || (data[0] > 2))
+  {
+    return BDP_RESULT_INVALID_ARGUMENT;
+  }
+
+  m_pcSpeed = data[1];
+  if (data[0] == 2)
+  {
+    m_pcSpeed = -m_pcSpeed;
+  }
+  timer_start(m_pcTimeoutTimer, PC_TIMEOUT_MS);
+  return BDP_RESULT_OK;
+}
+
+static bdp_result_code_t throttle_get_opcode(const uint8_t *data, uint8_t length, uint8_t *response, uint8_t *responseLength)
+{
+  uint16_t throttle = input_driver_get_throttle();
+
+  response[0] = m_pcControl;
+  response[1] = (uint16_t)m_pcSpeed >> 8;
+  response[2] = m_pcSpeed & 0xFF;
+  response[3] = throttle >> 8;
+  response[4] = throttle & 0xFF;
+  response[5] = input_driver_get_direction();
+  *responseLength = 6;
+  return BDP_RESULT_OK;
+}
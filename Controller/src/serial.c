@@ -93,6 +93,72 @@ bool serial_send(const uint8_t *data, uint8_t length)
   return allWritten;
 }
 
+uint16_t serial_get_tx_free(void)
+{
+  uint16_t count;
+
+  NO_IRQ_BLOCK(UCSR0B, UDRIE0)
+  {
+    count = txBuffer.count;
+  }
+
+  return txBuffer.size - count;
+}
+
+bool serial_tx_reserve(serial_tx_reservation_t *reservation, uint16_t capacity)
+{
+  uint16_t count;
+  uint16_t readIndex;
+
+  NO_IRQ_BLOCK(UCSR0B, UDRIE0)
+  {
+    count = txBuffer.count;
+    readIndex = txBuffer.readIndex;
+  }
+
+  if ((txBuffer.size - count) < capacity)
+  {
+    return false;
+  }
+
+  // The interrupt only moves the read side, the free space after the last byte stays ours
+  reservation->writeIndex = (readIndex + count) % TX_BUFFER_SIZE;
+  reservation->length = 0;
+  reservation->capacity = capacity;
+  return true;
+}
+
+bool serial_tx_put(serial_tx_reservation_t *reservation, uint8_t data)
+{
+  if (reservation->length == reservation->capacity)
+  {
+    return false;
+  }
+
+  txBufferStorage[reservation->writeIndex] = data;
+  if (++reservation->writeIndex == TX_BUFFER_SIZE)
+  {
+    reservation->writeIndex = 0;
+  }
+  reservation->length++;
+  return true;
+}
+
+void serial_tx_commit(const serial_tx_reservation_t *reservation)
+{
+  if (reservation->length == 0)
+  {
+    return;
+  }
+
+  NO_IRQ_BLOCK(UCSR0B, UDRIE0)
+  {
+    txBuffer.count += reservation->length;
+    // Make sure the interrupt is enabled when the block exits, it starts the transmission if none is active
+    __NO_IRQ_BLOCK_RESTORE_MASK = (1 << UDRIE0);
+  }
+}
+
 uint8_t serial_read(uint8_t *data, uint8_t maxLength)
 {
   uint8_t numReadBytes = maxLength;
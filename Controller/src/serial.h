@@ -14,4 +14,26 @@ uint8_t serial_read(uint8_t *data, uint8_t maxLength);
 
 bool serial_read_has_overflowed(void);
 
+// Gets the amount of bytes that fit in the transmit buffer right now
+uint16_t serial_get_tx_free(void);
+
+// Room in the transmit buffer that is written in place
+typedef struct
+{
+  uint16_t writeIndex;      // Where the next byte goes
+  uint16_t length;          // Bytes put so far
+  uint16_t capacity;
+} serial_tx_reservation_t;
+
+// Reserves room for up to capacity bytes in the transmit buffer, so they can be written without an intermediate buffer.
+// Nothing is sent until the reservation is committed, dropping it is enough to cancel. Only one reservation can be open
+// and nothing else may be sent while it is.
+bool serial_tx_reserve(serial_tx_reservation_t *reservation, uint16_t capacity);
+
+// Puts a byte in the reservation, false when it is full
+bool serial_tx_put(serial_tx_reservation_t *reservation, uint8_t data);
+
+// Hands the bytes that were put to the transmitter
+void serial_tx_commit(const serial_tx_reservation_t *reservation);
+
 #endif /* SERIAL_H_ */
\ No newline at end of file
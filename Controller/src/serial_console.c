@@ -43,60 +43,65 @@ void serial_console_poll(void)
   uint8_t data;
   if (serial_read_byte(&data))
   {
-    if (false == is_allowed_command_char(data))
-    {
-      return;
-    }
+    serial_console_handle_byte(data);
+  }
+}
 
-    bool output = true;
-    bool handleCommand = false;
+void serial_console_handle_byte(uint8_t data)
+{
+  if (false == is_allowed_command_char(data))
+  {
+    return;
+  }
+
+  bool output = true;
+  bool handleCommand = false;
 
-    if (data == 0x0D)
+  if (data == 0x0D)
+  {
+    // Enter
+    handleCommand = true;
+    output = false;
+    if (m_echo)
     {
-      // Enter
-      handleCommand = true;
-      output = false;
-      if (m_echo)
-      {
-        log_writeln("");
-      }
+      log_writeln("");
     }
-    else if (data == 0x7F)
+  }
+  else if (data == 0x7F)
+  {
+    // Backspace
+    if (m_commandBuffer.count > 0)
     {
-      // Backspace
-      if (m_commandBuffer.count > 0)
-      {
-        m_commandBuffer.count--;
-      }
-      else
-      {
-        output = false;
-      }
+      m_commandBuffer.count--;
     }
     else
     {
-      output = circular_buffer_write(&m_commandBuffer, &data, 1);
-    }
-
-    if (output && m_echo)
-    {
-      log_write_char(data);
+      output = false;
     }
+  }
+  else
+  {
+    output = circular_buffer_write(&m_commandBuffer, &data, 1);
+  }
 
-    if (handleCommand)
-    {
-      uint8_t length = m_commandBuffer.count;
-      char data[sizeof(m_commandBufferData) + 1];
-      memset(&data[0], 0, sizeof(data));
+  if (output && m_echo)
+  {
+    log_write_char(data);
+  }
 
-      if (false == circular_buffer_read(&m_commandBuffer, (uint8_t*)&data[0], length))
-      {
-        log_writeln(ERR_WITH_REASON(COM_ERR_UNKNOWN));
-        return;
-      }
+  if (handleCommand)
+  {
+    uint8_t length = m_commandBuffer.count;
+    char command[sizeof(m_commandBufferData) + 1];
+    memset(&command[0], 0, sizeof(command));
 
-      commands_handle(&data[0], length, &m_output);
+    if (false == circular_buffer_read(&m_commandBuffer, (uint8_t*)&command[0], length))
+    {
+      log_writeln(ERR_WITH_REASON(COM_ERR_UNKNOWN));
+      return;
     }
+
+    commands_handle(&command[0], length, &m_output);
   }
 }
 
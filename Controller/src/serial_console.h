@@ -1,8 +1,13 @@
 #ifndef SERIAL_CONSOLE_H_
 #define SERIAL_CONSOLE_H_
 
+#include <stdint.h>
+
 void serial_console_initialize(void);
 
 void serial_console_poll(void);
 
+// Feeds one received byte to the console, for when another module owns the serial port
+void serial_console_handle_byte(uint8_t data);
+
 #endif /* SERIAL_CONSOLE_H_ */
\ No newline at end of file
@@ -0,0 +1,499 @@
+// Host build of the BDP port and the serial transmit path under it. bdp.c is compiled unchanged, the harness
+// is both the host that sends the commands and the handler that runs them. It checks which commands reach the
+// handler and which are answered from the window, for stop and wait hosts, pipelined hosts that lose a response,
+// duplicates of a command that has not been answered yet and the sequence number wrapping from 255 to 0.
+//
+// serial.c, log.c and bdp_console.c run against mocked USART registers, the harness calls the interrupts.
+// It checks that transmit reservations wrap at the end of the ring and can be dropped, that a formatted line
+// that does not fit is dropped as a whole and that responses are SLIP escaped straight into the ring.
+//
+// Exits with 1 when a check fails.
+
+#include "dcc/bdp.h"
+#include "dcc/bdp_console.h"
+#include "serial.h"
+#include "log.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_FRAMES      (64)
+#define TX_RING_SIZE    (256)       // TX_BUFFER_SIZE in serial.c
+
+// A transmitted response
+typedef struct
+{
+  uint8_t size;
+  uint8_t data[BDP_LAST_RESPONSE_SIZE];
+} frame_t;
+
+static bdp_port_t m_port;
+static frame_t m_frames[MAX_FRAMES];
+static uint32_t m_frameCount;
+static uint32_t m_handled[256];             // Handler calls per sequence number
+static bool m_deferResponse;                // The handler answers later through bdp_port_transmit_response
+static bool m_repeatFromHandler;            // The handler receives a copy of its own command before it returns
+
+static uint32_t m_failures;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("  FAIL: %s\n", what);
+    m_failures++;
+  }
+}
+
+static bool send_command(uint8_t seqNumber, uint8_t flags);
+
+static bool transmit(const uint8_t *data, uint16_t size)
+{
+  if ((m_frameCount < MAX_FRAMES) && (size <= BDP_LAST_RESPONSE_SIZE))
+  {
+    m_frames[m_frameCount].size = size;
+    memcpy(&m_frames[m_frameCount].data[0], data, size);
+    m_frameCount++;
+  }
+  return true;
+}
+
+static bool handle_command(const bdp_header_t *header)
+{
+  uint8_t seqNumber = header->seqNumber;
+  m_handled[seqNumber]++;
+
+  if (m_repeatFromHandler)
+  {
+    // Like a console that is polled while a slow command runs
+    m_repeatFromHandler = false;
+    (void)send_command(seqNumber, BDP_FLAG_NONE);
+  }
+
+  if (m_deferResponse)
+  {
+    return true;
+  }
+
+  // Result code and the sequence number, so every response can be traced back to its command
+  uint8_t *response = bdp_port_begin_response(&m_port, seqNumber);
+  if (response != NULL)
+  {
+    response[0] = BDP_RESULT_OK;
+    response[1] = seqNumber;
+    (void)bdp_port_transmit_response(&m_port, seqNumber, response, 2);
+  }
+  return true;
+}
+
+// Builds a ping with the CRC a host would add
+static uint8_t build_command(uint8_t *frame, uint8_t seqNumber, uint8_t flags)
+{
+  bdp_header_t *header = (bdp_header_t*)&frame[0];
+  header->flags = BDP_FLAG_COMMAND | flags;
+  header->seqNumber = seqNumber;
+  header->dataLength = 1;
+  frame[sizeof(bdp_header_t)] = BDP_OPCODE_PING;
+
+  uint8_t size = sizeof(bdp_header_t) + 1;
+  uint16_t crc = BDP_CRC_INIT;
+  for (uint8_t i = 0; i < size; i++)
+  {
+    crc = bdp_crc_update(crc, frame[i]);
+  }
+  frame[size++] = crc >> 8;
+  frame[size++] = crc & 0xFF;
+  return size;
+}
+
+static bool send_command(uint8_t seqNumber, uint8_t flags)
+{
+  uint8_t frame[sizeof(bdp_header_t) + 1 + BDP_CRC_LENGTH];
+  uint8_t size = build_command(&frame[0], seqNumber, flags);
+  return bdp_port_received_command(&m_port, &frame[0], size);
+}
+
+// Checks the last transmitted frame is a valid response to seqNumber
+static bool is_response(uint32_t frameIndex, uint8_t seqNumber)
+{
+  if (frameIndex >= m_frameCount)
+  {
+    return false;
+  }
+
+  const frame_t *frame = &m_frames[frameIndex];
+  uint16_t crc = BDP_CRC_INIT;
+  for (uint8_t i = 0; i < frame->size; i++)
+  {
+    crc = bdp_crc_update(crc, frame->data[i]);
+  }
+
+  const bdp_header_t *header = (const bdp_header_t*)&frame->data[0];
+  return (crc == BDP_CRC_CHECK) && (header->seqNumber == seqNumber) && (header->dataLength == 2) &&
+         (frame->data[sizeof(bdp_header_t)] == BDP_RESULT_OK) && (frame->data[sizeof(bdp_header_t) + 1] == seqNumber);
+}
+
+static void start(uint8_t windowSize)
+{
+  bdp_port_initialize(&m_port, transmit, handle_command);
+  (void)bdp_port_set_window_size(&m_port, windowSize);
+  m_frameCount = 0;
+  memset(&m_handled[0], 0, sizeof(m_handled));
+  m_deferResponse = false;
+  m_repeatFromHandler = false;
+}
+
+// A host that waits for every response and flips between two sequence numbers
+static void test_stop_and_wait(void)
+{
+  printf("Window 1, alternating sequence numbers\n");
+  start(1);
+  check(bdp_port_get_window_size(&m_port) == 1, "the window can be set to 1");
+
+  bool allHandled = true;
+  for (uint8_t i = 0; i < 8; i++)
+  {
+    uint8_t seqNumber = i & 1;
+    uint32_t handled = m_handled[seqNumber];
+    allHandled = allHandled && send_command(seqNumber, BDP_FLAG_NONE) && (m_handled[seqNumber] == handled + 1) && is_response(m_frameCount - 1, seqNumber);
+  }
+  check(allHandled, "every new command runs and is answered");
+
+  // The response to the last one got lost, the host sends it again
+  check(send_command(1, BDP_FLAG_NONE) && (m_handled[1] == 4), "a repeat does not run the command again");
+  check((m_frameCount == 9) && is_response(8, 1), "a repeat is answered from the window");
+}
+
+// A host with four commands in flight that loses one response
+static void test_lost_response(void)
+{
+  printf("Window 4, lost response\n");
+  start(4);
+  check(bdp_port_get_window_size(&m_port) == 4, "the window can be set to 4");
+
+  for (uint8_t seqNumber = 10; seqNumber < 14; seqNumber++)
+  {
+    (void)send_command(seqNumber, BDP_FLAG_NONE);
+  }
+  check((m_frameCount == 4) && is_response(1, 11), "pipelined commands are answered in order");
+
+  // The response to 11 got lost, the retry is inside the window
+  check(send_command(11, BDP_FLAG_NONE) && (m_handled[11] == 1), "a retry inside the window does not run the command again");
+  check((m_frameCount == 5) && is_response(4, 11), "a retry inside the window is answered from the cache");
+
+  // Two more commands push 11 out of the window, 12 is still in it
+  (void)send_command(14, BDP_FLAG_NONE);
+  (void)send_command(15, BDP_FLAG_NONE);
+  uint32_t frameCount = m_frameCount;
+  check(!send_command(11, BDP_FLAG_NONE) && (m_handled[11] == 1) && (m_frameCount == frameCount), "a retry outside the window is dropped");
+  check(send_command(12, BDP_FLAG_NONE) && (m_handled[12] == 1) && is_response(m_frameCount - 1, 12), "the oldest command in the window is still answered");
+}
+
+// Repeats of a command that has no response yet are neither answered nor run again
+static void test_pending_duplicates(void)
+{
+  printf("Duplicates of a pending command\n");
+  start(4);
+
+  m_repeatFromHandler = true;
+  (void)send_command(20, BDP_FLAG_NONE);
+  check((m_handled[20] == 1) && (m_frameCount == 1) && is_response(0, 20), "a repeat while the command runs is ignored");
+
+  m_deferResponse = true;
+  (void)send_command(21, BDP_FLAG_NONE);
+  check(send_command(21, BDP_FLAG_NONE) && (m_handled[21] == 1) && (m_frameCount == 1), "a repeat before the late response is ignored");
+
+  uint8_t data[] = { BDP_RESULT_OK, 21 };
+  check(bdp_port_transmit_response(&m_port, 21, &data[0], sizeof(data)) && is_response(1, 21), "the late response goes out");
+  check(send_command(21, BDP_FLAG_NONE) && (m_handled[21] == 1) && (m_frameCount == 3) && is_response(2, 21), "a repeat after the late response is answered from the cache");
+}
+
+// Slots stay put and ages stay right when the sequence number wraps
+static void test_wrap(void)
+{
+  printf("Sequence number wrap\n");
+  start(4);
+
+  static const uint8_t sequence[] = { 253, 254, 255, 0, 1 };
+  bool allHandled = true;
+  for (uint8_t i = 0; i < sizeof(sequence); i++)
+  {
+    allHandled = allHandled && send_command(sequence[i], BDP_FLAG_NONE) && (m_handled[sequence[i]] == 1) && is_response(m_frameCount - 1, sequence[i]);
+  }
+  check(allHandled, "commands across the wrap all run");
+
+  check(send_command(255, BDP_FLAG_NONE) && (m_handled[255] == 1) && is_response(m_frameCount - 1, 255), "a retry from before the wrap is answered from the cache");
+  uint32_t frameCount = m_frameCount;
+  check(!send_command(253, BDP_FLAG_NONE) && (m_handled[253] == 1) && (m_frameCount == frameCount), "a retry from before the wrap outside the window is dropped");
+
+  // A full lap later the same sequence numbers are new commands again
+  for (uint16_t i = 2; i < 256 + 2; i++)
+  {
+    (void)send_command(i & 0xFF, BDP_FLAG_NONE);
+  }
+  check((m_handled[0] == 2) && (m_handled[1] == 2) && (m_handled[255] == 2), "the sequence numbers are reused after a full lap");
+}
+
+// The serial console gets everything outside the frames, nothing in these tests
+void serial_console_handle_byte(uint8_t data)
+{
+}
+
+static void receive(const uint8_t *data, uint16_t length)
+{
+  for (uint16_t i = 0; i < length; i++)
+  {
+    UDR0 = data[i];
+    USART_RX_vect();
+  }
+}
+
+// The USART keeps the interrupt busy until the ring is empty, returns what it sent
+static uint16_t drain(uint8_t *data, uint16_t maxLength)
+{
+  uint16_t length = 0;
+  UCSR0B |= (1 << UDRIE0);
+  while (UCSR0B & (1 << UDRIE0))
+  {
+    USART_UDRE_vect();
+    if ((UCSR0B & (1 << UDRIE0)) && (length < maxLength))
+    {
+      data[length++] = UDR0;
+    }
+  }
+  return length;
+}
+
+static void start_serial(uint16_t ringPosition)
+{
+  serial_initialize();
+  // Never ready for a byte, so nothing goes around the ring
+  UCSR0A = 0;
+
+  // Sends and drains filler until the ring starts at ringPosition
+  uint8_t filler[128];
+  uint8_t drained[128];
+  memset(&filler[0], 'x', sizeof(filler));
+  while (ringPosition > 0)
+  {
+    uint8_t length = (ringPosition < sizeof(filler)) ? ringPosition : sizeof(filler);
+    (void)serial_send(&filler[0], length);
+    (void)drain(&drained[0], sizeof(drained));
+    ringPosition -= length;
+  }
+}
+
+static void test_reservations(void)
+{
+  printf("Transmit reservations\n");
+  start_serial(TX_RING_SIZE - 8);
+
+  // 20 bytes from 8 before the end of the ring
+  serial_tx_reservation_t reservation;
+  bool reserved = serial_tx_reserve(&reservation, 20);
+  bool allPut = true;
+  for (uint8_t i = 0; i < 20; i++)
+  {
+    allPut = allPut && serial_tx_put(&reservation, i + 1);
+  }
+  check(reserved && allPut && !serial_tx_put(&reservation, 0), "a reservation takes bytes up to its capacity");
+  check(serial_get_tx_free() == TX_RING_SIZE, "nothing is sent before the commit");
+
+  serial_tx_commit(&reservation);
+  uint8_t sent[TX_RING_SIZE];
+  uint16_t length = drain(&sent[0], sizeof(sent));
+  bool inOrder = (length == 20);
+  for (uint8_t i = 0; inOrder && (i < 20); i++)
+  {
+    inOrder = (sent[i] == i + 1);
+  }
+  check(inOrder, "a reservation that wraps at the end of the ring comes out in order");
+
+  // Dropping a reservation is the cancel
+  reserved = serial_tx_reserve(&reservation, 10);
+  for (uint8_t i = 0; i < 5; i++)
+  {
+    (void)serial_tx_put(&reservation, 0xEE);
+  }
+  (void)serial_send((const uint8_t*)"abc", 3);
+  length = drain(&sent[0], sizeof(sent));
+  check(reserved && (length == 3) && (memcmp(&sent[0], "abc", 3) == 0), "a dropped reservation sends nothing");
+
+  check(!serial_tx_reserve(&reservation, TX_RING_SIZE + 1), "a reservation bigger than the ring fails");
+}
+
+static void test_formatted_lines(void)
+{
+  printf("Formatted lines\n");
+  start_serial(100);
+
+  // Leave room for 10 bytes
+  uint8_t filler[TX_RING_SIZE - 10];
+  memset(&filler[0], 'x', sizeof(filler));
+  (void)serial_send(&filler[0], sizeof(filler));
+
+  log_writeln_format("%s %u", "TOO LONG", 12345);
+  check(serial_get_tx_free() == 10, "a line that does not fit is dropped as a whole");
+
+  log_writeln_format("OK %u", 7);
+  check(serial_get_tx_free() == 4, "a line that fits is sent");
+
+  uint8_t sent[TX_RING_SIZE];
+  uint16_t length = drain(&sent[0], sizeof(sent));
+  check((length == sizeof(filler) + 6) && (memcmp(&sent[sizeof(filler)], "OK 7\r\n", 6) == 0), "only the line that fits comes out after the filler");
+}
+
+// Undoes the SLIP framing of one frame, false when the bytes are not exactly one frame
+static bool slip_decode(const uint8_t *data, uint16_t length, uint8_t *frame, uint8_t *frameLength)
+{
+  if ((length < 2) || (data[0] != BDP_CONSOLE_END) || (data[length - 1] != BDP_CONSOLE_END))
+  {
+    return false;
+  }
+
+  *frameLength = 0;
+  for (uint16_t i = 1; i < length - 1; i++)
+  {
+    uint8_t value = data[i];
+    if (value == BDP_CONSOLE_END)
+    {
+      return false;
+    }
+    if (value == BDP_CONSOLE_ESC)
+    {
+      value = data[++i];
+      if (value == BDP_CONSOLE_ESC_END)
+      {
+        value = BDP_CONSOLE_END;
+      }
+      else if (value == BDP_CONSOLE_ESC_ESC)
+      {
+        value = BDP_CONSOLE_ESC;
+      }
+      else
+      {
+        return false;
+      }
+    }
+    frame[(*frameLength)++] = value;
+  }
+  return true;
+}
+
+static void test_slip(void)
+{
+  printf("SLIP framing\n");
+  // The responses wrap at the end of the ring
+  start_serial(TX_RING_SIZE - 5);
+  bdp_console_initialize();
+
+  // Sequence numbers that are the SLIP special bytes, so the header needs escaping
+  static const uint8_t sequence[] = { BDP_CONSOLE_END, BDP_CONSOLE_ESC };
+  for (uint8_t i = 0; i < sizeof(sequence); i++)
+  {
+    uint8_t command[sizeof(bdp_header_t) + 1 + BDP_CRC_LENGTH];
+    uint8_t size = build_command(&command[0], sequence[i], BDP_FLAG_NONE);
+
+    uint8_t encoded[2 * sizeof(command) + 2];
+    uint8_t encodedLength = 0;
+    encoded[encodedLength++] = BDP_CONSOLE_END;
+    for (uint8_t j = 0; j < size; j++)
+    {
+      if ((command[j] == BDP_CONSOLE_END) || (command[j] == BDP_CONSOLE_ESC))
+      {
+        encoded[encodedLength++] = BDP_CONSOLE_ESC;
+        encoded[encodedLength++] = (command[j] == BDP_CONSOLE_END) ? BDP_CONSOLE_ESC_END : BDP_CONSOLE_ESC_ESC;
+      }
+      else
+      {
+        encoded[encodedLength++] = command[j];
+      }
+    }
+    encoded[encodedLength++] = BDP_CONSOLE_END;
+
+    receive(&encoded[0], encodedLength);
+    bdp_console_poll();
+
+    uint8_t sent[TX_RING_SIZE];
+    uint16_t length = drain(&sent[0], sizeof(sent));
+    uint8_t frame[BDP_LAST_RESPONSE_SIZE];
+    uint8_t frameLength;
+    bool decoded = slip_decode(&sent[0], length, &frame[0], &frameLength);
+
+    uint16_t crc = BDP_CRC_INIT;
+    for (uint8_t j = 0; decoded && (j < frameLength); j++)
+    {
+      crc = bdp_crc_update(crc, frame[j]);
+    }
+    const bdp_header_t *header = (const bdp_header_t*)&frame[0];
+    check(decoded && (length == frameLength + 2 + 1), "the response is one frame with its special byte escaped");
+    check(decoded && (crc == BDP_CRC_CHECK) && (header->seqNumber == sequence[i]) && (header->dataLength == 1) && (frame[sizeof(bdp_header_t)] == BDP_RESULT_OK),
+          "the escaped response is the answer to the ping");
+  }
+}
+
+static void test_event(void)
+{
+  printf("Events\n");
+  start_serial(TX_RING_SIZE - 5);
+  bdp_console_initialize();
+
+  // Data with both special bytes, and more than one event so the sequence number moves
+  static const uint8_t data[] = { 0x01, BDP_CONSOLE_END, 0x02, BDP_CONSOLE_ESC, BDP_CONSOLE_ESC_END };
+  for (uint8_t i = 0; i < 2; i++)
+  {
+    check(bdp_console_send_event(BDP_OPCODE_DCC_CURRENT, &data[0], sizeof(data)), "the event fits in the transmit buffer");
+
+    uint8_t sent[TX_RING_SIZE];
+    uint16_t length = drain(&sent[0], sizeof(sent));
+    uint8_t frame[BDP_LAST_RESPONSE_SIZE];
+    uint8_t frameLength;
+    bool decoded = slip_decode(&sent[0], length, &frame[0], &frameLength);
+
+    uint16_t crc = BDP_CRC_INIT;
+    for (uint8_t j = 0; decoded && (j < frameLength); j++)
+    {
+      crc = bdp_crc_update(crc, frame[j]);
+    }
+    const bdp_header_t *header = (const bdp_header_t*)&frame[0];
+    const uint8_t *payload = &frame[sizeof(bdp_header_t)];
+    check(decoded && (length == frameLength + 2 + 2), "the event is one frame with its special bytes escaped");
+    check(decoded && (crc == BDP_CRC_CHECK) && (header->flags == BDP_FLAG_EVENT) && (header->seqNumber == i),
+          "the event has a valid CRC, the event flag and the next event number");
+    check(decoded && (header->dataLength == 1 + sizeof(data)) && (payload[0] == BDP_OPCODE_DCC_CURRENT) &&
+          (memcmp(&payload[1], &data[0], sizeof(data)) == 0), "the event carries the opcode and the data");
+  }
+
+  // Nothing is sent when it does not fit
+  serial_tx_reservation_t reservation;
+  uint16_t filler = TX_RING_SIZE - BDP_CONSOLE_EVENT_SIZE(sizeof(data)) + 1;
+  check(serial_tx_reserve(&reservation, filler), "the filler fits");
+  for (uint16_t i = 0; i < filler; i++)
+  {
+    serial_tx_put(&reservation, 'x');
+  }
+  serial_tx_commit(&reservation);
+  check(!bdp_console_send_event(BDP_OPCODE_DCC_CURRENT, &data[0], sizeof(data)), "an event that may not fit is refused");
+}
+
+int main(void)
+{
+  test_stop_and_wait();
+  test_lost_response();
+  test_pending_duplicates();
+  test_wrap();
+  test_reservations();
+  test_formatted_lines();
+  test_slip();
+  test_event();
+
+  if (m_failures != 0)
+  {
+    printf("%u checks failed\n", m_failures);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Builds the BDP port and the serial transmit path for the host and runs their checks, then builds the CRC benchmark once for
+# every BDP_CRC_METHOD and runs them over the same data.
+# Exits with the result of the checks.
+CC="gcc"
+SRC="bdp_host.c"
+SRC+=" mock/mock_avr.c"
+SRC+=" ../../src/dcc/bdp.c"
+SRC+=" ../../src/dcc/bdp_console.c"
+SRC+=" ../../src/serial.c"
+SRC+=" ../../src/buffers.c"
+SRC+=" ../../src/log.c"
+INC="-Imock -I../../src -I../../include"
+OPTS="-std=gnu99 -O2 -Wall"
+OUT="bdp_host"
+
+cd "$(dirname "$0")"
+mkdir -p ../../build
+${CC} ${OPTS} ${INC} -o ../../build/${OUT} ${SRC} || exit 1
+../../build/${OUT} || exit 1
+
+echo "CRC per byte:"
+for METHOD in 0 1 2; do
+  ${CC} ${OPTS} ${INC} -DBDP_CRC_METHOD=${METHOD} -o ../../build/crc_bench_${METHOD} crc_bench.c ../../src/dcc/bdp.c || exit 1
+  ../../build/crc_bench_${METHOD} || exit 1
+done
@@ -0,0 +1,69 @@
+// Times bdp_crc_update for the BDP_CRC_METHOD it is built with. build.sh builds it once per method and they
+// all run over the same data, so the numbers line up. The cycles are host TSC cycles: they rank the methods,
+// the AVR spends more per byte. Every method is also checked against the avr-libc reference routine.
+//
+// Exits with 1 when the CRC is wrong.
+
+#include "dcc/bdp.h"
+#include <stdio.h>
+#include <x86intrin.h>
+
+#define DATA_SIZE       (4096)
+#define PASSES          (200)
+
+#if BDP_CRC_METHOD == BDP_CRC_BYTE_TABLE
+#define METHOD_NAME     "Byte table"
+#elif BDP_CRC_METHOD == BDP_CRC_NIBBLE_TABLE
+#define METHOD_NAME     "Nibble table"
+#else
+#define METHOD_NAME     "Bitwise"
+#endif
+
+static uint8_t m_data[DATA_SIZE];
+
+static uint16_t crc_of(const uint8_t *data, uint16_t size)
+{
+  uint16_t crc = BDP_CRC_INIT;
+  for (uint16_t i = 0; i < size; i++)
+  {
+    crc = bdp_crc_update(crc, data[i]);
+  }
+  return crc;
+}
+
+int main(void)
+{
+  // The same pseudo random bytes for every method
+  uint32_t seed = 1;
+  for (uint16_t i = 0; i < DATA_SIZE; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    m_data[i] = seed >> 16;
+  }
+
+  uint16_t expected = BDP_CRC_INIT;
+  for (uint16_t i = 0; i < DATA_SIZE; i++)
+  {
+    expected = _crc_xmodem_update(expected, m_data[i]);
+  }
+
+  // The slowest passes are the ones an interrupt or a migration landed in, keep the fastest
+  uint64_t best = UINT64_MAX;
+  uint16_t crc = 0;
+  for (uint16_t pass = 0; pass < PASSES; pass++)
+  {
+    uint64_t start = __rdtsc();
+    crc = crc_of(&m_data[0], DATA_SIZE);
+    uint64_t cycles = __rdtsc() - start;
+    if (cycles < best)
+    {
+      best = cycles;
+    }
+  }
+
+  static const uint8_t checkString[] = "123456789";
+  bool correct = (crc == expected) && (crc_of(&checkString[0], sizeof(checkString) - 1) == 0x31C3);
+
+  printf("  %-14s %6.2f cycles per byte, CRC %04X%s\n", METHOD_NAME, (double)best / DATA_SIZE, crc, correct ? "" : " WRONG");
+  return correct ? 0 : 1;
+}
@@ -0,0 +1,12 @@
+#ifndef MOCK_AVR_INTERRUPT_H_
+#define MOCK_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+// Interrupt handlers become plain functions that the harness calls
+#define ISR(vector)   void vector(void)
+
+void USART_UDRE_vect(void);
+void USART_RX_vect(void);
+
+#endif /* MOCK_AVR_INTERRUPT_H_ */
@@ -0,0 +1,23 @@
+#ifndef MOCK_AVR_IO_H_
+#define MOCK_AVR_IO_H_
+
+// Host stand-in for the USART 0 registers serial.c touches. They are plain variables, the harness plays
+// the part of the USART by calling the interrupts.
+#include <stdint.h>
+
+extern volatile uint8_t UCSR0A;
+extern volatile uint8_t UCSR0B;
+extern volatile uint8_t UCSR0C;
+extern volatile uint16_t UBRR0;
+extern volatile uint8_t UDR0;
+
+#define U2X0      (1)
+#define UDRE0     (5)
+#define UCSZ00    (1)
+#define UCSZ01    (2)
+#define TXEN0     (3)
+#define RXEN0     (4)
+#define UDRIE0    (5)
+#define RXCIE0    (7)
+
+#endif /* MOCK_AVR_IO_H_ */
@@ -0,0 +1,10 @@
+#ifndef MOCK_AVR_PGMSPACE_H_
+#define MOCK_AVR_PGMSPACE_H_
+
+// The host has one address space, flash tables are plain constants
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_word(address)    (*(const uint16_t*)(address))
+
+#endif /* MOCK_AVR_PGMSPACE_H_ */
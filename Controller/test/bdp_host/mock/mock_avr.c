@@ -0,0 +1,7 @@
+#include <avr/io.h>
+
+volatile uint8_t UCSR0A;
+volatile uint8_t UCSR0B;
+volatile uint8_t UCSR0C;
+volatile uint16_t UBRR0;
+volatile uint8_t UDR0;
@@ -0,0 +1,35 @@
+#ifndef MOCK_STDIO_H_
+#define MOCK_STDIO_H_
+
+// The avr-libc streams log.c writes through: a FILE is a put function that takes one character at a time.
+// Included after the host stdio.h, so everything else in it keeps working.
+#include_next <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+
+typedef struct mock_file mock_file_t;
+
+struct mock_file
+{
+  int (*put)(char chr, mock_file_t *stream);
+};
+
+#define FILE                          mock_file_t
+#define _FDEV_SETUP_WRITE             (2)
+#define FDEV_SETUP_STREAM(p, g, f)    { .put = (p) }
+#define vfprintf                      mock_vfprintf
+
+// Like avr-libc every character goes to put, also after it has failed
+static inline int mock_vfprintf(mock_file_t *stream, const char *format, va_list args)
+{
+  char text[512];
+  int length = vsnprintf(&text[0], sizeof(text), format, args);
+  bool failed = false;
+  for (int i = 0; (i < length) && (i < (int)sizeof(text) - 1); i++)
+  {
+    failed |= (stream->put(text[i], stream) != 0);
+  }
+  return failed ? EOF : length;
+}
+
+#endif /* MOCK_STDIO_H_ */
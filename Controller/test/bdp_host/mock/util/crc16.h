@@ -0,0 +1,24 @@
+#ifndef MOCK_UTIL_CRC16_H_
+#define MOCK_UTIL_CRC16_H_
+
+#include <stdint.h>
+
+// The C equivalent avr-libc documents for its assembler routine
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+  crc = crc ^ ((uint16_t)data << 8);
+  for (uint8_t i = 0; i < 8; i++)
+  {
+    if (crc & 0x8000)
+    {
+      crc = (crc << 1) ^ 0x1021;
+    }
+    else
+    {
+      crc <<= 1;
+    }
+  }
+  return crc;
+}
+
+#endif /* MOCK_UTIL_CRC16_H_ */
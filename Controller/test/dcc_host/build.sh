@@ -0,0 +1,25 @@
+#!/bin/bash
+# Builds dcc.c for the host against the mocked timer 4 in mock/ and runs the waveform checks, the benchmark
+# and the interrupt instruction count. The count of the old interrupt in baseline/ is printed first to compare.
+# Exits with the result of the checks.
+CC="gcc"
+SRC="dcc_host.c"
+SRC+=" isr_counter.c"
+SRC+=" mock/mock_avr.c"
+SRC+=" ../../src/dcc/dcc_packet.c"
+SRC+=" ../../src/dcc/dcc_refresh.c"
+SRC+=" ../../src/dcc/dcc_pom.c"
+SRC+=" ../../src/events.c"
+SRC+=" ../../src/timer.c"
+SRC+=" ../../src/gpio.c"
+INC="-Imock -I../../src -I../../include"
+OPTS="-std=gnu99 -O2 -Wall"
+OUT="dcc_host"
+BASELINE="baseline/dcc_shim.c"
+
+cd "$(dirname "$0")"
+mkdir -p ../../build
+${CC} ${OPTS} ${INC} -DDCC_HOST_BASELINE -o ../../build/${OUT}_baseline ${SRC} ${BASELINE} || exit 1
+${CC} ${OPTS} ${INC} -o ../../build/${OUT} ${SRC} ../../src/dcc/dcc.c || exit 1
+../../build/${OUT}_baseline
+../../build/${OUT}
@@ -0,0 +1,797 @@
+// Host build of the DCC waveform engine. dcc.c is compiled unchanged against mocked timer 4 registers,
+// the harness plays the part of the timer and records the compare values the interrupt leaves behind
+// for every period. That recording is turned back into a track voltage, decoded into bits and packets
+// and checked against what was queued and against the NMRA timing limits.
+//
+// Exits with 1 when a check fails, so it can be used as a gate for changes to the encoder and the interrupt.
+// It also counts the instructions the interrupt executes per bit, see isr_counter.h, and fails when an interrupt
+// takes more than the limits below. Built with DCC_HOST_BASELINE it only prints the counts of the interrupt in baseline/.
+
+#include "dcc/dcc.h"
+#include "dcc/dcc_railcom.h"
+#include "dcc/dcc_pom.h"
+#include "dcc/dcc_refresh.h"
+#include "dcc/dcc_service_mode.h"
+#include "dcc/current_sense.h"
+#include "events.h"
+#include "timer.h"
+#include "isr_counter.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TICKS_PER_US            (2)         // Timer 4 runs at 0.5 us per tick
+#define TICKS_PER_MS            (1000 * TICKS_PER_US)
+#define MAX_PERIODS             (100000)
+#define MAX_PACKETS             (4000)
+#define MAX_PACKET_SIZE         (32)
+#define QUEUE_FILL_DEPTH        (3)         // The feeder keeps this many packets queued, like a busy host
+
+// Nominal timing of this command station, every half period has to match it to the tick
+#define ONE_BIT_HALF_TICKS      (58 * TICKS_PER_US)
+#define ZERO_BIT_HALF_TICKS     (100 * TICKS_PER_US)
+#define CUTOUT_START_TICKS      (29 * TICKS_PER_US)
+#define CUTOUT_END_TICKS        (470 * TICKS_PER_US)
+#define NORMAL_PREAMBLE_LENGTH  (16)
+#define LONG_PREAMBLE_LENGTH    (22)
+
+// Limits from NMRA S-9.1 and S-9.3.2. The harness keeps its own copy, so a change in dcc.c cannot move both.
+#define SPEC_ONE_HALF_MIN       (55 * TICKS_PER_US)
+#define SPEC_ONE_HALF_MAX       (61 * TICKS_PER_US)
+#define SPEC_ZERO_HALF_MIN      (95 * TICKS_PER_US)
+#define SPEC_ZERO_HALF_MAX      (9900 * TICKS_PER_US)
+#define SPEC_CUTOUT_START_MIN   (26 * TICKS_PER_US)
+#define SPEC_CUTOUT_START_MAX   (32 * TICKS_PER_US)
+#define SPEC_CUTOUT_END_MIN     (454 * TICKS_PER_US)
+#define SPEC_CUTOUT_END_MAX     (488 * TICKS_PER_US)
+#define DECODER_MIN_PREAMBLE    (10)
+
+// Most host instructions one interrupt may execute, with some room for compiler versions. Raise them only when a change
+// really needs the time, the interrupt has to be done well before the shortest half bit ends.
+#define ISR_PLAIN_BIT_LIMIT     (80)
+#define ISR_BOUNDARY_LIMIT      (160)
+
+// One timer 4 period as the hardware ran it
+typedef struct
+{
+  uint16_t top;               // OCR4A
+  uint16_t compareB;          // OCR4B, non inverting: high from BOTTOM up to the match
+  uint16_t compareC;          // OCR4C, inverting: low from BOTTOM up to the match
+  bool enabled;               // Compare outputs connected
+  bool boundary;              // The interrupt at the start of this period posted a packet event
+  uint32_t isrInstructions;   // Host instructions the interrupt at the start of this period executed
+} period_t;
+
+typedef struct
+{
+  uint8_t size;
+  uint8_t preamble;           // 1 bits in front of the first start bit
+  uint8_t data[MAX_PACKET_SIZE];
+  uint64_t endTicks;          // End of the packet end bit
+} packet_t;
+
+typedef struct
+{
+  uint8_t minSize;
+  uint8_t maxSize;
+} packet_mix_t;
+
+typedef enum
+{
+  BIT_STATE_PREAMBLE,
+  BIT_STATE_DATA,
+  BIT_STATE_SEPARATOR,        // Start bit of the next byte or the packet end bit
+} bit_state_t;
+
+// Decoded track signal
+typedef struct
+{
+  uint32_t packetCount;
+  uint32_t errors;
+  uint16_t oneMin;
+  uint16_t oneMax;
+  uint16_t zeroMin;
+  uint16_t zeroMax;
+  uint8_t preambleMin;
+  uint8_t preambleMax;
+  uint32_t cutoutCount;
+  uint16_t cutoutStartMin;
+  uint16_t cutoutStartMax;
+  uint16_t cutoutEndMin;
+  uint16_t cutoutEndMax;
+} decode_result_t;
+
+// Simulation
+static period_t m_periods[MAX_PERIODS];
+static uint32_t m_periodCount;
+static uint64_t m_periodStartTicks;
+static uint32_t m_msTicks;
+static const packet_mix_t* m_mix;
+static dcc_mode_t m_mode;
+static uint32_t m_interruptErrors;
+static bool m_countInstructions;          // Single stepping is slow, only the work runs count the interrupt
+
+// What the feeder queued, in order
+static packet_t m_sent[MAX_PACKETS];
+static uint32_t m_sentCount;
+static uint32_t m_sentMatched;
+
+// RailCom calls from the interrupt
+static uint64_t m_cutoutStartCalls[MAX_PACKETS];
+static uint64_t m_cutoutEndCalls[MAX_PACKETS];
+static uint32_t m_cutoutStartCount;
+static uint32_t m_cutoutEndCount;
+
+// Decoder
+static decode_result_t m_result;
+static uint64_t m_trackTicks;
+static int8_t m_runLevel;
+static uint32_t m_runTicks;
+static uint32_t m_pendingHigh;
+static bit_state_t m_bitState;
+static uint8_t m_ones;
+static uint8_t m_bitCount;
+static packet_t m_packet;
+static bool m_afterPacketEnd;
+static uint32_t m_cutoutIndex;
+
+static uint32_t m_failures;
+
+static void check(bool condition, const char* what)
+{
+  if (!condition)
+  {
+    printf("  FAIL: %s\n", what);
+    m_failures++;
+  }
+}
+
+// Stubs for the modules dcc.c drives that have nothing to do with the waveform
+
+void dcc_service_mode_initialize(void)
+{
+}
+
+void current_sense_initialize(void)
+{
+}
+
+void current_sense_start(void)
+{
+}
+
+void current_sense_stop(void)
+{
+}
+
+void dcc_railcom_initialize(void)
+{
+}
+
+void dcc_railcom_on_cutout_start(uint8_t dccMessageId)
+{
+  if (m_cutoutStartCount < MAX_PACKETS)
+  {
+    m_cutoutStartCalls[m_cutoutStartCount++] = m_periodStartTicks;
+  }
+}
+
+void dcc_railcom_on_cutout_end(void)
+{
+  if (m_cutoutEndCount < MAX_PACKETS)
+  {
+    m_cutoutEndCalls[m_cutoutEndCount++] = m_periodStartTicks;
+  }
+}
+
+// Simulated timer 4
+
+static void latch_period(void)
+{
+  // The compare values written since the last BOTTOM are used for the period that starts now
+  period_t* period = &m_periods[m_periodCount++];
+  period->top = OCR4A;
+  period->compareB = OCR4B;
+  period->compareC = OCR4C;
+  period->enabled = (TCCR4A & ((1 << COM4B1) | (1 << COM4C1))) == ((1 << COM4B1) | (1 << COM4C1));
+  period->boundary = false;
+  period->isrInstructions = 0;
+}
+
+static void make_packet(packet_t* packet)
+{
+  // Accessory addresses keep the queue from coalescing packets, every packet has to come out as it went in
+  packet->size = m_mix->minSize + rand() % (m_mix->maxSize - m_mix->minSize + 1);
+  uint8_t checksum = 0;
+  for (uint8_t i = 0; i < packet->size - 1; i++)
+  {
+    packet->data[i] = (i == 0) ? (0x80 | (rand() & 0x3F)) : (rand() & 0xFF);
+    checksum ^= packet->data[i];
+  }
+  packet->data[packet->size - 1] = checksum;
+}
+
+static void feed(void)
+{
+  while ((m_sentCount < MAX_PACKETS) && (dcc_get_queue_depth() < QUEUE_FILL_DEPTH))
+  {
+    packet_t* packet = &m_sent[m_sentCount];
+    make_packet(packet);
+    if (!dcc_queue_data(&packet->data[0], packet->size, NULL))
+    {
+      break;
+    }
+    m_sentCount++;
+  }
+}
+
+// Does what the main loop does for the DCC engine
+static bool run_main_loop(void)
+{
+  bool posted = false;
+  message_t message;
+  while (event_get_message(&message))
+  {
+    posted = true;
+    if (message.id == MESSAGE_ID_DCC_TX_STARTED)
+    {
+      dcc_on_tx_started();
+    }
+    else if (message.id == MESSAGE_ID_DCC_TX_COMPLETED)
+    {
+      dcc_on_tx_completed();
+    }
+  }
+
+  while (m_msTicks >= TICKS_PER_MS)
+  {
+    m_msTicks -= TICKS_PER_MS;
+    timer_tick(1);
+  }
+
+  if (m_mix != NULL)
+  {
+    feed();
+  }
+  return posted;
+}
+
+static void sim_start(dcc_mode_t mode, bool railcom, const packet_mix_t* mix)
+{
+  m_periodCount = 0;
+  m_periodStartTicks = 0;
+  m_msTicks = 0;
+  m_mix = mix;
+  m_mode = mode;
+  m_interruptErrors = 0;
+  m_sentCount = 0;
+  m_sentMatched = 0;
+  m_cutoutStartCount = 0;
+  m_cutoutEndCount = 0;
+  srand(1);
+
+  message_t message;
+  while (event_get_message(&message))
+  {
+  }
+
+  timer_initialize();
+  dcc_initialize();
+  dcc_set_railcom_enabled(railcom);
+  dcc_start(mode);
+  run_main_loop();
+
+  // The first period runs with the values from dcc_initialize, the first overflow comes at its end
+  latch_period();
+}
+
+static void sim_run(uint32_t durationMs)
+{
+  uint64_t endTicks = m_periodStartTicks + (uint64_t)durationMs * TICKS_PER_MS;
+  while ((m_periodStartTicks < endTicks) && (m_periodCount < MAX_PERIODS))
+  {
+    // TOP of the running period: the next one starts with whatever the last interrupt wrote, and TOV4 fires
+    uint32_t length = m_periods[m_periodCount - 1].top + 1;
+    m_periodStartTicks += length;
+    m_msTicks += length;
+    latch_period();
+    period_t* period = &m_periods[m_periodCount - 1];
+
+    mock_interrupts_enabled = false;
+    if (m_countInstructions)
+    {
+      isr_counter_begin();
+      TIMER4_OVF_vect();
+      period->isrInstructions = isr_counter_end();
+    }
+    else
+    {
+      TIMER4_OVF_vect();
+    }
+    if (mock_interrupts_enabled)
+    {
+      // The interrupt turned the global interrupt flag on halfway through
+      m_interruptErrors++;
+    }
+    mock_interrupts_enabled = true;
+
+    period->boundary = run_main_loop();
+    if (!mock_interrupts_enabled)
+    {
+      m_interruptErrors++;
+      mock_interrupts_enabled = true;
+    }
+  }
+  dcc_stop();
+}
+
+// Decoder, fed with runs of constant track voltage
+
+static void decode_error(const char* what)
+{
+  if (m_result.errors++ < 5)
+  {
+    printf("  decode error at %.1f us: %s\n", (double)m_trackTicks / TICKS_PER_US, what);
+  }
+}
+
+static void on_packet(void)
+{
+  m_result.packetCount++;
+  m_packet.endTicks = m_trackTicks;
+  if (m_packet.preamble < m_result.preambleMin)
+  {
+    m_result.preambleMin = m_packet.preamble;
+  }
+  if (m_packet.preamble > m_result.preambleMax)
+  {
+    m_result.preambleMax = m_packet.preamble;
+  }
+
+  uint8_t checksum = 0;
+  for (uint8_t i = 0; i < m_packet.size; i++)
+  {
+    checksum ^= m_packet.data[i];
+  }
+  if ((m_packet.size < 3) || (checksum != 0))
+  {
+    decode_error("packet with a bad error detection byte");
+    return;
+  }
+
+  const packet_t* expected = (m_sentMatched < m_sentCount) ? &m_sent[m_sentMatched] : NULL;
+  if ((expected != NULL) && (expected->size == m_packet.size) && (memcmp(&expected->data[0], &m_packet.data[0], m_packet.size) == 0))
+  {
+    m_sentMatched++;
+    return;
+  }
+
+  // Idle and reset packets fill the gaps, anything else is a packet that was lost, reordered or changed
+  static const uint8_t idle[] = { 0xFF, 0x00, 0xFF };
+  static const uint8_t reset[] = { 0x00, 0x00, 0x00 };
+  if ((m_packet.size != 3) || ((memcmp(&m_packet.data[0], idle, 3) != 0) && (memcmp(&m_packet.data[0], reset, 3) != 0)))
+  {
+    decode_error("packet does not match the queued one");
+  }
+}
+
+static void on_bit(bool one)
+{
+  m_afterPacketEnd = false;
+
+  switch (m_bitState)
+  {
+  case BIT_STATE_PREAMBLE:
+    if (one)
+    {
+      m_ones += (m_ones < 255) ? 1 : 0;
+    }
+    else if (m_ones >= DECODER_MIN_PREAMBLE)
+    {
+      memset(&m_packet, 0, sizeof(m_packet));
+      m_packet.preamble = m_ones;
+      m_bitState = BIT_STATE_DATA;
+      m_bitCount = 0;
+    }
+    else
+    {
+      m_ones = 0;
+    }
+    break;
+  case BIT_STATE_DATA:
+    m_packet.data[m_packet.size] = (m_packet.data[m_packet.size] << 1) | one;
+    if (++m_bitCount == 8)
+    {
+      m_packet.size++;
+      m_bitState = BIT_STATE_SEPARATOR;
+    }
+    break;
+  case BIT_STATE_SEPARATOR:
+    if (one)
+    {
+      on_packet();
+      m_afterPacketEnd = true;
+      m_bitState = BIT_STATE_PREAMBLE;
+      m_ones = 0;
+    }
+    else if (m_packet.size == MAX_PACKET_SIZE)
+    {
+      decode_error("packet too long");
+      m_bitState = BIT_STATE_PREAMBLE;
+      m_ones = 0;
+    }
+    else
+    {
+      m_bitState = BIT_STATE_DATA;
+      m_bitCount = 0;
+    }
+    break;
+  }
+}
+
+static void update_range(uint16_t value, uint16_t* minimum, uint16_t* maximum)
+{
+  *minimum = (value < *minimum) ? value : *minimum;
+  *maximum = (value > *maximum) ? value : *maximum;
+}
+
+static void on_cutout(uint32_t highTicks, uint32_t zeroTicks)
+{
+  uint64_t start = m_trackTicks - zeroTicks - highTicks;
+  m_result.cutoutCount++;
+  update_range(highTicks, &m_result.cutoutStartMin, &m_result.cutoutStartMax);
+  update_range(highTicks + zeroTicks, &m_result.cutoutEndMin, &m_result.cutoutEndMax);
+
+  if (!m_afterPacketEnd)
+  {
+    decode_error("cutout does not follow a packet end bit");
+  }
+
+  // The RailCom receiver has to be told when the track goes quiet and when it is driven again
+  uint32_t index = m_cutoutIndex++;
+  if ((index >= m_cutoutStartCount) || (index >= m_cutoutEndCount) ||
+      (m_cutoutStartCalls[index] != start) || (m_cutoutEndCalls[index] != start + highTicks + zeroTicks))
+  {
+    decode_error("RailCom cutout start or end call out of step with the track");
+  }
+
+  m_afterPacketEnd = false;
+  m_bitState = BIT_STATE_PREAMBLE;
+  m_ones = 0;
+}
+
+static void on_run(int8_t level, uint32_t ticks)
+{
+  m_trackTicks += ticks;
+
+  if (level == 2)
+  {
+    decode_error("both outputs high");
+    m_pendingHigh = 0;
+  }
+  else if (level > 0)
+  {
+    if (m_pendingHigh != 0)
+    {
+      decode_error("two positive halves in a row");
+    }
+    m_pendingHigh = ticks;
+  }
+  else if (level < 0)
+  {
+    if (m_pendingHigh == 0)
+    {
+      decode_error("negative half without a positive one");
+      return;
+    }
+
+    uint32_t high = m_pendingHigh;
+    m_pendingHigh = 0;
+    if ((high >= SPEC_ONE_HALF_MIN) && (high <= SPEC_ONE_HALF_MAX) && (ticks >= SPEC_ONE_HALF_MIN) && (ticks <= SPEC_ONE_HALF_MAX))
+    {
+      update_range(high, &m_result.oneMin, &m_result.oneMax);
+      update_range(ticks, &m_result.oneMin, &m_result.oneMax);
+      on_bit(true);
+    }
+    else if ((high >= SPEC_ZERO_HALF_MIN) && (high <= SPEC_ZERO_HALF_MAX) && (ticks >= SPEC_ZERO_HALF_MIN) && (ticks <= SPEC_ZERO_HALF_MAX))
+    {
+      update_range(high, &m_result.zeroMin, &m_result.zeroMax);
+      update_range(ticks, &m_result.zeroMin, &m_result.zeroMax);
+      on_bit(false);
+    }
+    else
+    {
+      char text[80];
+      snprintf(text, sizeof(text), "bit with halves of %.1f and %.1f us", (double)high / TICKS_PER_US, (double)ticks / TICKS_PER_US);
+      decode_error(text);
+    }
+  }
+  else if (m_pendingHigh != 0)
+  {
+    // Track driven for a moment after the packet end bit and then left alone
+    on_cutout(m_pendingHigh, ticks);
+    m_pendingHigh = 0;
+  }
+  else
+  {
+    decode_error("track not driven outside of a cutout");
+  }
+}
+
+static void add_level(int8_t level, uint32_t ticks)
+{
+  if (ticks == 0)
+  {
+    return;
+  }
+  if ((level != m_runLevel) && (m_runTicks != 0))
+  {
+    on_run(m_runLevel, m_runTicks);
+    m_runTicks = 0;
+  }
+  m_runLevel = level;
+  m_runTicks += ticks;
+}
+
+static void decode(void)
+{
+  memset(&m_result, 0, sizeof(m_result));
+  m_result.oneMin = m_result.zeroMin = m_result.cutoutStartMin = m_result.cutoutEndMin = UINT16_MAX;
+  m_result.preambleMin = UINT8_MAX;
+  m_trackTicks = 0;
+  m_runLevel = 0;
+  m_runTicks = 0;
+  m_pendingHigh = 0;
+  m_bitState = BIT_STATE_PREAMBLE;
+  m_ones = 0;
+  m_afterPacketEnd = false;
+  m_cutoutIndex = 0;
+
+  // The last period has not been run by the timer yet
+  for (uint32_t i = 0; i + 1 < m_periodCount; i++)
+  {
+    const period_t* period = &m_periods[i];
+    uint32_t length = period->top + 1;
+    if (!period->enabled)
+    {
+      add_level(0, length);
+      continue;
+    }
+
+    // Fast PWM: a compare value at or above TOP keeps the output where BOTTOM put it for the whole period
+    uint32_t highEnd = (period->compareB + 1u < length) ? period->compareB + 1u : length;
+    uint32_t lowEnd = (period->compareC + 1u < length) ? period->compareC + 1u : length;
+
+    // The track sees B - C, 2 marks both outputs high
+    uint32_t first = (highEnd < lowEnd) ? highEnd : lowEnd;
+    uint32_t second = (highEnd < lowEnd) ? lowEnd : highEnd;
+    add_level(1, first);
+    add_level((highEnd < lowEnd) ? 0 : 2, second - first);
+    add_level(-1, length - second);
+  }
+}
+
+static void report_timing(const char* name, uint8_t minimumPreamble, bool cutouts)
+{
+  printf("%s: %u periods, %u packets decoded, %u of %u queued packets matched\n",
+         name, m_periodCount, m_result.packetCount, m_sentMatched, m_sentCount);
+  printf("  1 bit halves %.1f to %.1f us, 0 bit halves %.1f to %.1f us, preambles %u to %u bits\n",
+         (double)m_result.oneMin / TICKS_PER_US, (double)m_result.oneMax / TICKS_PER_US,
+         (double)m_result.zeroMin / TICKS_PER_US, (double)m_result.zeroMax / TICKS_PER_US,
+         m_result.preambleMin, m_result.preambleMax);
+
+  check(m_result.errors == 0, "track signal decodes cleanly");
+  check(m_interruptErrors == 0, "interrupt flag is only changed with its state restored");
+  check(m_sentMatched + QUEUE_FILL_DEPTH + 1 >= m_sentCount, "every queued packet came out in order");
+  check((m_result.oneMin == ONE_BIT_HALF_TICKS) && (m_result.oneMax == ONE_BIT_HALF_TICKS), "1 bit half periods are 58 us");
+  check((m_result.zeroMin == ZERO_BIT_HALF_TICKS) && (m_result.zeroMax == ZERO_BIT_HALF_TICKS), "0 bit half periods are 100 us");
+  check(m_result.preambleMin >= minimumPreamble, "preamble length");
+
+  if (cutouts)
+  {
+    printf("  %u cutouts, start %.1f to %.1f us, end %.1f to %.1f us after the packet end bit\n", m_result.cutoutCount,
+           (double)m_result.cutoutStartMin / TICKS_PER_US, (double)m_result.cutoutStartMax / TICKS_PER_US,
+           (double)m_result.cutoutEndMin / TICKS_PER_US, (double)m_result.cutoutEndMax / TICKS_PER_US);
+    check(m_result.cutoutCount + 1 >= m_result.packetCount, "a cutout after every packet");
+    check((m_result.cutoutStartMin == CUTOUT_START_TICKS) && (m_result.cutoutStartMax == CUTOUT_START_TICKS), "cutout starts at 29 us");
+    check((m_result.cutoutEndMin == CUTOUT_END_TICKS) && (m_result.cutoutEndMax == CUTOUT_END_TICKS), "cutout ends at 470 us");
+    check((m_result.cutoutStartMin >= SPEC_CUTOUT_START_MIN) && (m_result.cutoutStartMax <= SPEC_CUTOUT_START_MAX), "cutout start within 26 to 32 us");
+    check((m_result.cutoutEndMin >= SPEC_CUTOUT_END_MIN) && (m_result.cutoutEndMax <= SPEC_CUTOUT_END_MAX), "cutout end within 454 to 488 us");
+  }
+  else
+  {
+    check(m_result.cutoutCount == 0, "no cutouts");
+  }
+}
+
+static void test_timing(const char* name, dcc_mode_t mode, bool railcom, uint8_t minimumPreamble)
+{
+  static const packet_mix_t mix = { 3, 6 };
+  sim_start(mode, railcom, &mix);
+  sim_run(2000);
+  decode();
+  report_timing(name, minimumPreamble, railcom && (mode == DCC_MODE_OPERATION));
+}
+
+// Calls that can be made with the interrupts off have to leave them off
+static void test_interrupt_state(void)
+{
+  dcc_statistics_t statistics;
+  mock_interrupts_enabled = false;
+  dcc_get_statistics(&statistics);
+  dcc_reset_statistics();
+  bool keptOff = !mock_interrupts_enabled;
+  mock_interrupts_enabled = true;
+
+  printf("Interrupt state\n");
+  check(keptOff, "statistics calls leave the interrupts off");
+}
+
+// Sends one CV write on the main track, the track queue refuses every other packet when full is set.
+// Returns how many packets it took to finish the operation.
+static uint32_t send_pom_write(bool full)
+{
+  dcc_packet_t packet;
+  dcc_packet_t next;
+  dcc_pom_initialize();
+  if (!dcc_packet_pom_write_cv(&packet, 3, 28, 0x55) || !dcc_pom_queue_packet(3, &packet))
+  {
+    return 0;
+  }
+
+  uint32_t queued = 0;
+  for (uint32_t i = 0; (i < 100) && dcc_pom_get_packet(&next, false); i++)
+  {
+    if (memcmp(&next, &packet, sizeof(packet)) != 0)
+    {
+      return 0;
+    }
+    if (!full || (i % 2 == 1))
+    {
+      dcc_pom_packet_queued(true);
+      queued++;
+    }
+  }
+  return (dcc_pom_get_queue_depth() == 0) ? queued : 0;
+}
+
+static void test_pom_repeats(void)
+{
+  uint32_t repeats = send_pom_write(false);
+
+  printf("Programming on main\n");
+  check(repeats != 0, "a CV write goes out and leaves the queue");
+  check(send_pom_write(true) == repeats, "a packet the track queue refused is offered again");
+}
+
+// A new decoder has changed speed and functions, the speed packet has to stay first until the track queue takes it
+static void test_refresh_retry(void)
+{
+  dcc_packet_t first;
+  dcc_packet_t again;
+  dcc_packet_t next;
+  dcc_refresh_initialize();
+  bool picked = dcc_refresh_set_speed(3, 10, true) && dcc_refresh_get_packet(&first) && dcc_refresh_get_packet(&again);
+  dcc_refresh_packet_queued();
+  picked = picked && dcc_refresh_get_packet(&next);
+
+  printf("Refresh\n");
+  check(picked && (memcmp(&first, &again, sizeof(first)) == 0), "a refresh packet the track queue refused is offered again");
+  check(picked && (memcmp(&first, &next, sizeof(first)) != 0), "the refresh moves on once the packet is queued");
+}
+
+static int compare_counts(const void* a, const void* b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Interrupt work per bit, split in plain bits and the bits where a packet ends or starts. These are x86 instructions,
+// the AVR needs more of them, but the counts move together when the interrupt changes.
+static void report_isr_work(bool limited)
+{
+  static uint32_t samples[2][MAX_PERIODS];
+  uint32_t counts[2] = { 0, 0 };
+  uint64_t sums[2] = { 0, 0 };
+
+  for (uint32_t i = 1; i < m_periodCount; i++)
+  {
+    uint8_t kind = m_periods[i].boundary ? 1 : 0;
+    samples[kind][counts[kind]++] = m_periods[i].isrInstructions;
+    sums[kind] += m_periods[i].isrInstructions;
+  }
+
+  static const char* names[] = { "plain bits", "packet boundaries" };
+  static const uint32_t limits[] = { ISR_PLAIN_BIT_LIMIT, ISR_BOUNDARY_LIMIT };
+  for (uint8_t kind = 0; kind < 2; kind++)
+  {
+    if (counts[kind] == 0)
+    {
+      continue;
+    }
+    qsort(&samples[kind][0], counts[kind], sizeof(uint32_t), compare_counts);
+    printf("    ISR %-17s %6u calls, instructions mean %5.1f, median %3u, max %3u\n", names[kind], counts[kind],
+           (double)sums[kind] / counts[kind], samples[kind][counts[kind] / 2], samples[kind][counts[kind] - 1]);
+    if (limited && (samples[kind][counts[kind] - 1] > limits[kind]))
+    {
+      printf("  FAIL: the interrupt takes more than %u instructions on %s\n", limits[kind], names[kind]);
+      m_failures++;
+    }
+  }
+}
+
+static void benchmark(const char* name, uint8_t minSize, uint8_t maxSize, bool railcom)
+{
+  const uint32_t durationMs = 5000;
+  packet_mix_t mix = { minSize, maxSize };
+  sim_start(DCC_MODE_OPERATION, railcom, &mix);
+  sim_run(durationMs);
+  decode();
+
+  if ((m_result.errors != 0) || (m_sentMatched + QUEUE_FILL_DEPTH + 1 < m_sentCount))
+  {
+    printf("  %s: signal does not decode\n", name);
+    m_failures++;
+    return;
+  }
+
+  printf("  %-24s %7.1f packets/s\n", name, m_sentMatched * 1000.0 / durationMs);
+}
+
+static void isr_work(const char* name, bool railcom, bool limited)
+{
+  packet_mix_t mix = { 3, 6 };
+  m_countInstructions = true;
+  sim_start(DCC_MODE_OPERATION, railcom, &mix);
+  sim_run(1000);
+  m_countInstructions = false;
+
+  printf("  %s\n", name);
+  report_isr_work(limited);
+}
+
+int main(void)
+{
+  if (!isr_counter_attach())
+  {
+    printf("Can not trace this process, interrupt instruction counts are 0\n");
+  }
+
+#ifdef DCC_HOST_BASELINE
+  // The old interrupt has no cutout and its own queue, only its work is comparable
+  printf("Interrupt work per bit before, 3 to 6 byte packets:\n");
+  isr_work("Without RailCom", false, false);
+  return 0;
+#endif
+
+  test_timing("Operation mode", DCC_MODE_OPERATION, false, NORMAL_PREAMBLE_LENGTH);
+  test_timing("Service mode", DCC_MODE_SERVICE, false, LONG_PREAMBLE_LENGTH);
+  test_timing("Operation mode with RailCom", DCC_MODE_OPERATION, true, NORMAL_PREAMBLE_LENGTH);
+  test_timing("Service mode with RailCom enabled", DCC_MODE_SERVICE, true, LONG_PREAMBLE_LENGTH);
+  test_interrupt_state();
+  test_pom_repeats();
+  test_refresh_retry();
+
+  printf("Sustained throughput, queue kept %u deep:\n", QUEUE_FILL_DEPTH);
+  benchmark("3 byte packets", 3, 3, false);
+  benchmark("4 byte packets", 4, 4, false);
+  benchmark("6 byte packets", 6, 6, false);
+  benchmark("3 to 6 bytes", 3, 6, false);
+  benchmark("3 to 6 bytes, RailCom", 3, 6, true);
+
+  printf("Interrupt work per bit, 3 to 6 byte packets:\n");
+  isr_work("Without RailCom", false, true);
+  isr_work("With RailCom", true, true);
+
+  if (m_failures != 0)
+  {
+    printf("%u checks failed\n", m_failures);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}
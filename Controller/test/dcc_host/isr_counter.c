@@ -0,0 +1,112 @@
+#include "isr_counter.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+static bool m_attached;
+static volatile unsigned long m_count; // Written by the parent when a section is done, PTRACE_POKEDATA writes a whole word
+static uint32_t m_overhead;           // Instructions of an empty section
+
+#if defined(__x86_64__)
+
+static uint32_t count_section(pid_t child)
+{
+  // The child stopped on the breakpoint in isr_counter_begin, step it until it calls isr_counter_end
+  const unsigned long end = (unsigned long)&isr_counter_end;
+  uint32_t count = 0;
+  int status;
+  do
+  {
+    if ((ptrace(PTRACE_SINGLESTEP, child, NULL, NULL) != 0) || (waitpid(child, &status, 0) != child) || !WIFSTOPPED(status))
+    {
+      return 0;
+    }
+    count++;
+  } while ((unsigned long)ptrace(PTRACE_PEEKUSER, child, offsetof(struct user_regs_struct, rip), NULL) != end);
+
+  return count;
+}
+
+static int trace(pid_t child)
+{
+  int status;
+  while (waitpid(child, &status, 0) == child)
+  {
+    if (WIFEXITED(status))
+    {
+      return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status))
+    {
+      return 1;
+    }
+
+    int signal = WSTOPSIG(status);
+    if (signal == SIGTRAP)
+    {
+      ptrace(PTRACE_POKEDATA, child, (void*)&m_count, (void*)(unsigned long)count_section(child));
+      signal = 0;
+    }
+    ptrace(PTRACE_CONT, child, NULL, (void*)(long)signal);
+  }
+  return 1;
+}
+
+bool isr_counter_attach(void)
+{
+  fflush(stdout);
+  pid_t child = fork();
+  if (child < 0)
+  {
+    return false;
+  }
+
+  if (child != 0)
+  {
+    exit(trace(child));
+  }
+
+  if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+  {
+    return false;
+  }
+
+  m_attached = true;
+  isr_counter_begin();
+  m_overhead = isr_counter_end();
+  return true;
+}
+
+__attribute__((noinline)) void isr_counter_begin(void)
+{
+  if (m_attached)
+  {
+    __asm__ volatile ("int3");
+  }
+}
+
+#else
+
+bool isr_counter_attach(void)
+{
+  return false;
+}
+
+__attribute__((noinline)) void isr_counter_begin(void)
+{
+}
+
+#endif
+
+__attribute__((noinline)) uint32_t isr_counter_end(void)
+{
+  __asm__ volatile ("");
+  uint32_t count = (uint32_t)m_count;
+  m_count = 0;
+  return (count > m_overhead) ? count - m_overhead : 0;
+}
@@ -0,0 +1,19 @@
+#ifndef ISR_COUNTER_H_
+#define ISR_COUNTER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Counts the host instructions executed between isr_counter_begin and isr_counter_end. The process forks and the parent
+// single steps the child through every counted section with ptrace, so the counts do not depend on the load of the machine.
+
+// Call once at the start. Only the child returns, the parent exits with its exit code. Returns false when the
+// sections can not be counted, the program then runs on its own and isr_counter_end always returns 0.
+bool isr_counter_attach(void);
+
+void isr_counter_begin(void);
+
+// Instructions since isr_counter_begin, not including the calls of the counter itself
+uint32_t isr_counter_end(void);
+
+#endif /* ISR_COUNTER_H_ */
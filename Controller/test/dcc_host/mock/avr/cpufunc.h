@@ -0,0 +1,6 @@
+#ifndef MOCK_AVR_CPUFUNC_H_
+#define MOCK_AVR_CPUFUNC_H_
+
+#define _MemoryBarrier()    __asm__ __volatile__("" ::: "memory")
+
+#endif /* MOCK_AVR_CPUFUNC_H_ */
@@ -0,0 +1,25 @@
+#ifndef MOCK_AVR_INTERRUPT_H_
+#define MOCK_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+#include <stdbool.h>
+
+// Interrupt handlers become plain functions that the harness calls
+#define ISR(vector)   void vector(void)
+
+void TIMER4_OVF_vect(void);
+
+// Global interrupt flag, the harness checks it is set again whenever the code under test returns
+extern volatile bool mock_interrupts_enabled;
+
+static inline void cli(void)
+{
+  mock_interrupts_enabled = false;
+}
+
+static inline void sei(void)
+{
+  mock_interrupts_enabled = true;
+}
+
+#endif /* MOCK_AVR_INTERRUPT_H_ */
@@ -0,0 +1,39 @@
+#ifndef MOCK_AVR_IO_H_
+#define MOCK_AVR_IO_H_
+
+// Host stand-in for the ATmega2560 registers the DCC engine touches. They are plain variables,
+// the harness plays the part of timer 4 by reading the compare values after every interrupt.
+#include <stdint.h>
+
+extern volatile uint8_t TCCR4A;
+extern volatile uint8_t TCCR4B;
+extern volatile uint16_t OCR4A;
+extern volatile uint16_t OCR4B;
+extern volatile uint16_t OCR4C;
+extern volatile uint16_t TCNT4;
+extern volatile uint8_t TIMSK4;
+extern volatile uint8_t TIFR4;
+extern volatile uint8_t DDRH;
+
+// GPIO goes through the register file by address
+extern volatile uint8_t mock_sfr[0x200];
+#define _SFR_IO8(address)   (mock_sfr[(address)])
+#define _SFR_MEM8(address)  (mock_sfr[(address)])
+
+#define WGM40     (0)
+#define WGM41     (1)
+#define COM4C0    (2)
+#define COM4C1    (3)
+#define COM4B0    (4)
+#define COM4B1    (5)
+#define COM4A0    (6)
+#define COM4A1    (7)
+#define WGM42     (3)
+#define WGM43     (4)
+#define TOIE4     (0)
+#define TOV4      (0)
+#define DDH3      (3)
+#define DDH4      (4)
+#define DDH5      (5)
+
+#endif /* MOCK_AVR_IO_H_ */
@@ -0,0 +1,17 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+volatile uint8_t TCCR4A;
+volatile uint8_t TCCR4B;
+volatile uint16_t OCR4A;
+volatile uint16_t OCR4B;
+volatile uint16_t OCR4C;
+volatile uint16_t TCNT4;
+volatile uint8_t TIMSK4;
+volatile uint8_t TIFR4;
+volatile uint8_t DDRH;
+
+volatile uint8_t mock_sfr[0x200];
+
+volatile bool mock_interrupts_enabled = true;
+
@@ -0,0 +1,11 @@
+#ifndef MOCK_UTIL_ATOMIC_H_
+#define MOCK_UTIL_ATOMIC_H_
+
+#include <avr/interrupt.h>
+
+// Same behaviour as avr-libc: interrupts are off inside the block and the previous state comes back afterwards
+#define ATOMIC_RESTORESTATE   (0)
+#define ATOMIC_BLOCK(type)    for (bool __mock_restore = mock_interrupts_enabled, __mock_loop = (cli(), true); __mock_loop; \
+                                   mock_interrupts_enabled = __mock_restore, __mock_loop = false)
+
+#endif /* MOCK_UTIL_ATOMIC_H_ */